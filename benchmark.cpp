@@ -22,6 +22,25 @@ int main() {
 			((double)(after_insert - before_insert)/CLOCKS_PER_SEC*1000) << "ms" << endl;
 	}
 
+	// the same number of rows again, 50000 to a batch
+	cout << "Batch insertion:" << endl;
+	before_insert = clock();
+	for (long ii = 1000000; ii != 2000000; ii += 50000) {
+		long i;
+		vector<vector<DBData> > rows;
+		for (i = ii; i != ii + 50000; ++i) {
+			vector<DBData> line;
+			DBData dbd(DBType::INT64);
+			dbd.int64 = i;
+			line.push_back(dbd);
+			rows.push_back(line);
+		}
+		db.insertBatch("bmtable",rows);
+		clock_t after_insert = clock();
+		cout << "  " << i - 1000000 << " completed after " << 
+			((double)(after_insert - before_insert)/CLOCKS_PER_SEC*1000) << "ms" << endl;
+	}
+
 	cout << "Query:" << endl;
 	before_insert = clock();
 	for (long ii = 1; ii <= 1000000; ii += 50000) {
@@ -48,7 +67,7 @@ int main() {
 
 	cout << "Verifying" << endl;
 	bool success = true;
-	for (long i = 1; i <= 1000000; ++i) {
+	for (long i = 1; i <= 2000000; ++i) {
 		DBData dbd(DBType::INT64);
 		dbd.int64 = i;
 		RecordHandle handle = db.query("bmtable","id",dbd)[0];
@@ -7,40 +7,142 @@
 #define BPTREE_HPP
 
 #include <algorithm>
+#include <deque>
 #include <stack>
 #include <vector>
 #include <fstream>
 #include <string>
-#include <map>
 #include <cstring>
+#include <new>
+#include <cstdint>
 #include <cassert>
+#if defined(__AVX2__) || defined(__SSE4_2__)
+#include <immintrin.h>
+#endif
+#include "bufferpool.h"
 #include "diskfile.h"
 #include "kikutil.h"
+#include "slab.h"
+#include "wal.h"
 
-// NOTE if your change kBlockSize, change kMaxBPOrder correspondently
+// Block size of an index unless it is given one, and the size of the
+// header at the start of every index file
 const size_t kBlockSize = 4096;
 
+// How a posting list stores a value: its position (a FilePos) as a
+// zigzag varint delta from the previous one, then whatever else the value
+// carries. Plain positions carry nothing, specialize it for values with
+// a payload
+template <typename ValType>
+struct PostingCoding {
+	// most bytes written after the delta
+	static const size_t kMaxExtra = 0;
+
+	static int64_t position(const ValType &value) { return (int64_t)value; }
+	static void setPosition(ValType &value, int64_t pos) { value = pos; }
+	static char* writeExtra(char *dest, const ValType &) { return dest; }
+	static const char* readExtra(const char *src, ValType &) { return src; }
+};
+
+// Where key goes among the sorted keys of a node: the number of keys
+// smaller than it. Integer keys have a SIMD version when the target has
+// AVX2 or SSE4.2 (build with -mavx2 or -msse4.2), which halves the keys
+// down to kWindow without branches and counts the smaller ones among
+// those with vector compares
+template <typename KeyType>
+struct KeySearch {
+	static size_t lowerBound(const KeyType *keys, size_t count, const KeyType &key) {
+		return std::lower_bound(keys,keys + count,key) - keys;
+	}
+};
+
+#if defined(__AVX2__) || defined(__SSE4_2__)
+template <>
+struct KeySearch<int64_t> {
+	static const size_t kWindow = 16;
+
+	static size_t lowerBound(const int64_t *keys, size_t count, int64_t key) {
+		// every key before base is smaller than key
+		const int64_t *base = keys;
+		while (count > kWindow) {
+			size_t half = count / 2;
+			base = base[half] < key ? base + half : base;
+			count -= half;
+		}
+		size_t i = 0, smaller = 0;
+#ifdef __AVX2__
+		__m256i needle = _mm256_set1_epi64x(key);
+		for (; i + 4 <= count; i += 4) {
+			__m256i chunk = _mm256_loadu_si256((const __m256i*)(base + i));
+			__m256i less = _mm256_cmpgt_epi64(needle,chunk);
+			smaller += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(less)));
+		}
+#else
+		__m128i needle = _mm_set1_epi64x(key);
+		for (; i + 2 <= count; i += 2) {
+			__m128i chunk = _mm_loadu_si128((const __m128i*)(base + i));
+			__m128i less = _mm_cmpgt_epi64(needle,chunk);
+			smaller += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(less)));
+		}
+#endif
+		for (; i != count; ++i)
+			smaller += base[i] < key;
+		return (base - keys) + smaller;
+	}
+};
+
+template <>
+struct KeySearch<int32_t> {
+	static const size_t kWindow = 32;
+
+	static size_t lowerBound(const int32_t *keys, size_t count, int32_t key) {
+		const int32_t *base = keys;
+		while (count > kWindow) {
+			size_t half = count / 2;
+			base = base[half] < key ? base + half : base;
+			count -= half;
+		}
+		size_t i = 0, smaller = 0;
+#ifdef __AVX2__
+		__m256i needle = _mm256_set1_epi32(key);
+		for (; i + 8 <= count; i += 8) {
+			__m256i chunk = _mm256_loadu_si256((const __m256i*)(base + i));
+			__m256i less = _mm256_cmpgt_epi32(needle,chunk);
+			smaller += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(less)));
+		}
+#else
+		__m128i needle = _mm_set1_epi32(key);
+		for (; i + 4 <= count; i += 4) {
+			__m128i chunk = _mm_loadu_si128((const __m128i*)(base + i));
+			__m128i less = _mm_cmpgt_epi32(needle,chunk);
+			smaller += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(less)));
+		}
+#endif
+		for (; i != count; ++i)
+			smaller += base[i] < key;
+		return (base - keys) + smaller;
+	}
+};
+#endif
+
 // The BPTree class
 // Stores on disk file
 // Leafs are linked
+// Nodes are cached in a BufferPool, which may be shared among trees
 template <typename KeyType, typename ValType>
-class BPTree {
+class BPTree : public BufferPool::PageOwner {
 public:
 	// Order-related configuration
 
-	static const size_t kMaxBPOrder = 320;
 	size_t BPOrder;
 	size_t InnerNodePadding;
 	size_t LeafPadding;
 private:
 	size_t keysize_;
 	size_t valsize_;
-
-	// Cache configuration
-	static const size_t kMaxCachedNode = 10000;
 public:
 	// Base class for all nodes
-	struct Node {
+	struct Node : public BufferPool::Page {
 		// Number of KEYS in this node
 		// The number of children is slotuse+1
 		short slotuse;
@@ -49,7 +151,7 @@ public:
 		Node(const BPTree<KeyType,ValType> *context) : context_(context) {}
 
 		virtual ~Node() {}
-	private:
+	protected:
 		const BPTree<KeyType,ValType> *context_;
 	public:
 		bool isFull() {
@@ -58,21 +160,126 @@ public:
 	};
 
 	// Contains only array of data values
+	// The arrays hold BPOrder entries and follow the node in its chunk of
+	// the tree's slab, nodes are made by create(...) and deleted as usual
 	struct Leaf : public Node {
-		KeyType keys[kMaxBPOrder];
-		ValType data[kMaxBPOrder];
-		char overflowptr[kMaxBPOrder];
+		KeyType *keys;
+		ValType *data;
+		char *overflowptr;
 		// Leafs are linked
 		FilePos next_leaf;
-		Leaf(const BPTree<KeyType,ValType> *context) : Node(context) {}
-		~Leaf() {}
+		static Leaf* create(const BPTree<KeyType,ValType> *context) {
+			char *chunk = static_cast<char*>(context->leaf_slab_->allocate());
+			return new (chunk) Leaf(context,chunk);
+		}
+		static void operator delete(void *p) { Slab::release(p); }
+		~Leaf() {
+			destroy_array_(keys,this->context_->BPOrder);
+			destroy_array_(data,this->context_->BPOrder);
+		}
+	private:
+		Leaf(const BPTree<KeyType,ValType> *context, char *chunk) : Node(context), next_leaf(0) {
+			keys = construct_array_<KeyType>(chunk + context->leaf_keys_offset_,context->BPOrder);
+			data = construct_array_<ValType>(chunk + context->leaf_data_offset_,context->BPOrder);
+			overflowptr = chunk + context->leaf_overflow_offset_;
+			std::memset(overflowptr,0,context->BPOrder);
+		}
 	};
 
 	struct InnerNode : public Node {
-		KeyType keys[kMaxBPOrder];
-		FilePos children[kMaxBPOrder]; // Meaningless on leaf node
-		InnerNode(const BPTree<KeyType,ValType> *context) : Node(context) {}
-		~InnerNode() {}
+		KeyType *keys;
+		FilePos *children; // Meaningless on leaf node
+		static InnerNode* create(const BPTree<KeyType,ValType> *context) {
+			char *chunk = static_cast<char*>(context->inner_slab_->allocate());
+			return new (chunk) InnerNode(context,chunk);
+		}
+		static void operator delete(void *p) { Slab::release(p); }
+		~InnerNode() {
+			destroy_array_(keys,this->context_->BPOrder);
+		}
+	private:
+		InnerNode(const BPTree<KeyType,ValType> *context, char *chunk) : Node(context) {
+			keys = construct_array_<KeyType>(chunk + context->inner_keys_offset_,context->BPOrder);
+			children = construct_array_<FilePos>(chunk + context->inner_children_offset_,
+												 context->BPOrder);
+		}
+	};
+
+	// Block of a posting list, slotuse is the number of values
+	// The values of a duplicate key are appended to a chain of these,
+	// the first block knows the last one so that appending is O(1)
+	// The deltas follow the posting in its chunk, as many bytes as the
+	// block has after the header
+	struct Posting : public Node {
+		uint16_t used; // bytes of deltas
+		FilePos next;
+		FilePos tail; // first block only
+		int64_t last; // value the next delta is based on
+		char *deltas;
+		static Posting* create(const BPTree<KeyType,ValType> *context) {
+			char *chunk = static_cast<char*>(context->posting_slab_->allocate());
+			return new (chunk) Posting(context,chunk);
+		}
+		static void operator delete(void *p) { Slab::release(p); }
+		~Posting() {}
+		size_t capacity() const {
+			return this->context_->blocksize_ - IdxFile::kPostingHeaderSize;
+		}
+	private:
+		Posting(const BPTree<KeyType,ValType> *context, char *chunk)
+			: Node(context), used(0), next(0), tail(0), last(0),
+			  deltas(chunk + context->posting_deltas_offset_) {
+			this->slotuse = 0;
+			this->nodetype = IdxFile::POSTING;
+		}
+	};
+
+	// Read-only view of a node in place inside a mapped block
+	// Stands in for Leaf and InnerNode on the read paths in mapped mode
+	struct NodeView {
+		const BPTree<KeyType,ValType> *context;
+		const char *block;
+
+		char nodetype() const { return block[0]; }
+		short slotuse() const;
+		KeyType key(size_t i) const;
+		size_t find_lower(const KeyType &key) const;
+		// leaf only
+		ValType data(size_t i) const;
+		FilePos next_leaf() const;
+		char overflowptr(size_t i) const;
+		// inner node only
+		FilePos child(size_t i) const;
+		// prefixed nodes only: the prefix length, and the bytes right
+		// after the rests of the keys
+		const char* prefixed_keys() const;
+		const char* after_keys() const;
+	};
+
+	// Position of a range scan, see scan
+	// Plain values only, so a cursor may be kept between operations and
+	// copied to resume from a saved position. The leaf it stopped at is
+	// only trusted while the tree is unchanged, otherwise the scan goes
+	// on by descending to key again
+	struct Cursor {
+		KeyType first;
+		KeyType last;
+		bool descending; // from last down to first
+		bool started; // key and skip are set
+		bool done; // the whole range has been handed out
+		KeyType key; // key of the slot the scan is at
+		// values of key handed out already, descending scans count the
+		// ones left instead as new values of key are appended behind them
+		size_t skip;
+		FilePos leafpos;
+		// the slot read next, descending scans read index - 1
+		size_t index;
+		uint64_t version; // version_ when leafpos was saved
+		// inner nodes from the root down to leafpos and the child taken
+		// in each, leaves are linked forward only so a descending scan
+		// steps back to the previous leaf through them
+		std::vector<FilePos> path;
+		std::vector<size_t> path_index;
 	};
 
 private:
@@ -82,40 +289,244 @@ private:
 
 	std::string filename_;
 
-	std::map<FilePos, Node*> cache_;
+	// index file kept open for the lifetime of the tree
+	PosFile file_;
+
+	BufferPool *pool_;
+	// non-null when the tree was not given a pool and made its own
+	BufferPool *own_pool_;
+	// nodes pinned by the running operation
+	std::vector<FilePos> pinned_;
+
+	// mapped mode: the read paths look at the index file through this
+	// mapping instead of the buffer pool, nullptr otherwise
+	MappedFile *map_;
+
+	// Rightmost path cache: keys above max_key_ are appended to the
+	// rightmost leaf without descending from the root
+	// nodes from the root down to the rightmost leaf, empty if unknown
+	std::vector<FilePos> right_path_;
+	// a key in the rightmost leaf, the largest one seen there
+	KeyType max_key_;
+
+	// changes are logged to wal_ when it is not nullptr
+	Wal *wal_;
+	// nodes changed by the running operation, logged when it finishes
+	std::vector<FilePos> logged_;
+	// the root pointer in the header lags behind rootpos_: it is written
+	// with the pages, once the log covering the new root is durable
+	FilePos logged_rootpos_;
+	FilePos durable_rootpos_;
+	FilePos disk_rootpos_;
+	// updates of a mapped tree logged but not written through yet, the
+	// file is behind the pool until they are, see mapped_reads_
+	size_t unmapped_updates_;
+
+	// bumped by every update, tells cursors whether their leaf is valid
+	uint64_t version_;
+
+	// bytes of prefixed nodes before their keys: type, slotuse and, in
+	// leaves, next_leaf
+	static const size_t kPrefixedLeafHeader = 3 + sizeof(FilePos);
+	static const size_t kPrefixedInnerHeader = 3;
+
+	// bytes of a node on disk, see kBlockSizePos
+	size_t blocksize_;
+
+	// Leaf and InnerNode chunks, sized to BPOrder, Posting chunks to the
+	// block size, and where their arrays start inside a chunk
+	Slab *leaf_slab_;
+	Slab *inner_slab_;
+	Slab *posting_slab_;
+	size_t posting_deltas_offset_;
+	size_t leaf_keys_offset_;
+	size_t leaf_data_offset_;
+	size_t leaf_overflow_offset_;
+	size_t inner_keys_offset_;
+	size_t inner_children_offset_;
+
 	// Private helper member functions
 
-	void swapOutAllCache_(std::fstream &stream);
-	void insert_in_parent_(std::fstream &stream, std::stack<FilePos> parentpos, KeyType newkey, FilePos newnode_pos);
-	Node* load_node_(std::fstream &stream, FilePos nodepos);
-	Node* load_node_from_disk_(std::fstream &stream, FilePos nodepos) const;
-	void load_root_node_(std::fstream &stream);
-	void write_node_(std::fstream &stream, FilePos nodepos, Node* p);
-	void write_node_to_disk_(std::fstream &stream, FilePos nodepos, Node* p);
-	void create_empty_tree_(std::fstream &stream);
-	void create_new_root_(std::fstream &stream, KeyType newkey, FilePos lptr, FilePos rptr);
+	void unpin_all_();
+	// default-construct count objects of T at dest / destroy them, the
+	// arrays inside node chunks
+	template <typename T>
+	static T* construct_array_(char *dest, size_t count);
+	template <typename T>
+	static void destroy_array_(T *array, size_t count);
+	// memory charged to the buffer pool for a node
+	size_t footprint_(const Node *p) const;
+	// append is set when newnode_pos was split off the right edge of the
+	// tree, the node is then split 90/10 as well if it is full
+	void insert_in_parent_(std::stack<FilePos> parentpos, KeyType newkey, FilePos newnode_pos,
+						   bool append);
+	// where to split a full node of slotuse keys when key goes to
+	// newval_pos, the keys up to mid_pos stay in the old node
+	// Prefixed nodes are split by bytes rather than by keys, at a place
+	// where both halves fit
+	size_t split_pos_(const KeyType *keys, size_t slotuse, size_t newval_pos,
+					  const KeyType &key, bool append, bool leaf) const;
+	// whether key fits in the node at position pos
+	bool has_room_(const Leaf *leaf, size_t pos, const KeyType &key) const;
+	bool has_room_(const InnerNode *inner, size_t pos, const KeyType &key) const;
+	// Prefixed nodes (KeyBytes<KeyType>::kPrefixed)
+	// They store the prefix shared by their keys once, then the end of
+	// the rest of every key and the rests, instead of keys in slots
+	// the block bytes taken by a node of count sorted keys, key_at(i)
+	// being key i, with fixed bytes in all and per_key for every key
+	template <typename KeyAt>
+	size_t prefixed_size_(KeyAt key_at, size_t count, size_t fixed, size_t per_key) const;
+	// how many of the first count keys at key_at fit in a node
+	template <typename KeyAt>
+	size_t prefixed_fit_(KeyAt key_at, size_t count, size_t fixed, size_t per_key) const;
+	const char* decode_prefixed_keys_(const char *src, KeyType *keys, size_t count) const;
+	char* encode_prefixed_keys_(char *dest, const KeyType *keys, size_t count) const;
+	static size_t common_prefix_(const KeyType &lval, const KeyType &rval);
+	// the key parting a node from its right neighbour: the shortest one
+	// from left (the largest key of the node) up to but not including
+	// right (the smallest of the neighbour), left if keys are not
+	// prefixed
+	static KeyType separator_(const KeyType &left, const KeyType &right);
+	Node* load_node_(FilePos nodepos);
+	Node* load_node_from_disk_(FilePos nodepos) const;
+	// decode/encode count keys at src/dest inside a block, return the
+	// position right after them
+	const char* decode_keys_(const char *src, KeyType *keys, size_t count) const;
+	char* encode_keys_(char *dest, const KeyType *keys, size_t count) const;
+	void load_root_node_();
+	// write_node_(...) marks node dirty, a node not cached yet is
+	// handed over to the buffer pool
+	void write_node_(FilePos nodepos, Node* p);
+	void encode_node_(const Node *p, char *block) const;
+	void write_node_to_disk_(FilePos nodepos, Node* p);
+	// hand the nodes changed by the running operation over to wal_, they
+	// stay pinned until the operation is durable
+	void log_changes_();
+	// whether reads may look at the mapping rather than the pool
+	bool mapped_reads_() const { return map_ != nullptr && unmapped_updates_ == 0; }
+	// a block for a new node, see IdxFile::consumeFreeSpace
+	FilePos alloc_node_();
+	void create_empty_tree_();
+	void create_new_root_(KeyType newkey, FilePos lptr, FilePos rptr);
 	void initConfiguration_(size_t keysize, size_t valsize);
 	template <typename NodeWithKeys>
 	size_t find_lower_(NodeWithKeys *p, const KeyType &key) const;
 
 	// return true on success, fail if the leaf node is full
-	bool insert_in_leaf_(std::fstream &stream, Leaf *leaf_node, const KeyType &key, const ValType &value);
+	bool insert_in_leaf_(Leaf *leaf_node, const KeyType &key, const ValType &value);
+	// Posting list helpers
+	// a slot whose overflowptr is set holds the position of the first
+	// block of its list where the value goes
+	static FilePos posting_head_(const ValType &slot) {
+		return PostingCoding<ValType>::position(slot);
+	}
+	static void set_posting_head_(ValType &slot, FilePos head_pos) {
+		slot = ValType();
+		PostingCoding<ValType>::setPosition(slot,head_pos);
+	}
+	// append value to the block, fail if it does not fit
+	static bool push_posting_(Posting *p, const ValType &value);
+	// decode count values from deltas, appending them to retval
+	static void decode_postings_(const char *deltas, size_t count, std::vector<ValType> &retval);
+	// append value to the list starting at head
+	void append_posting_(FilePos head_pos, Posting *head, const ValType &value);
+	// append to a chain of overflow nodes left by an older version
+	void append_overflow_(FilePos overflow_pos, Leaf *overflow,
+						  const KeyType &key, const ValType &value);
+	// store value in place of the one with its position in block p of
+	// the list starting at head_pos, fail if p holds no such value
+	bool modify_posting_(FilePos head_pos, FilePos pos, Posting *p, const ValType &value);
+	// append the value(s) stored in slot i of leaf to retval, leaving
+	// out the first skip of them and stopping after count, return how
+	// many were appended
+	size_t collect_values_(const Leaf *leaf, size_t i, std::vector<ValType> &retval,
+						   size_t skip = 0, size_t count = SIZE_MAX);
+	// write the values of entries[first, last), which share one key,
+	// as a packed posting list, return its first block
+	FilePos bulk_load_overflow_(const std::vector<std::pair<KeyType,ValType> > &entries,
+								size_t first, size_t last);
+	// insert without releasing the nodes, see finish_update_
+	void insert_(const KeyType &key, const ValType &value);
+	// release the nodes after an update, logging or writing through
+	// the changes as needed
+	void finish_update_();
+
+	// Mapped mode helpers
+	NodeView view_node_(FilePos nodepos);
+	NodeView view_leaf_(const KeyType &key);
+	// same as collect_values_
+	size_t collect_view_values_(const NodeView &leaf, size_t i, std::vector<ValType> &retval,
+								size_t skip = 0, size_t count = SIZE_MAX);
+	std::vector<ValType> find_mapped_(const KeyType &key);
+	size_t scan_mapped_(Cursor &cursor, size_t count, std::vector<ValType> &retval);
+	// Cursor helpers, for both modes
+	// the leaf where key is or would be, the way down is kept in cursor
+	FilePos descend_(Cursor &cursor, const KeyType &key);
+	// the leaf before the one cursor's path leads to, 0 at the first one
+	FilePos prev_leaf_(Cursor &cursor);
+	// append up to count of the first left values to retval, from the
+	// back, and take them off left, return how many
+	static size_t collect_reversed_(const std::vector<ValType> &values, std::vector<ValType> &retval,
+									size_t &left, size_t count);
+	// values of a posting list block with count of them at deltas, as
+	// collect_values_ wants them
+	static size_t collect_postings_(const char *deltas, size_t count, std::vector<ValType> &retval,
+									size_t &skip, size_t want);
 public:
 	// Public methods
 
-	BPTree(const std::string &filename, size_t keysize = 0, size_t valsize = 0);
+	// mapped selects the mapped mode for read-mostly indexes: find and
+	// rangeFind read nodes straight from the mapped file, while insert
+	// writes its changes through to the file before returning
+	// wal makes insert log its changes, the caller commits them
+	// blocksize is the size of a node of a new index (kBlockSize if 0),
+	// an existing one keeps the size in its header
+	BPTree(const std::string &filename, size_t keysize = 0, size_t valsize = 0,
+		   BufferPool *pool = nullptr, bool mapped = false, Wal *wal = nullptr,
+		   size_t blocksize = 0);
 
 	~BPTree();
 
+	// BufferPool::PageOwner
+	void writeBackPage(FilePos pos, BufferPool::Page *page);
+
 	std::vector<ValType> find(const KeyType &key);
 
 	void insert(const KeyType &key, const ValType &value);
 
+	// insert many entries at once, entries are sorted by key (stable, so
+	// values of a duplicate key keep their order) and every leaf is
+	// descended to once for all the entries it receives
+	void insertBatch(std::vector<std::pair<KeyType,ValType> > entries);
+
+	// build the tree bottom-up from entries sorted by key, only on an
+	// empty tree: leaves and inner nodes are packed, every block is
+	// written once and the header points at the new root at last
+	void bulkLoad(const std::vector<std::pair<KeyType,ValType> > &entries);
+
 	bool erase(const KeyType &key);
 
+	// store new_value in place of the value of key with the same
+	// position, i.e. update what an entry carries besides its record,
+	// fail if key has no such value
 	bool modify(const KeyType &key, const ValType &new_value);
 
 	std::vector<ValType> rangeFind(const KeyType &first,const KeyType &last);
+
+	// a cursor over the values of the keys in [first, last], nothing is
+	// read until it is scanned
+	Cursor openCursor(const KeyType &first, const KeyType &last,
+					  bool descending = false) const;
+	// scan(...) appends up to count values of the range of cursor to
+	// retval, in the order of rangeFind (reversed if descending), and
+	// moves the cursor past them
+	// returns how many were appended, fewer than count only at the end
+	// Only the leaf being read is pinned, the scan may stop anywhere
+	// A descending scan decodes the whole posting list of a duplicate
+	// key to hand out its values from the back
+	size_t scan(Cursor &cursor, size_t count, std::vector<ValType> &retval);
+
+	size_t blockSize() const { return blocksize_; }
 };
 
 // Implementations of class BPTree
@@ -123,9 +534,67 @@ public:
 template <typename KeyType, typename ValType>
 BPTree<KeyType,ValType>::~BPTree() {
 
-	std::fstream file(filename_.c_str(), std::ios::in | std::ios::out |
-					  std::ios::binary);
-	swapOutAllCache_(file);
+	pool_->drop(this);
+	if (wal_ != nullptr && disk_rootpos_ != durable_rootpos_)
+		file_.writeAt(IdxFile::kRootPointerPos,durable_rootpos_);
+	delete own_pool_;
+	delete map_;
+	// every node went back to the slabs with the pages
+	delete leaf_slab_;
+	delete inner_slab_;
+	delete posting_slab_;
+}
+
+template <typename KeyType, typename ValType>
+void BPTree<KeyType,ValType>::
+		writeBackPage(FilePos pos, BufferPool::Page *page) {
+
+	// with a log, pages are only unpinned once the log has them on disk
+	if (wal_ != nullptr && disk_rootpos_ != durable_rootpos_) {
+		file_.writeAt(IdxFile::kRootPointerPos,durable_rootpos_);
+		disk_rootpos_ = durable_rootpos_;
+	}
+	write_node_to_disk_(pos,static_cast<Node*>(page));
+}
+
+template <typename KeyType, typename ValType>
+size_t BPTree<KeyType,ValType>::
+		footprint_(const Node *p) const {
+
+	if (p->nodetype == IdxFile::LEAF || p->nodetype == IdxFile::OVF)
+		return leaf_slab_->chunkSize();
+	if (p->nodetype == IdxFile::POSTING)
+		return posting_slab_->chunkSize();
+	return inner_slab_->chunkSize();
+}
+
+template <typename KeyType, typename ValType>
+template <typename T>
+T* BPTree<KeyType,ValType>::
+		construct_array_(char *dest, size_t count) {
+
+	T *array = reinterpret_cast<T*>(dest);
+	for (size_t i = 0; i != count; ++i)
+		new (array + i) T();
+	return array;
+}
+
+template <typename KeyType, typename ValType>
+template <typename T>
+void BPTree<KeyType,ValType>::
+		destroy_array_(T *array, size_t count) {
+
+	for (size_t i = 0; i != count; ++i)
+		array[i].~T();
+}
+
+template <typename KeyType, typename ValType>
+void BPTree<KeyType,ValType>::
+		unpin_all_() {
+
+	for (FilePos pos : pinned_)
+		pool_->unpin(this,pos);
+	pinned_.clear();
 }
 
 template <typename KeyType, typename ValType>
@@ -138,117 +607,164 @@ void BPTree<KeyType,ValType>::
 		valsize = sizeof(ValType);
 	keysize_ = keysize;
 	valsize_ = valsize;
-	BPOrder = (kBlockSize - 2 + keysize)/(keysize + valsize + 1);
-	InnerNodePadding = kBlockSize -
-			(BPOrder-1)*keysize - BPOrder*sizeof(FilePos) - 3;
-	LeafPadding = kBlockSize - (BPOrder-1)*keysize - (BPOrder-1)*valsize -
-			sizeof(FilePos) - (BPOrder-1) - 3;
+	if (KeyBytes<KeyType>::kPrefixed) {
+		// a key takes at least the two bytes of its end and a child or a
+		// value, the number of keys that fit depends on them. Splits
+		// rely on a few of the longest keys fitting in a node
+		assert(5*(2 + keysize + valsize + 1) <= blocksize_ - kPrefixedLeafHeader - 2);
+		assert(keysize < kBlockSize); // keys are put together in such a buffer
+		BPOrder = (blocksize_ - kPrefixedInnerHeader - 2)/(2 + sizeof(FilePos)) + 1;
+		InnerNodePadding = LeafPadding = 0;
+	} else {
+		BPOrder = (blocksize_ - 2 + keysize)/(keysize + valsize + 1);
+		InnerNodePadding = blocksize_ -
+				(BPOrder-1)*keysize - BPOrder*sizeof(FilePos) - 3;
+		LeafPadding = blocksize_ - (BPOrder-1)*keysize - (BPOrder-1)*valsize -
+				sizeof(FilePos) - (BPOrder-1) - 3;
+	}
+
+	// nodes in memory hold BPOrder keys of sizeof(KeyType), which is
+	// not keysize for string keys, right after the node itself
+	auto align = [](size_t offset, size_t alignment) {
+		return (offset + alignment - 1)/alignment*alignment;
+	};
+	leaf_keys_offset_ = align(sizeof(Leaf),alignof(KeyType));
+	leaf_data_offset_ = align(leaf_keys_offset_ + BPOrder*sizeof(KeyType),alignof(ValType));
+	leaf_overflow_offset_ = leaf_data_offset_ + BPOrder*sizeof(ValType);
+	leaf_slab_ = new Slab(leaf_overflow_offset_ + BPOrder);
+	inner_keys_offset_ = align(sizeof(InnerNode),alignof(KeyType));
+	inner_children_offset_ = align(inner_keys_offset_ + BPOrder*sizeof(KeyType),alignof(FilePos));
+	inner_slab_ = new Slab(inner_children_offset_ + BPOrder*sizeof(FilePos));
+	posting_deltas_offset_ = sizeof(Posting);
+	posting_slab_ = new Slab(posting_deltas_offset_ + blocksize_ - IdxFile::kPostingHeaderSize);
 }
 
 template <typename KeyType, typename ValType>
 BPTree<KeyType,ValType>::
-		BPTree(const std::string &filename,size_t keysize, size_t valsize)
-			: filename_(filename)
+		BPTree(const std::string &filename,size_t keysize, size_t valsize,
+			   BufferPool *pool, bool mapped, Wal *wal, size_t blocksize)
+			: filename_(filename), file_(filename), pool_(pool), own_pool_(nullptr),
+			  map_(nullptr), wal_(wal), unmapped_updates_(0), version_(0)
 {
 
 	// ASSERT
 	static_assert(sizeof(ValType) >= sizeof(FilePos),"ValType too short!");
 
+	// the nodes of a file are all as large as its header says
+	if (file_.size() != 0) {
+		int32_t size;
+		file_.readAt(IdxFile::kBlockSizePos,size);
+		assert(blocksize == 0 || blocksize == (size_t)size);
+		blocksize = size;
+	} else if (blocksize == 0) {
+		blocksize = kBlockSize;
+	}
+	// a power of two that the uint16 offsets inside a node can address
+	assert(blocksize >= 1024 && blocksize <= 65536 && (blocksize & (blocksize - 1)) == 0);
+	blocksize_ = blocksize;
+
 	initConfiguration_(keysize,valsize);
 
-	if (!fileExists(filename.c_str())) {
+	if (pool_ == nullptr) {
+		own_pool_ = new BufferPool();
+		pool_ = own_pool_;
+	}
+
+	if (file_.size() == 0) {
 		// empty file
-		std::fstream file(filename.c_str(), std::ios::out |
-					  std::ios::binary);
-		create_empty_tree_(file);
-		file.close();
+		create_empty_tree_();
 	}
+	// the nodes are laid out for one kind of keys only
+	char format;
+	file_.readAt(IdxFile::kKeyFormatPos,format);
+	assert(format == (KeyBytes<KeyType>::kPrefixed ? IdxFile::PREFIX_KEYS : IdxFile::SLOT_KEYS));
+	(void)format;
 
 	// load meta
-	std::fstream file(filename.c_str(), std::ios::in | std::ios::out |
-					  std::ios::binary);
-	load_root_node_(file);
-	file.close();
+	load_root_node_();
+	logged_rootpos_ = durable_rootpos_ = disk_rootpos_ = rootpos_;
+
+	if (mapped)
+		map_ = new MappedFile(filename);
 }
 
 template <typename KeyType, typename ValType>
 void BPTree<KeyType,ValType>::
-		load_root_node_(std::fstream &stream) {
+		load_root_node_() {
 
 	FilePos rootpos;
-	getFromPos(stream,IdxFile::kRootPointerPos,rootpos);
+	file_.readAt(IdxFile::kRootPointerPos,rootpos);
 	rootpos_ = rootpos;
 }
 
 template <typename KeyType, typename ValType>
-typename BPTree<KeyType,ValType>::Node* BPTree<KeyType,ValType>::
-		load_node_from_disk_(std::fstream &stream, FilePos nodepos) const {
+const char* BPTree<KeyType,ValType>::
+		decode_keys_(const char *src, KeyType *keys, size_t count) const {
 
-	Node *node;
-	// the first byte determines if node type is a leaf
-	char byte;
-	getFromPos(stream,nodepos,byte);
-	switch (byte) {
-	case IdxFile::LEAF:
-	case IdxFile::OVF: {
-		node = new Leaf(this);
-		Leaf *leaf = static_cast<Leaf*>(node);
-		binary_read(stream,node->slotuse);
-		for (size_t i = 0; i != BPOrder - 1; ++i)
-			binary_read(stream,leaf->keys[i]);
-		for (size_t i = 0; i != BPOrder - 1; ++i)
-			binary_read(stream,leaf->data[i]);
-		binary_read(stream,leaf->next_leaf);
-		for (size_t i = 0; i != BPOrder - 1; ++i)
-			binary_read(stream,leaf->overflowptr[i]);
-		break;
-	}
-	default: {
-		node = new InnerNode(this);
-		InnerNode *inner = static_cast<InnerNode*>(node);
-		binary_read(stream,node->slotuse);
-		for (size_t i = 0; i != BPOrder - 1; ++i)
-			binary_read(stream,inner->keys[i]);
-		for (size_t i = 0; i != BPOrder; ++i)
-			binary_read(stream,inner->children[i]);
-	}
-	}
-	node->nodetype = (IdxFile::NodeType)byte;
-	return node;
+	return block_read_keys(src,keys,count,keysize_);
 }
 
-// Specialization for string and FilePos
-template <>
-inline typename BPTree<std::string,FilePos>::Node* BPTree<std::string,FilePos>::
-		load_node_from_disk_(std::fstream &stream, FilePos nodepos) const {
+template <typename KeyType, typename ValType>
+char* BPTree<KeyType,ValType>::
+		encode_keys_(char *dest, const KeyType *keys, size_t count) const {
+
+	return block_write_keys(dest,keys,count,keysize_);
+}
+
+template <typename KeyType, typename ValType>
+typename BPTree<KeyType,ValType>::Node* BPTree<KeyType,ValType>::
+		load_node_from_disk_(FilePos nodepos) const {
 
 	Node *node;
+	// fetch the whole block with a single read and decode it in memory
+	std::vector<char> buffer(blocksize_);
+	char *block = buffer.data();
+	file_.read(nodepos,block,blocksize_);
+	const char *src = block;
 	// the first byte determines if node type is a leaf
 	char byte;
-	getFromPos(stream,nodepos,byte);
+	src = block_read(src,byte);
 	switch (byte) {
 	case IdxFile::LEAF:
 	case IdxFile::OVF: {
-		node = new Leaf(this);
+		node = Leaf::create(this);
 		Leaf *leaf = static_cast<Leaf*>(node);
-		binary_read(stream,node->slotuse);
-		for (size_t i = 0; i != BPOrder - 1; ++i)
-			binary_read_s(stream,leaf->keys[i],keysize_);
-		for (size_t i = 0; i != BPOrder - 1; ++i)
-			binary_read(stream,leaf->data[i]);
-		binary_read(stream,leaf->next_leaf);
-		for (size_t i = 0; i != BPOrder - 1; ++i)
-			binary_read(stream,leaf->overflowptr[i]);
+		src = block_read(src,node->slotuse);
+		if (KeyBytes<KeyType>::kPrefixed) {
+			src = block_read(src,leaf->next_leaf);
+			src = decode_prefixed_keys_(src,leaf->keys,node->slotuse);
+			src = block_read_array(src,leaf->data,node->slotuse);
+			src = block_read_array(src,leaf->overflowptr,node->slotuse);
+			break;
+		}
+		src = decode_keys_(src,leaf->keys,BPOrder - 1);
+		src = block_read_array(src,leaf->data,BPOrder - 1);
+		src = block_read(src,leaf->next_leaf);
+		src = block_read_array(src,leaf->overflowptr,BPOrder - 1);
+		break;
+	}
+	case IdxFile::POSTING: {
+		node = Posting::create(this);
+		Posting *posting = static_cast<Posting*>(node);
+		src = block_read(src,node->slotuse);
+		src = block_read(src,posting->used);
+		src = block_read(src,posting->next);
+		src = block_read(src,posting->tail);
+		src = block_read(src,posting->last);
+		std::memcpy(posting->deltas,src,posting->used);
 		break;
 	}
 	default: {
-		node = new InnerNode(this);
+		node = InnerNode::create(this);
 		InnerNode *inner = static_cast<InnerNode*>(node);
-		binary_read(stream,node->slotuse);
-		for (size_t i = 0; i != BPOrder - 1; ++i)
-			binary_read_s(stream,inner->keys[i],keysize_);
-		for (size_t i = 0; i != BPOrder; ++i)
-			binary_read(stream,inner->children[i]);
+		src = block_read(src,node->slotuse);
+		if (KeyBytes<KeyType>::kPrefixed) {
+			src = decode_prefixed_keys_(src,inner->keys,node->slotuse);
+			src = block_read_array(src,inner->children,node->slotuse + 1);
+			break;
+		}
+		src = decode_keys_(src,inner->keys,BPOrder - 1);
+		src = block_read_array(src,inner->children,BPOrder);
 	}
 	}
 	node->nodetype = (IdxFile::NodeType)byte;
@@ -257,32 +773,33 @@ inline typename BPTree<std::string,FilePos>::Node* BPTree<std::string,FilePos>::
 
 template <typename KeyType, typename ValType>
 typename BPTree<KeyType,ValType>::Node* BPTree<KeyType,ValType>::
-		load_node_(std::fstream &stream, FilePos nodepos) {
+		load_node_(FilePos nodepos) {
 
 	// found in cache
-	if (cache_.count(nodepos) > 0)
-		return cache_[nodepos];
-	if (cache_.size() == kMaxCachedNode) {
-		// swap out all cache
-		swapOutAllCache_(stream);
+	Node *node = static_cast<Node*>(pool_->fetch(this,nodepos));
+	if (node == nullptr) {
+		node = load_node_from_disk_(nodepos);
+		pool_->add(this,nodepos,node,footprint_(node),false);
 	}
-	cache_[nodepos] = load_node_from_disk_(stream,nodepos);
-	return cache_[nodepos];
+	// keep the node in memory until the operation finishes
+	pinned_.push_back(nodepos);
+	return node;
 }
 
 template <typename KeyType, typename ValType>
 std::vector<ValType> BPTree<KeyType,ValType>::
 		find(const KeyType &key) {
 
+	if (mapped_reads_())
+		return find_mapped_(key);
+	ON_SCOPE_EXIT([this]() { unpin_all_(); });
 	std::vector<ValType> retval;
-	std::fstream stream(filename_,std::ios::in | std::ios::out |
-						std::ios::binary);
-	Node *p = load_node_(stream,rootpos_);
+	Node *p = load_node_(rootpos_);
 	// Locate leaf or overflow node
 	while (p->nodetype == IdxFile::INNER) {
 		InnerNode *inner_node = static_cast<InnerNode*>(p);
 		size_t next_child_index = find_lower_(inner_node, key);
-		Node* newnode = load_node_(stream,inner_node->children[next_child_index]);
+		Node* newnode = load_node_(inner_node->children[next_child_index]);
 		p = newnode;
 	}
 	Leaf *leaf_node = static_cast<Leaf*>(p);
@@ -290,26 +807,8 @@ std::vector<ValType> BPTree<KeyType,ValType>::
 	// Find in that node
 	// Search in inner node, find correct children and continue the recursion
 	size_t data_index = find_lower_(leaf_node, key);
-	if (leaf_node->overflowptr[data_index] == true && leaf_node->keys[data_index] == key) {
-		// process duplicate key
-		Leaf *overflow = static_cast<Leaf*>(
-					load_node_(stream,leaf_node->data[data_index]));
-		while (true) {
-			for (size_t i = 0; i != overflow->slotuse; ++i)
-				retval.push_back(overflow->data[i]);
-			if (overflow->next_leaf == 0)
-				break;
-			else {
-				Leaf *next_overflow = static_cast<Leaf*>(
-							load_node_(stream,overflow->next_leaf));
-				//delete overflow;
-				overflow = next_overflow;
-			}
-		}
-		//delete overflow;
-	} else if (leaf_node->keys[data_index] == key)
-		// normal situation, determine if key is found and then add the key
-		retval.push_back(leaf_node->data[data_index]);
+	if (data_index < (size_t)leaf_node->slotuse && leaf_node->keys[data_index] == key)
+		collect_values_(leaf_node,data_index,retval);
 	return retval;
 }
 
@@ -326,83 +825,347 @@ size_t BPTree<KeyType,ValType>::
 	//return i;
 
 	// Binary search inside a node to find the place that is just smaller than or equal to key
-	return std::lower_bound(p->keys,p->keys + p->slotuse,key) - p->keys;
+	return KeySearch<KeyType>::lowerBound(p->keys,p->slotuse,key);
+}
+
+template <typename KeyType, typename ValType>
+void BPTree<KeyType,ValType>::
+		finish_update_() {
+
+	++version_;
+	if (wal_ != nullptr)
+		log_changes_();
+	else
+		unpin_all_();
+	// readers of a mapped tree look at the file, not at the pool
+	if (map_ != nullptr && wal_ != nullptr) {
+		// the update may only be written through once it is durable, the
+		// pool is read instead of the file until then
+		++unmapped_updates_;
+		wal_->afterDurable([this]() {
+			if (--unmapped_updates_ == 0) {
+				pool_->drop(this);
+				map_->refresh();
+			}
+		});
+	} else if (map_ != nullptr) {
+		// pick up the blocks added by the update now, a remap in the
+		// middle of a read would leave the views taken so far dangling
+		map_->refresh();
+		pool_->drop(this);
+	}
 }
 
 template <typename KeyType, typename ValType>
 void BPTree<KeyType,ValType>::
 		insert(const KeyType &key, const ValType &value) {
 
-	std::fstream stream(filename_.c_str(),std::ios::in | std::ios::out |
-						std::ios::binary);
-	// parent_trace includes leaf node
-	std::stack<FilePos> parent_trace;
-	parent_trace.push(rootpos_);
-	std::stack<size_t> index_trace;
-	Node *p = load_node_(stream,rootpos_);
-	while (p->nodetype == IdxFile::INNER) {
-		InnerNode *inner_node = static_cast<InnerNode*>(p);
-		size_t next_child_index = find_lower_(inner_node, key);
-		Node* newnode = load_node_(stream,inner_node->children[next_child_index]);
-		parent_trace.push(inner_node->children[next_child_index]);
-		p = newnode;
-		index_trace.push(next_child_index);
+	ON_SCOPE_EXIT([this]() { finish_update_(); });
+	insert_(key,value);
+}
+
+template <typename KeyType, typename ValType>
+void BPTree<KeyType,ValType>::
+		insertBatch(std::vector<std::pair<KeyType,ValType> > entries) {
+
+	ON_SCOPE_EXIT([this]() { finish_update_(); });
+	typedef std::pair<KeyType,ValType> Entry;
+	std::stable_sort(entries.begin(),entries.end(),
+			[](const Entry &lval, const Entry &rval) {
+				return lval.first < rval.first;
+			});
+	size_t i = 0;
+	while (i != entries.size()) {
+		// descend to the leaf of the next key, remembering the largest
+		// key that leaf may hold (the separator on the tightest level)
+		const KeyType &first = entries[i].first;
+		bool bounded = false;
+		KeyType upper = KeyType();
+		FilePos nodepos = rootpos_;
+		Node *p = load_node_(rootpos_);
+		while (p->nodetype == IdxFile::INNER) {
+			InnerNode *inner_node = static_cast<InnerNode*>(p);
+			size_t next_child_index = find_lower_(inner_node, first);
+			if (next_child_index < (size_t)inner_node->slotuse) {
+				upper = inner_node->keys[next_child_index];
+				bounded = true;
+			}
+			nodepos = inner_node->children[next_child_index];
+			p = load_node_(nodepos);
+		}
+		Leaf *leaf = static_cast<Leaf*>(p);
+		// fill the leaf with every entry that belongs to it
+		bool changed = false;
+		while (i != entries.size() && !(bounded && upper < entries[i].first) &&
+			   insert_in_leaf_(leaf,entries[i].first,entries[i].second)) {
+			changed = true;
+			++i;
+		}
+		if (changed)
+			write_node_(nodepos,leaf);
+		// the leaf is full, split it on the normal path
+		if (i != entries.size() && !(bounded && upper < entries[i].first)) {
+			insert_(entries[i].first,entries[i].second);
+			++i;
+		}
+		if (wal_ == nullptr)
+			unpin_all_(); // keep a long batch from pinning the whole tree
+	}
+}
+
+template <typename KeyType, typename ValType>
+void BPTree<KeyType,ValType>::
+		bulkLoad(const std::vector<std::pair<KeyType,ValType> > &entries) {
+
+	FilePos old_rootpos = rootpos_;
+	Node *root = load_node_(rootpos_);
+	assert(root->nodetype == IdxFile::LEAF && root->slotuse == 0);
+	(void)root;
+	unpin_all_();
+	// nodes are written straight to disk, nothing may linger in the pool
+	pool_->drop(this);
+	if (entries.empty())
+		return;
+
+	// Leaves hold one slot per distinct key, the first entry of each
+	// key is at starts
+	std::vector<size_t> starts(1,0);
+	for (size_t i = 1; i != entries.size(); ++i) {
+		assert(!(entries[i].first < entries[i - 1].first));
+		if (entries[i - 1].first < entries[i].first)
+			starts.push_back(i);
+	}
+	size_t groups = starts.size();
+	// nodes of the level being built and the separator between each and
+	// the next one, the largest key under it for keys that are not
+	// prefixed
+	std::vector<FilePos> level_pos;
+	std::vector<KeyType> level_sep;
+	size_t leaves = (groups + BPOrder - 2)/(BPOrder - 1);
+	// the empty root is left alone so that the old tree stays valid
+	// until the header is switched over
+	FilePos leafpos = IdxFile::consumeFreeSpace(file_,blocksize_);
+	size_t i = 0;
+	for (size_t n = 0, g = 0; g != groups; ++n) {
+		// spread the keys evenly, no leaf is left nearly empty, prefixed
+		// leaves are filled with as many keys as fit instead
+		size_t slots;
+		if (KeyBytes<KeyType>::kPrefixed)
+			slots = prefixed_fit_([&](size_t s) -> const KeyType& {
+						return entries[starts[g + s]].first;
+					},groups - g,kPrefixedLeafHeader,sizeof(ValType) + 1);
+		else
+			slots = groups/leaves + (n < groups%leaves ? 1 : 0);
+		g += slots;
+		Leaf *leaf = Leaf::create(this);
+		ON_SCOPE_EXIT([leaf]() { delete leaf; });
+		leaf->nodetype = IdxFile::LEAF;
+		leaf->slotuse = slots;
+		for (size_t s = 0; s != slots; ++s) {
+			size_t j = i + 1; // end of the entries with this key
+			while (j != entries.size() && !(entries[i].first < entries[j].first))
+				++j;
+			leaf->keys[s] = entries[i].first;
+			if (j - i == 1) {
+				leaf->data[s] = entries[i].second;
+			} else {
+				set_posting_head_(leaf->data[s],bulk_load_overflow_(entries,i,j));
+				leaf->overflowptr[s] = true;
+			}
+			i = j;
+		}
+		if (g != groups)
+			leaf->next_leaf = IdxFile::consumeFreeSpace(file_,blocksize_);
+		write_node_to_disk_(leafpos,leaf);
+		level_pos.push_back(leafpos);
+		level_sep.push_back(g != groups ? separator_(leaf->keys[slots - 1],entries[i].first) :
+							leaf->keys[slots - 1]);
+		leafpos = leaf->next_leaf;
+	}
+
+	// Inner levels, a node is parted from the next one by the separator
+	// after its last child
+	while (level_pos.size() > 1) {
+		std::vector<FilePos> upper_pos;
+		std::vector<KeyType> upper_sep;
+		size_t count = level_pos.size();
+		size_t nodes = (count + BPOrder - 1)/BPOrder;
+		size_t c = 0;
+		for (size_t n = 0; c != count; ++n) {
+			size_t children;
+			if (KeyBytes<KeyType>::kPrefixed) {
+				children = prefixed_fit_([&](size_t s) -> const KeyType& {
+							return level_sep[c + s];
+						},count - c - 1,kPrefixedInnerHeader + sizeof(FilePos),
+						sizeof(FilePos)) + 1;
+				// a last node of a single child is left a second one
+				if (count - c - children == 1 && children > 2)
+					--children;
+			} else
+				children = count/nodes + (n < count%nodes ? 1 : 0);
+			InnerNode *inner = InnerNode::create(this);
+			ON_SCOPE_EXIT([inner]() { delete inner; });
+			inner->nodetype = IdxFile::INNER;
+			inner->slotuse = children - 1;
+			for (size_t s = 0; s != children; ++s, ++c) {
+				inner->children[s] = level_pos[c];
+				if (s + 1 != children)
+					inner->keys[s] = level_sep[c];
+			}
+			FilePos innerpos = IdxFile::consumeFreeSpace(file_,blocksize_);
+			write_node_to_disk_(innerpos,inner);
+			upper_pos.push_back(innerpos);
+			upper_sep.push_back(level_sep[c - 1]);
+		}
+		level_pos.swap(upper_pos);
+		level_sep.swap(upper_sep);
+	}
+
+	// the new tree is on disk before the header points at it
+	file_.sync();
+	rootpos_ = level_pos[0];
+	file_.writeAt(IdxFile::kRootPointerPos,rootpos_);
+	file_.sync();
+	logged_rootpos_ = durable_rootpos_ = disk_rootpos_ = rootpos_;
+	right_path_.clear();
+	++version_;
+	if (map_ != nullptr)
+		map_->refresh();
+	// the old root is of no use anymore, a crash before this leaks it
+	IdxFile::releaseSpace(file_,old_rootpos);
+}
+
+template <typename KeyType, typename ValType>
+FilePos BPTree<KeyType,ValType>::
+		bulk_load_overflow_(const std::vector<std::pair<KeyType,ValType> > &entries,
+							size_t first, size_t last) {
+
+	FilePos head_pos = IdxFile::consumeFreeSpace(file_,blocksize_);
+	// the first block is written last, once the tail is known
+	Posting *head = Posting::create(this);
+	ON_SCOPE_EXIT([head]() { delete head; });
+	Posting *tail = head;
+	FilePos tail_pos = head_pos;
+	for (; first != last; ++first) {
+		if (push_posting_(tail,entries[first].second))
+			continue;
+		FilePos next_pos = IdxFile::consumeFreeSpace(file_,blocksize_);
+		tail->next = next_pos;
+		if (tail != head) {
+			write_node_to_disk_(tail_pos,tail);
+			delete tail;
+		}
+		tail = Posting::create(this);
+		tail_pos = next_pos;
+		push_posting_(tail,entries[first].second);
+	}
+	if (tail != head) {
+		write_node_to_disk_(tail_pos,tail);
+		delete tail;
+	}
+	head->tail = tail_pos;
+	write_node_to_disk_(head_pos,head);
+	return head_pos;
+}
+
+template <typename KeyType, typename ValType>
+void BPTree<KeyType,ValType>::
+		insert_(const KeyType &key, const ValType &value) {
+
+	// path includes leaf node
+	std::vector<FilePos> path;
+	Node *p;
+	bool rightmost = true;
+	if (!right_path_.empty() && max_key_ < key) {
+		// appending at the right edge, no need to descend
+		path = right_path_;
+		p = load_node_(path.back());
+	} else {
+		path.push_back(rootpos_);
+		p = load_node_(rootpos_);
+		while (p->nodetype == IdxFile::INNER) {
+			InnerNode *inner_node = static_cast<InnerNode*>(p);
+			size_t next_child_index = find_lower_(inner_node, key);
+			rightmost = rightmost && next_child_index == (size_t)inner_node->slotuse;
+			Node* newnode = load_node_(inner_node->children[next_child_index]);
+			path.push_back(inner_node->children[next_child_index]);
+			p = newnode;
+		}
 	}
 	Leaf *old_leaf = static_cast<Leaf*>(p);
-	FilePos nodepos = parent_trace.top();
+	FilePos nodepos = path.back();
 
-	if (insert_in_leaf_(stream,old_leaf,key,value)) {
-		write_node_(stream,nodepos,old_leaf);
+	if (insert_in_leaf_(old_leaf,key,value)) {
+		write_node_(nodepos,old_leaf);
+		if (rightmost) {
+			right_path_ = path;
+			max_key_ = old_leaf->keys[old_leaf->slotuse - 1];
+		}
 		return;
 	} else {
-		// split current node
+		// the right edge changes
+		right_path_.clear();
+		std::stack<FilePos> parent_trace(std::deque<FilePos>(path.begin(),path.end()));
+		// split current node, keys appended to the right edge leave the
+		// old leaf nearly full
 		size_t newval_pos = find_lower_(old_leaf, key);
-		size_t mid_pos = (old_leaf->slotuse - 1)/2;
-		KeyType midkey = old_leaf->keys[mid_pos]; // to be inserted to parent
-		Leaf *new_leaf = new Leaf(this);
+		bool append = old_leaf->next_leaf == 0 && newval_pos == (size_t)old_leaf->slotuse;
+		size_t slotuse = old_leaf->slotuse;
+		size_t mid_pos = split_pos_(old_leaf->keys,slotuse,newval_pos,key,append,true);
+		// to be inserted to parent, the largest key of the old leaf or a
+		// shorter one below the smallest of the new leaf
+		KeyType midkey = separator_(old_leaf->keys[mid_pos],
+				newval_pos == mid_pos + 1 ? key : old_leaf->keys[mid_pos + 1]);
+		Leaf *new_leaf = Leaf::create(this);
 		new_leaf->nodetype = IdxFile::LEAF;
 		if (newval_pos <= mid_pos) {
 			// new data to be placed in old leaf
 			// copy the larger part to the new leaf
-			new_leaf->slotuse = old_leaf->slotuse/2;
-			old_leaf->slotuse = (old_leaf->slotuse + 1)/2 + 1;
+			new_leaf->slotuse = slotuse - mid_pos - 1;
+			old_leaf->slotuse = mid_pos + 2;
 			size_t i;
-			for (i = mid_pos + 1; i != BPOrder - 1; ++i) {
+			for (i = mid_pos + 1; i != slotuse; ++i) {
 				new_leaf->keys[i - mid_pos - 1] = old_leaf->keys[i];
 				new_leaf->data[i - mid_pos - 1] = old_leaf->data[i];
+				new_leaf->overflowptr[i - mid_pos - 1] = old_leaf->overflowptr[i];
 			}
 			array_move(old_leaf->keys,BPOrder - 1,newval_pos,1);
 			array_move(old_leaf->data,BPOrder - 1,newval_pos,1);
+			array_move(old_leaf->overflowptr,BPOrder - 1,newval_pos,1);
 			old_leaf->keys[newval_pos] = key;
 			old_leaf->data[newval_pos] = value;
+			old_leaf->overflowptr[newval_pos] = false;
 		} else {
 			// new data to be placed in new leaf
-			new_leaf->slotuse = old_leaf->slotuse/2 + 1;
-			old_leaf->slotuse = (old_leaf->slotuse + 1)/2;
+			new_leaf->slotuse = slotuse - mid_pos;
+			old_leaf->slotuse = mid_pos + 1;
 			size_t i;
 			for (i = mid_pos + 1; i != newval_pos; ++i) {
 				new_leaf->keys[i - mid_pos - 1] = old_leaf->keys[i];
 				new_leaf->data[i - mid_pos - 1] = old_leaf->data[i];
+				new_leaf->overflowptr[i - mid_pos - 1] = old_leaf->overflowptr[i];
 			}
 			new_leaf->keys[i - mid_pos - 1] = key;
 			new_leaf->data[i - mid_pos - 1] = value;
-			for (; i != BPOrder - 1; ++i) {
+			new_leaf->overflowptr[i - mid_pos - 1] = false;
+			for (; i != slotuse; ++i) {
 				new_leaf->keys[i - mid_pos] = old_leaf->keys[i];
 				new_leaf->data[i - mid_pos] = old_leaf->data[i];
+				new_leaf->overflowptr[i - mid_pos] = old_leaf->overflowptr[i];
 			}
 		}
 		// write old leaf and new leaf
-		FilePos newnode_pos = IdxFile::consumeFreeSpace(stream);
+		FilePos newnode_pos = alloc_node_();
 		new_leaf->next_leaf = old_leaf->next_leaf;
 		old_leaf->next_leaf = newnode_pos;
-		write_node_(stream,nodepos,old_leaf);
-		write_node_(stream,newnode_pos,new_leaf);
+		write_node_(nodepos,old_leaf);
+		write_node_(newnode_pos,new_leaf);
 		//delete new_leaf;
 		if (nodepos == rootpos_) {
-			create_new_root_(stream,midkey,nodepos,newnode_pos);
+			create_new_root_(midkey,nodepos,newnode_pos);
 		} else {
 			parent_trace.pop(); // remove leaf node from parent_trace
-			insert_in_parent_(stream,parent_trace,midkey,newnode_pos);
+			insert_in_parent_(parent_trace,midkey,newnode_pos,append);
 		}
 
 	}
@@ -410,7 +1173,7 @@ void BPTree<KeyType,ValType>::
 
 template <typename KeyType, typename ValType>
 bool BPTree<KeyType,ValType>::
-		insert_in_leaf_(std::fstream &stream,Leaf *leaf_node, const KeyType &key, const ValType &value) {
+		insert_in_leaf_(Leaf *leaf_node, const KeyType &key, const ValType &value) {
 
 	bool duplicate = false;
 	size_t i;
@@ -425,177 +1188,582 @@ bool BPTree<KeyType,ValType>::
 	if (duplicate) {
 		// duplicate key
 		if (leaf_node->overflowptr[i] == true) {
-			// already has overflow node
-			// locate the last one and insert in it
-			Leaf *overflow = static_cast<Leaf*>(
-						load_node_(stream,leaf_node->data[i]));
-			FilePos overflow_pos = leaf_node->data[i];
-			while (overflow->next_leaf != 0) {
-				overflow_pos = overflow->next_leaf;
-				Leaf *next_overflow = static_cast<Leaf*>(
-							load_node_(stream,overflow->next_leaf));
-				//delete overflow;
-				overflow = next_overflow;
-			}
-			if (overflow->isFull()) {
-				// require new node
-				Leaf *new_overflow = new Leaf(this);
-				new_overflow->nodetype = IdxFile::OVF;
-				new_overflow->slotuse = 1;
-				new_overflow->keys[0] = key;
-				new_overflow->data[0] = value;
-				FilePos new_overflow_pos = IdxFile::consumeFreeSpace(stream);
-				overflow->next_leaf = new_overflow_pos;
-				write_node_(stream,new_overflow_pos,new_overflow);
-				//delete new_overflow;
-			} else {
-				overflow->keys[overflow->slotuse] = key;
-				overflow->data[overflow->slotuse] = value;
-				overflow->slotuse++;
-			}
-			write_node_(stream,overflow_pos,overflow); // write changes back
-			//delete overflow;
+			// already has a posting list
+			FilePos head_pos = posting_head_(leaf_node->data[i]);
+			Node *head = load_node_(head_pos);
+			if (head->nodetype == IdxFile::OVF)
+				append_overflow_(head_pos,static_cast<Leaf*>(head),key,value);
+			else
+				append_posting_(head_pos,static_cast<Posting*>(head),value);
 		} else {
-			// need to create overflow node
-			Leaf *new_overflow = new Leaf(this);
-			new_overflow->nodetype = IdxFile::OVF;
-			new_overflow->slotuse = 2;
-			new_overflow->keys[1] = key;
-			new_overflow->data[1] = value;
-			new_overflow->keys[0] = key;
-			new_overflow->data[0] = leaf_node->data[i];
-			FilePos new_overflow_pos = IdxFile::consumeFreeSpace(stream);
-			leaf_node->data[i] = new_overflow_pos;
+			// need to create a posting list
+			Posting *head = Posting::create(this);
+			push_posting_(head,leaf_node->data[i]);
+			push_posting_(head,value);
+			FilePos head_pos = alloc_node_();
+			head->tail = head_pos;
+			set_posting_head_(leaf_node->data[i],head_pos);
 			leaf_node->overflowptr[i] = true;
-			write_node_(stream,new_overflow_pos,new_overflow);
-			//delete new_overflow;
+			write_node_(head_pos,head);
 		}
 		return true;
-	} else if (leaf_node->isFull()) {
+	} else if (!has_room_(leaf_node,i,key)) {
 		return false; // need split
 	} else {
 		// normal situation
 		// move data backward
-		array_move(leaf_node->keys,BPOrder - 1,i,1);
-		array_move(leaf_node->data,BPOrder - 1,i,1);
+		array_move(leaf_node->keys,leaf_node->slotuse + 1,i,1);
+		array_move(leaf_node->data,leaf_node->slotuse + 1,i,1);
+		array_move(leaf_node->overflowptr,leaf_node->slotuse + 1,i,1);
 		// insert
 		leaf_node->keys[i] = key;
 		leaf_node->data[i] = value;
+		leaf_node->overflowptr[i] = false;
 		leaf_node->slotuse += 1;
 		return true;
 	}
 }
 
-// Specialization for string and filepos
-template <>
-inline void BPTree<std::string,FilePos>::
-		write_node_to_disk_(std::fstream &stream, FilePos nodepos, Node *p) {
+template <typename KeyType, typename ValType>
+bool BPTree<KeyType,ValType>::
+		push_posting_(Posting *p, const ValType &value) {
+
+	typedef PostingCoding<ValType> Coding;
+	// zigzag maps small negative deltas to small numbers as well
+	int64_t delta = Coding::position(value) - p->last;
+	char buffer[10 + Coding::kMaxExtra];
+	char *end = varint_write(buffer,((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+	end = Coding::writeExtra(end,value);
+	size_t length = end - buffer;
+	// slotuse is a short, which large blocks of one byte deltas outgrow
+	if (p->used + length > p->capacity() || p->slotuse == INT16_MAX)
+		return false;
+	std::memcpy(p->deltas + p->used,buffer,length);
+	p->used += length;
+	p->slotuse += 1;
+	p->last = Coding::position(value);
+	return true;
+}
 
-	char byte = p->nodetype;
-	writeToPos(stream,nodepos,byte);
-	binary_write(stream,p->slotuse);
-	switch (p->nodetype) {
-	case IdxFile::INNER:
-	case IdxFile::SINGLE: {
-		InnerNode* inner = static_cast<InnerNode*>(p);
-		for (size_t i = 0; i != BPOrder - 1; ++i)
-			binary_write_s(stream,inner->keys[i],keysize_);
-		for (size_t i = 0; i != BPOrder; ++i)
-			binary_write(stream,inner->children[i]);
-		// padding
-		byte = 0;
-		for (size_t i = 0; i != InnerNodePadding; ++i)
-			binary_write(stream,byte);
-		break;
+template <typename KeyType, typename ValType>
+void BPTree<KeyType,ValType>::
+		decode_postings_(const char *deltas, size_t count, std::vector<ValType> &retval) {
+
+	size_t base = retval.size();
+	retval.resize(base + count);
+	ValType *dest = retval.data() + base;
+	int64_t value = 0;
+	for (size_t i = 0; i != count; ++i) {
+		uint64_t zigzag = (unsigned char)*deltas;
+		if (zigzag < 0x80)
+			++deltas; // one byte deltas dominate dense lists
+		else
+			deltas = varint_read(deltas,zigzag);
+		value += (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+		PostingCoding<ValType>::setPosition(dest[i],value);
+		deltas = PostingCoding<ValType>::readExtra(deltas,dest[i]);
 	}
-	default: {
-		Leaf* leaf = static_cast<Leaf*>(p);
-		for (size_t i = 0; i != BPOrder - 1; ++i)
-			binary_write_s(stream,leaf->keys[i],keysize_);
-		for (size_t i = 0; i != BPOrder - 1; ++i)
-			binary_write(stream, leaf->data[i]);
-		binary_write(stream,leaf->next_leaf);
-		for (size_t i = 0; i != BPOrder - 1; ++i)
-			binary_write(stream, leaf->overflowptr[i]);
-		// padding
-		byte = 0;
-		for (size_t i = 0; i != LeafPadding; ++i)
-			binary_write(stream,byte);
-		break;
+}
+
+template <typename KeyType, typename ValType>
+void BPTree<KeyType,ValType>::
+		append_posting_(FilePos head_pos, Posting *head, const ValType &value) {
+
+	FilePos tail_pos = head->tail;
+	Posting *tail = head;
+	if (tail_pos != head_pos)
+		tail = static_cast<Posting*>(load_node_(tail_pos));
+	if (push_posting_(tail,value)) {
+		write_node_(tail_pos,tail);
+		return;
 	}
+	// the tail is full, start a new block
+	Posting *new_tail = Posting::create(this);
+	push_posting_(new_tail,value);
+	FilePos new_tail_pos = alloc_node_();
+	tail->next = new_tail_pos;
+	head->tail = new_tail_pos;
+	write_node_(new_tail_pos,new_tail);
+	write_node_(tail_pos,tail);
+	if (tail != head)
+		write_node_(head_pos,head);
+}
+
+template <typename KeyType, typename ValType>
+void BPTree<KeyType,ValType>::
+		append_overflow_(FilePos overflow_pos, Leaf *overflow,
+						 const KeyType &key, const ValType &value) {
+
+	// locate the last one and insert in it
+	while (overflow->next_leaf != 0) {
+		overflow_pos = overflow->next_leaf;
+		Leaf *next_overflow = static_cast<Leaf*>(
+					load_node_(overflow->next_leaf));
+		overflow = next_overflow;
 	}
+	if (overflow->isFull()) {
+		// require new node
+		Leaf *new_overflow = Leaf::create(this);
+		new_overflow->nodetype = IdxFile::OVF;
+		new_overflow->slotuse = 1;
+		new_overflow->keys[0] = key;
+		new_overflow->data[0] = value;
+		FilePos new_overflow_pos = alloc_node_();
+		overflow->next_leaf = new_overflow_pos;
+		write_node_(new_overflow_pos,new_overflow);
+	} else {
+		overflow->keys[overflow->slotuse] = key;
+		overflow->data[overflow->slotuse] = value;
+		overflow->slotuse++;
+	}
+	write_node_(overflow_pos,overflow); // write changes back
+}
+
+template <typename KeyType, typename ValType>
+bool BPTree<KeyType,ValType>::
+		modify_posting_(FilePos head_pos, FilePos pos, Posting *p, const ValType &value) {
+
+	typedef PostingCoding<ValType> Coding;
+	std::vector<ValType> values;
+	decode_postings_(p->deltas,p->slotuse,values);
+	size_t k = 0;
+	while (k != values.size() && Coding::position(values[k]) != Coding::position(value))
+		++k;
+	if (k == values.size())
+		return false;
+	values[k] = value;
+	// encode the block again, the new value may take more bytes
+	p->used = 0;
+	p->slotuse = 0;
+	p->last = 0;
+	size_t n = 0;
+	while (n != values.size() && push_posting_(p,values[n]))
+		++n;
+	if (n != values.size()) {
+		// the values left over fit in a new block right after this one
+		Posting *rest = Posting::create(this);
+		for (; n != values.size(); ++n) {
+			bool pushed = push_posting_(rest,values[n]);
+			assert(pushed);
+		}
+		FilePos rest_pos = alloc_node_();
+		rest->next = p->next;
+		p->next = rest_pos;
+		write_node_(rest_pos,rest);
+		Posting *head = static_cast<Posting*>(load_node_(head_pos));
+		if (head->tail == pos) {
+			head->tail = rest_pos;
+			if (head != p)
+				write_node_(head_pos,head);
+		}
+	}
+	write_node_(pos,p);
+	return true;
+}
+
+template <typename KeyType, typename ValType>
+size_t BPTree<KeyType,ValType>::
+		collect_postings_(const char *deltas, size_t count, std::vector<ValType> &retval,
+						  size_t &skip, size_t want) {
+
+	if (skip >= count) {
+		// the whole block has been handed out
+		skip -= count;
+		return 0;
+	}
+	size_t base = retval.size();
+	decode_postings_(deltas,count,retval);
+	retval.erase(retval.begin() + base,retval.begin() + base + skip);
+	if (retval.size() - base > want)
+		retval.resize(base + want);
+	skip = 0;
+	return retval.size() - base;
+}
+
+template <typename KeyType, typename ValType>
+size_t BPTree<KeyType,ValType>::
+		collect_values_(const Leaf *leaf, size_t i, std::vector<ValType> &retval,
+						size_t skip, size_t count) {
+
+	if (!leaf->overflowptr[i]) {
+		if (skip != 0 || count == 0)
+			return 0;
+		retval.push_back(leaf->data[i]);
+		return 1;
+	}
+	// duplicate key, walk through the posting list
+	size_t added = 0;
+	FilePos pos = posting_head_(leaf->data[i]);
+	while (pos != 0 && added != count) {
+		Node *p = load_node_(pos);
+		if (p->nodetype == IdxFile::OVF) {
+			Leaf *overflow = static_cast<Leaf*>(p);
+			if (skip >= (size_t)overflow->slotuse) {
+				skip -= overflow->slotuse;
+			} else {
+				size_t take = std::min(overflow->slotuse - skip,count - added);
+				retval.insert(retval.end(),overflow->data + skip,overflow->data + skip + take);
+				added += take;
+				skip = 0;
+			}
+			pos = overflow->next_leaf;
+		} else {
+			Posting *posting = static_cast<Posting*>(p);
+			added += collect_postings_(posting->deltas,posting->slotuse,retval,
+									   skip,count - added);
+			pos = posting->next;
+		}
+	}
+	return added;
 }
 
 template <typename KeyType, typename ValType>
 void BPTree<KeyType,ValType>::
-		write_node_to_disk_(std::fstream &stream, FilePos nodepos, Node *p) {
+		encode_node_(const Node *p, char *block) const {
 
+	// block is zero-filled by caller, which also serves as padding
+	char *dest = block;
 	char byte = p->nodetype;
-	writeToPos(stream,nodepos,byte);
-	binary_write(stream,p->slotuse);
+	dest = block_write(dest,byte);
+	dest = block_write(dest,p->slotuse);
 	switch (p->nodetype) {
 	case IdxFile::INNER:
 	case IdxFile::SINGLE: {
-		InnerNode *inner = static_cast<InnerNode*>(p);
-		for (size_t i = 0; i != BPOrder - 1; ++i)
-			binary_write(stream,inner->keys[i]);
-		for (size_t i = 0; i != BPOrder; ++i)
-			binary_write(stream,inner->children[i]);
-		// padding
-		byte = 0;
-		for (size_t i = 0; i != InnerNodePadding; ++i)
-			binary_write(stream,byte);
+		const InnerNode *inner = static_cast<const InnerNode*>(p);
+		if (KeyBytes<KeyType>::kPrefixed) {
+			dest = encode_prefixed_keys_(dest,inner->keys,p->slotuse);
+			dest = block_write_array(dest,inner->children,p->slotuse + 1);
+			break;
+		}
+		dest = encode_keys_(dest,inner->keys,BPOrder - 1);
+		dest = block_write_array(dest,inner->children,BPOrder);
+		break;
+	}
+	case IdxFile::POSTING: {
+		const Posting *posting = static_cast<const Posting*>(p);
+		dest = block_write(dest,posting->used);
+		dest = block_write(dest,posting->next);
+		dest = block_write(dest,posting->tail);
+		dest = block_write(dest,posting->last);
+		std::memcpy(dest,posting->deltas,posting->used);
+		dest += posting->used;
 		break;
 	}
 	default: {
-		Leaf *leaf = static_cast<Leaf*>(p);
-		for (size_t i = 0; i != BPOrder - 1; ++i)
-			binary_write(stream,leaf->keys[i]);
-		for (size_t i = 0; i != BPOrder - 1; ++i)
-			binary_write(stream, leaf->data[i]);
-		binary_write(stream,leaf->next_leaf);
-		for (size_t i = 0; i != BPOrder - 1; ++i)
-			binary_write(stream, leaf->overflowptr[i]);
-		// padding
-		byte = 0;
-		for (size_t i = 0; i != LeafPadding; ++i)
-			binary_write(stream,byte);
+		const Leaf *leaf = static_cast<const Leaf*>(p);
+		if (KeyBytes<KeyType>::kPrefixed) {
+			dest = block_write(dest,leaf->next_leaf);
+			dest = encode_prefixed_keys_(dest,leaf->keys,p->slotuse);
+			dest = block_write_array(dest,leaf->data,p->slotuse);
+			dest = block_write_array(dest,leaf->overflowptr,p->slotuse);
+			break;
+		}
+		dest = encode_keys_(dest,leaf->keys,BPOrder - 1);
+		dest = block_write_array(dest,leaf->data,BPOrder - 1);
+		dest = block_write(dest,leaf->next_leaf);
+		dest = block_write_array(dest,leaf->overflowptr,BPOrder - 1);
 		break;
 	}
 	}
+	assert(dest <= block + blocksize_);
 }
 
 template <typename KeyType, typename ValType>
 void BPTree<KeyType,ValType>::
-		write_node_(std::fstream &stream, FilePos nodepos, Node *p) {
+		write_node_to_disk_(FilePos nodepos, Node *p) {
 
-	if (cache_.count(nodepos) > 0) {
-		return; // no need to write to disk
-	} else
-		write_node_to_disk_(stream,nodepos,p);
+	// encode then write it out with a single positional write
+	std::vector<char> block(blocksize_);
+	encode_node_(p,block.data());
+	file_.write(nodepos,block.data(),blocksize_);
 }
 
 template <typename KeyType, typename ValType>
 void BPTree<KeyType,ValType>::
-		insert_in_parent_(std::fstream &stream, std::stack<FilePos> parentpos, KeyType newkey, FilePos newnode_pos) {
+		log_changes_() {
+
+	std::sort(logged_.begin(),logged_.end());
+	logged_.erase(std::unique(logged_.begin(),logged_.end()),logged_.end());
+	for (FilePos pos : logged_) {
+		// still pinned by the running operation
+		Node *p = static_cast<Node*>(pool_->fetch(this,pos));
+		assert(p != nullptr);
+		std::vector<char> block(blocksize_);
+		encode_node_(p,block.data());
+		wal_->append(filename_,pos,block.data(),blocksize_);
+		pool_->unpin(this,pos);
+	}
+	logged_.clear();
+	if (logged_rootpos_ != rootpos_) {
+		wal_->append(filename_,IdxFile::kRootPointerPos,&rootpos_,sizeof(rootpos_));
+		logged_rootpos_ = rootpos_;
+	}
+	std::vector<FilePos> pinned;
+	pinned.swap(pinned_);
+	FilePos rootpos = rootpos_;
+	wal_->afterDurable([this, pinned, rootpos]() {
+		for (FilePos pos : pinned)
+			pool_->unpin(this,pos);
+		durable_rootpos_ = rootpos;
+	});
+}
+
+template <typename KeyType, typename ValType>
+FilePos BPTree<KeyType,ValType>::
+		alloc_node_() {
+
+	FilePos head = 0;
+	if (wal_ != nullptr)
+		file_.readAt(IdxFile::kFlHeadPos,head);
+	FilePos nodepos = IdxFile::consumeFreeSpace(file_,blocksize_);
+	// A block taken off the free list is logged with its new head, or a
+	// replay would leave the block on the list while a node lives in it.
+	// The head written ahead of the log costs at most a leaked block.
+	// Extending the file is not logged: the block holds zeros until its
+	// node is written back, and replaying the node extends the file
+	if (head != 0) {
+		file_.readAt(IdxFile::kFlHeadPos,head);
+		wal_->append(filename_,IdxFile::kFlHeadPos,&head,sizeof(head));
+	}
+	return nodepos;
+}
+
+template <typename KeyType, typename ValType>
+void BPTree<KeyType,ValType>::
+		write_node_(FilePos nodepos, Node *p) {
+
+	BufferPool::Page *cached = pool_->fetch(this,nodepos);
+	if (cached != nullptr) {
+		// already cached, written back when evicted
+		assert(cached == p);
+		pool_->markDirty(this,nodepos);
+		pool_->unpin(this,nodepos);
+	} else {
+		pool_->add(this,nodepos,p,footprint_(p),true);
+		pinned_.push_back(nodepos);
+	}
+	if (wal_ != nullptr)
+		logged_.push_back(nodepos);
+}
+
+template <typename KeyType, typename ValType>
+size_t BPTree<KeyType,ValType>::
+		split_pos_(const KeyType *keys, size_t slotuse, size_t newval_pos,
+				   const KeyType &key, bool append, bool leaf) const {
+
+	// half split leaves sequentially filled nodes half empty forever,
+	// keep 90% of them in the old node when appending
+	if (!KeyBytes<KeyType>::kPrefixed) {
+		if (append)
+			return slotuse - 1 - slotuse/10;
+		return (slotuse - 1)/2;
+	}
+	// the node as it would be with key, n + 1 keys
+	size_t n = slotuse;
+	auto key_at = [&](size_t i) -> const KeyType& {
+		return i < newval_pos ? keys[i] : i == newval_pos ? key : keys[i - 1];
+	};
+	size_t fixed = leaf ? kPrefixedLeafHeader : kPrefixedInnerHeader + sizeof(FilePos);
+	size_t per_key = leaf ? sizeof(ValType) + 1 : sizeof(FilePos);
+	// lengths[i] is the length of the keys before key i
+	std::vector<size_t> lengths(n + 2,0);
+	for (size_t i = 0; i != n + 1; ++i)
+		lengths[i + 1] = lengths[i] + KeyBytes<KeyType>::length(key_at(i));
+	auto bytes = [&](size_t first, size_t last) {
+		size_t count = last - first;
+		size_t prefix = count == 0 ? 0 : common_prefix_(key_at(first),key_at(last - 1));
+		return fixed + 2 + prefix + count*(2 + per_key) +
+				(lengths[last] - lengths[first] - count*prefix);
+	};
+	// the old node keeps left keys, or left keys and left + 1 children
+	// with key left moving up from an inner node. Where key itself would
+	// be the last one kept, or move up, mid_pos cannot tell, any other
+	// place may do
+	int64_t share = append ? 9 : 5; // tenths of the bytes kept
+	size_t best = 0;
+	int64_t best_score = INT64_MAX;
+	for (size_t left = 1; left != n + (leaf ? 1 : 0); ++left) {
+		if (left == newval_pos + (leaf ? 1 : 0))
+			continue;
+		size_t left_bytes = bytes(0,left);
+		size_t right_bytes = leaf ? bytes(left,n + 1) : bytes(left + 1,n + 1);
+		if (left_bytes > blocksize_ || right_bytes > blocksize_)
+			continue;
+		int64_t score = (10 - share)*(int64_t)left_bytes - share*(int64_t)right_bytes;
+		score = score < 0 ? -score : score;
+		if (score < best_score) {
+			best = left;
+			best_score = score;
+		}
+	}
+	assert(best != 0);
+	if (leaf)
+		return best <= newval_pos ? best - 1 : best - 2;
+	return best < newval_pos ? best : best - 1;
+}
+
+template <typename KeyType, typename ValType>
+bool BPTree<KeyType,ValType>::
+		has_room_(const Leaf *leaf, size_t pos, const KeyType &key) const {
+
+	if (leaf->slotuse == (short)BPOrder - 1)
+		return false;
+	if (!KeyBytes<KeyType>::kPrefixed)
+		return true;
+	auto key_at = [&](size_t i) -> const KeyType& {
+		return i < pos ? leaf->keys[i] : i == pos ? key : leaf->keys[i - 1];
+	};
+	return prefixed_size_(key_at,leaf->slotuse + 1,kPrefixedLeafHeader,
+						  sizeof(ValType) + 1) <= blocksize_;
+}
+
+template <typename KeyType, typename ValType>
+bool BPTree<KeyType,ValType>::
+		has_room_(const InnerNode *inner, size_t pos, const KeyType &key) const {
+
+	if (inner->slotuse == (short)BPOrder - 1)
+		return false;
+	if (!KeyBytes<KeyType>::kPrefixed)
+		return true;
+	auto key_at = [&](size_t i) -> const KeyType& {
+		return i < pos ? inner->keys[i] : i == pos ? key : inner->keys[i - 1];
+	};
+	return prefixed_size_(key_at,inner->slotuse + 1,kPrefixedInnerHeader + sizeof(FilePos),
+						  sizeof(FilePos)) <= blocksize_;
+}
+
+template <typename KeyType, typename ValType>
+template <typename KeyAt>
+size_t BPTree<KeyType,ValType>::
+		prefixed_size_(KeyAt key_at, size_t count, size_t fixed, size_t per_key) const {
+
+	size_t prefix = count == 0 ? 0 : common_prefix_(key_at(0),key_at(count - 1));
+	size_t bytes = fixed + 2 + prefix + count*(2 + per_key);
+	for (size_t i = 0; i != count; ++i)
+		bytes += KeyBytes<KeyType>::length(key_at(i)) - prefix;
+	return bytes;
+}
+
+template <typename KeyType, typename ValType>
+template <typename KeyAt>
+size_t BPTree<KeyType,ValType>::
+		prefixed_fit_(KeyAt key_at, size_t count, size_t fixed, size_t per_key) const {
+
+	// keys are sorted, the prefix of the first and the last one is
+	// shared by all of them
+	size_t lengths = 0;
+	size_t n = 0;
+	for (; n != count && n != BPOrder - 1; ++n) {
+		size_t length = KeyBytes<KeyType>::length(key_at(n));
+		size_t prefix = common_prefix_(key_at(0),key_at(n));
+		size_t bytes = fixed + 2 + prefix + (n + 1)*(2 + per_key) +
+				(lengths + length - (n + 1)*prefix);
+		if (bytes > blocksize_)
+			break;
+		lengths += length;
+	}
+	return n;
+}
+
+template <typename KeyType, typename ValType>
+size_t BPTree<KeyType,ValType>::
+		common_prefix_(const KeyType &lval, const KeyType &rval) {
+
+	typedef KeyBytes<KeyType> Bytes;
+	size_t length = std::min(Bytes::length(lval),Bytes::length(rval));
+	const char *lbytes = Bytes::data(lval);
+	const char *rbytes = Bytes::data(rval);
+	size_t i = 0;
+	while (i != length && lbytes[i] == rbytes[i])
+		++i;
+	return i;
+}
+
+template <typename KeyType, typename ValType>
+KeyType BPTree<KeyType,ValType>::
+		separator_(const KeyType &left, const KeyType &right) {
+
+	if (!KeyBytes<KeyType>::kPrefixed)
+		return left;
+	// right cut after the first byte where it differs from left is still
+	// above left, and below right unless that is all of right
+	size_t length = common_prefix_(left,right) + 1;
+	if (length >= KeyBytes<KeyType>::length(right))
+		return left;
+	KeyType separator;
+	KeyBytes<KeyType>::assign(separator,KeyBytes<KeyType>::data(right),length);
+	return separator;
+}
+
+template <typename KeyType, typename ValType>
+const char* BPTree<KeyType,ValType>::
+		decode_prefixed_keys_(const char *src, KeyType *keys, size_t count) const {
+
+	uint16_t prefix;
+	src = block_read(src,prefix);
+	// every key is the prefix followed by its rest
+	char key[kBlockSize];
+	std::memcpy(key,src,prefix);
+	const char *ends = src + prefix;
+	const char *rests = ends + count*sizeof(uint16_t);
+	uint16_t begin = 0;
+	for (size_t i = 0; i != count; ++i) {
+		uint16_t end;
+		block_read(ends + i*sizeof(uint16_t),end);
+		std::memcpy(key + prefix,rests + begin,end - begin);
+		KeyBytes<KeyType>::assign(keys[i],key,prefix + end - begin);
+		begin = end;
+	}
+	return rests + begin;
+}
+
+template <typename KeyType, typename ValType>
+char* BPTree<KeyType,ValType>::
+		encode_prefixed_keys_(char *dest, const KeyType *keys, size_t count) const {
+
+	typedef KeyBytes<KeyType> Bytes;
+	uint16_t prefix = count == 0 ? 0 : common_prefix_(keys[0],keys[count - 1]);
+	dest = block_write(dest,prefix);
+	if (count != 0)
+		std::memcpy(dest,Bytes::data(keys[0]),prefix);
+	char *ends = dest + prefix;
+	char *rests = ends + count*sizeof(uint16_t);
+	uint16_t end = 0;
+	for (size_t i = 0; i != count; ++i) {
+		size_t length = Bytes::length(keys[i]) - prefix;
+		std::memcpy(rests + end,Bytes::data(keys[i]) + prefix,length);
+		end += length;
+		block_write(ends + i*sizeof(uint16_t),end);
+	}
+	return rests + end;
+}
+
+template <typename KeyType, typename ValType>
+void BPTree<KeyType,ValType>::
+		insert_in_parent_(std::stack<FilePos> parentpos, KeyType newkey, FilePos newnode_pos,
+						  bool append) {
 
 	FilePos nodepos = parentpos.top();
 	InnerNode *p;
-	p = static_cast<InnerNode*>(load_node_(stream, nodepos));
-	if (p->isFull()) {
+	p = static_cast<InnerNode*>(load_node_( nodepos));
+	size_t newval_pos = find_lower_(p, newkey);
+	if (!has_room_(p,newval_pos,newkey)) {
 		// split innernode
-		size_t newval_pos = find_lower_(p, newkey);
-		size_t mid_pos = (p->slotuse - 1)/2;
+		size_t slotuse = p->slotuse;
+		append = append && newval_pos == slotuse;
+		size_t mid_pos = split_pos_(p->keys,slotuse,newval_pos,newkey,append,false);
 		KeyType midkey = p->keys[mid_pos]; // to be inserted to parent
-		InnerNode *new_inner = new InnerNode(this);
+		InnerNode *new_inner = InnerNode::create(this);
 		new_inner->nodetype = IdxFile::INNER;
 		if (newval_pos <= mid_pos) {
 			// new data to be placed in old node
 			// copy the larger part to the new node
-			new_inner->slotuse = p->slotuse/2;
-			p->slotuse = (p->slotuse + 1)/2 + 1;
+			// midkey moves up, the old node keeps the keys before it
+			// and the new one
+			new_inner->slotuse = slotuse - mid_pos - 1;
+			p->slotuse = mid_pos + 1;
 			size_t i;
-			for (i = mid_pos + 1; i != BPOrder - 1; ++i) {
+			for (i = mid_pos + 1; i != slotuse; ++i) {
 				new_inner->keys[i - mid_pos - 1] = p->keys[i];
 				new_inner->children[i - mid_pos - 1] = p->children[i];
 			}
@@ -608,10 +1776,10 @@ void BPTree<KeyType,ValType>::
 
 		} else {
 			// new data to be placed in new node
-			new_inner->slotuse = p->slotuse/2 + 1;
-			p->slotuse = (p->slotuse + 1)/2;
+			new_inner->slotuse = slotuse - mid_pos;
+			p->slotuse = mid_pos;
 			size_t i;
-			for (i = mid_pos + 1; i != BPOrder - 1; ++i) {
+			for (i = mid_pos + 1; i != slotuse; ++i) {
 				new_inner->keys[i - mid_pos - 1] = p->keys[i];
 				new_inner->children[i - mid_pos - 1] = p->children[i];
 			}
@@ -622,142 +1790,588 @@ void BPTree<KeyType,ValType>::
 			new_inner->children[newval_pos - mid_pos] = newnode_pos;
 		}
 		// write old node and new node
-		FilePos newinner_pos = IdxFile::consumeFreeSpace(stream);
-		write_node_(stream,nodepos,p);
-		write_node_(stream,newinner_pos,new_inner);
+		FilePos newinner_pos = alloc_node_();
+		write_node_(nodepos,p);
+		write_node_(newinner_pos,new_inner);
 		//delete new_inner;
 		if (nodepos == rootpos_) {
-			create_new_root_(stream,midkey,nodepos,newinner_pos);
+			create_new_root_(midkey,nodepos,newinner_pos);
 		} else {
 			parentpos.pop(); // remove this node from parent_trace
-			insert_in_parent_(stream,parentpos,midkey,newinner_pos);
+			insert_in_parent_(parentpos,midkey,newinner_pos,append);
 		}
 
 	} else {
-		size_t newpos = find_lower_(p,newkey);
+		size_t newpos = newval_pos;
 		p->slotuse += 1;
 		array_move(p->keys,p->slotuse,newpos,1);
 		array_move(p->children,p->slotuse + 1,newpos,1);
 		p->keys[newpos] = newkey;
 		p->children[newpos + 1] = newnode_pos;
-		write_node_(stream,nodepos,p);
+		write_node_(nodepos,p);
 	}
 
 }
 
 template <typename KeyType, typename ValType>
 void BPTree<KeyType,ValType>::
-		create_new_root_(std::fstream &stream, KeyType newkey, FilePos lptr, FilePos rptr) {
+		create_new_root_(KeyType newkey, FilePos lptr, FilePos rptr) {
 
-	InnerNode *newroot = new InnerNode(this);
+	InnerNode *newroot = InnerNode::create(this);
 	newroot->slotuse = 1;
 	newroot->nodetype = IdxFile::INNER;
 	newroot->keys[0] = newkey;
 	newroot->children[0] = lptr;
 	newroot->children[1] = rptr;
-	FilePos rootpos = IdxFile::consumeFreeSpace(stream);
-	write_node_(stream,rootpos,newroot);
-	writeToPos(stream,IdxFile::kRootPointerPos,rootpos);
+	FilePos rootpos = alloc_node_();
+	write_node_(rootpos,newroot);
+	// with a log the header is written with the pages, see writeBackPage
+	if (wal_ == nullptr)
+		file_.writeAt(IdxFile::kRootPointerPos,rootpos);
 	rootpos_ = rootpos;
 }
 
 template <typename KeyType, typename ValType>
 void BPTree<KeyType,ValType>::
-		create_empty_tree_(std::fstream &stream) {
+		create_empty_tree_() {
 
-	stream.seekp(0);
 	FilePos pos = 0;
-	binary_write(stream,pos);
+	file_.writeAt(IdxFile::kFlHeadPos,pos);
 	int32_t size = sizeof(KeyType);
-	binary_write(stream,size);
+	file_.writeAt(IdxFile::kKeySizePos,size);
 	size = sizeof(ValType);
-	binary_write(stream,size);
-	size = kBlockSize;
-	binary_write(stream,size);
-	// root node pointer
-	pos = 4096;
-	binary_write(stream,pos);
-	Leaf* root = new Leaf(this);
+	file_.writeAt(IdxFile::kValSizePos,size);
+	size = blocksize_;
+	file_.writeAt(IdxFile::kBlockSizePos,size);
+	char format = KeyBytes<KeyType>::kPrefixed ? IdxFile::PREFIX_KEYS : IdxFile::SLOT_KEYS;
+	file_.writeAt(IdxFile::kKeyFormatPos,format);
+	// root node pointer, past the header and on a multiple of the block
+	// size, so that every node allocated after it is aligned too
+	pos = std::max((size_t)kBlockSize,blocksize_);
+	file_.writeAt(IdxFile::kRootPointerPos,pos);
+	Leaf* root = Leaf::create(this);
 	root->nodetype = IdxFile::LEAF;
 	root->slotuse = 0;
-	write_node_(stream,4096,root);
+	write_node_to_disk_(pos,root);
 	delete root;
 }
 
 template <typename KeyType, typename ValType>
-std::vector<ValType> BPTree<KeyType,ValType>::
-		rangeFind(const KeyType &first, const KeyType &last) {
+bool BPTree<KeyType,ValType>::
+		modify(const KeyType &key, const ValType &new_value) {
 
-	std::vector<ValType> retval;
-	std::fstream stream(filename_,std::ios::in | std::ios::out |
-						std::ios::binary);
-	Node *p = load_node_(stream,rootpos_);
-	// Locate leaf or overflow node
+	ON_SCOPE_EXIT([this]() { finish_update_(); });
+	FilePos nodepos = rootpos_;
+	Node *p = load_node_(rootpos_);
 	while (p->nodetype == IdxFile::INNER) {
 		InnerNode *inner_node = static_cast<InnerNode*>(p);
-		size_t next_child_index = find_lower_(inner_node, first);
-		Node* newnode = load_node_(stream,inner_node->children[next_child_index]);
-		p = newnode;
+		nodepos = inner_node->children[find_lower_(inner_node, key)];
+		p = load_node_(nodepos);
 	}
 	Leaf *leaf_node = static_cast<Leaf*>(p);
-	KeyType key = first;
+	size_t i = find_lower_(leaf_node, key);
+	if (i == (size_t)leaf_node->slotuse || !(leaf_node->keys[i] == key))
+		return false;
+	FilePos position = PostingCoding<ValType>::position(new_value);
+	if (!leaf_node->overflowptr[i]) {
+		if (PostingCoding<ValType>::position(leaf_node->data[i]) != position)
+			return false;
+		leaf_node->data[i] = new_value;
+		write_node_(nodepos,leaf_node);
+		return true;
+	}
+	// duplicate key, look for the value in the posting list
+	FilePos head_pos = posting_head_(leaf_node->data[i]);
+	FilePos pos = head_pos;
+	while (pos != 0) {
+		p = load_node_(pos);
+		if (p->nodetype == IdxFile::OVF) {
+			Leaf *overflow = static_cast<Leaf*>(p);
+			for (size_t k = 0; k != (size_t)overflow->slotuse; ++k) {
+				if (PostingCoding<ValType>::position(overflow->data[k]) == position) {
+					overflow->data[k] = new_value;
+					write_node_(pos,overflow);
+					return true;
+				}
+			}
+			pos = overflow->next_leaf;
+		} else {
+			Posting *posting = static_cast<Posting*>(p);
+			if (modify_posting_(head_pos,pos,posting,new_value))
+				return true;
+			pos = posting->next;
+		}
+	}
+	return false;
+}
 
-	// Find in that node
-	// Search in inner node, find correct children and continue the recursion
-	size_t data_index = find_lower_(leaf_node, key);
-	key = leaf_node->keys[data_index];
-	while (key <= last) {
-		if (leaf_node->overflowptr[data_index] && leaf_node->keys[data_index] == key) {
-			// process duplicate key
-			Leaf *overflow = static_cast<Leaf*>(
-						load_node_(stream,leaf_node->data[data_index]));
-			while (true) {
-				for (size_t i = 0; i != overflow->slotuse; ++i)
-					retval.push_back(overflow->data[i]);
-				if (overflow->next_leaf == 0)
+template <typename KeyType, typename ValType>
+std::vector<ValType> BPTree<KeyType,ValType>::
+		rangeFind(const KeyType &first, const KeyType &last) {
+
+	std::vector<ValType> retval;
+	Cursor cursor = openCursor(first,last);
+	scan(cursor,SIZE_MAX,retval);
+	return retval;
+}
+
+template <typename KeyType, typename ValType>
+typename BPTree<KeyType,ValType>::Cursor BPTree<KeyType,ValType>::
+		openCursor(const KeyType &first, const KeyType &last, bool descending) const {
+
+	Cursor cursor;
+	cursor.first = first;
+	cursor.last = last;
+	cursor.descending = descending;
+	cursor.started = false;
+	cursor.done = false;
+	cursor.key = KeyType();
+	cursor.skip = 0;
+	cursor.leafpos = 0;
+	cursor.index = 0;
+	cursor.version = 0;
+	return cursor;
+}
+
+template <typename KeyType, typename ValType>
+FilePos BPTree<KeyType,ValType>::
+		descend_(Cursor &cursor, const KeyType &key) {
+
+	cursor.path.clear();
+	cursor.path_index.clear();
+	FilePos nodepos = rootpos_;
+	while (true) {
+		size_t i;
+		FilePos child;
+		if (mapped_reads_()) {
+			NodeView p = view_node_(nodepos);
+			if (p.nodetype() != IdxFile::INNER)
+				break;
+			i = p.find_lower(key);
+			child = p.child(i);
+		} else {
+			Node *p = load_node_(nodepos);
+			if (p->nodetype != IdxFile::INNER)
+				break;
+			InnerNode *inner_node = static_cast<InnerNode*>(p);
+			i = find_lower_(inner_node, key);
+			child = inner_node->children[i];
+		}
+		cursor.path.push_back(nodepos);
+		cursor.path_index.push_back(i);
+		nodepos = child;
+	}
+	return nodepos;
+}
+
+template <typename KeyType, typename ValType>
+FilePos BPTree<KeyType,ValType>::
+		prev_leaf_(Cursor &cursor) {
+
+	// up to the lowest node with a child left of the path
+	while (!cursor.path.empty() && cursor.path_index.back() == 0) {
+		cursor.path.pop_back();
+		cursor.path_index.pop_back();
+	}
+	if (cursor.path.empty())
+		return 0;
+	size_t i = --cursor.path_index.back();
+	FilePos nodepos = cursor.path.back();
+	// then down the rightmost children
+	while (true) {
+		FilePos child;
+		char nodetype;
+		short slotuse;
+		if (mapped_reads_()) {
+			child = view_node_(nodepos).child(i);
+			NodeView p = view_node_(child);
+			nodetype = p.nodetype();
+			slotuse = p.slotuse();
+		} else {
+			child = static_cast<InnerNode*>(load_node_(nodepos))->children[i];
+			Node *p = load_node_(child);
+			nodetype = p->nodetype;
+			slotuse = p->slotuse;
+		}
+		if (nodetype != IdxFile::INNER)
+			return child;
+		i = slotuse;
+		cursor.path.push_back(child);
+		cursor.path_index.push_back(i);
+		nodepos = child;
+	}
+}
+
+template <typename KeyType, typename ValType>
+size_t BPTree<KeyType,ValType>::
+		collect_reversed_(const std::vector<ValType> &values, std::vector<ValType> &retval,
+						  size_t &left, size_t count) {
+
+	left = std::min(left,values.size());
+	size_t take = std::min(left,count);
+	for (size_t j = 0; j != take; ++j)
+		retval.push_back(values[left - 1 - j]);
+	left -= take;
+	return take;
+}
+
+template <typename KeyType, typename ValType>
+size_t BPTree<KeyType,ValType>::
+		scan(Cursor &cursor, size_t count, std::vector<ValType> &retval) {
+
+	if (cursor.done || count == 0)
+		return 0;
+	if (mapped_reads_())
+		return scan_mapped_(cursor,count,retval);
+	ON_SCOPE_EXIT([this]() { unpin_all_(); });
+	FilePos leafpos;
+	Leaf *leaf_node;
+	size_t data_index;
+	if (cursor.started && cursor.version == version_) {
+		// nothing has moved since the last scan
+		leafpos = cursor.leafpos;
+		leaf_node = static_cast<Leaf*>(load_node_(leafpos));
+		data_index = cursor.index;
+	} else {
+		// descend to the key the scan is at
+		const KeyType &key = cursor.started ? cursor.key :
+				cursor.descending ? cursor.last : cursor.first;
+		leafpos = descend_(cursor,key);
+		leaf_node = static_cast<Leaf*>(load_node_(leafpos));
+		data_index = find_lower_(leaf_node, key);
+		if (cursor.descending && data_index < (size_t)leaf_node->slotuse &&
+				leaf_node->keys[data_index] == key)
+			++data_index;
+	}
+	size_t added = 0;
+	while (added != count) {
+		size_t slot = data_index;
+		if (cursor.descending) {
+			if (data_index == 0) {
+				unpin_all_();
+				leafpos = prev_leaf_(cursor);
+				if (leafpos == 0) {
+					cursor.done = true;
 					break;
-				else {
-					Leaf *next_overflow = static_cast<Leaf*>(
-								load_node_(stream,overflow->next_leaf));
-					//delete overflow;
-					overflow = next_overflow;
 				}
+				leaf_node = static_cast<Leaf*>(load_node_(leafpos));
+				data_index = leaf_node->slotuse;
+				continue;
+			}
+			slot = data_index - 1;
+			if (leaf_node->keys[slot] < cursor.first) {
+				cursor.done = true;
+				break;
 			}
-			//delete overflow;
-		} else if (leaf_node->keys[data_index] == key) {
-			// normal situation, determine if key is found and then add the key
-			retval.push_back(leaf_node->data[data_index]);
-		}
-
-		// change leaf_node ptr and data_index
-		if (data_index + 1 >= leaf_node->slotuse && leaf_node->next_leaf != 0) {
-			Leaf *next_leaf = static_cast<Leaf*>(
-						load_node_(stream,leaf_node->next_leaf));
-			//delete leaf_node;
-			leaf_node = next_leaf;
-			p = next_leaf;
-			data_index = 0;
-			key = leaf_node->keys[data_index];
-		} else if (data_index + 1 >= leaf_node->slotuse && leaf_node->next_leaf == 0) {
-			break;
 		} else {
-			++data_index;
-			key = leaf_node->keys[data_index];
+			if (data_index >= (size_t)leaf_node->slotuse) {
+				// continue with the next leaf, slots past slotuse may hold
+				// stale entries left by a split
+				if (leaf_node->next_leaf == 0) {
+					cursor.done = true;
+					break;
+				}
+				leafpos = leaf_node->next_leaf;
+				unpin_all_();
+				leaf_node = static_cast<Leaf*>(load_node_(leafpos));
+				data_index = 0;
+				continue;
+			}
+			if (cursor.last < leaf_node->keys[slot]) {
+				cursor.done = true;
+				break;
+			}
+		}
+		if (!cursor.started || !(cursor.key == leaf_node->keys[slot])) {
+			cursor.started = true;
+			cursor.key = leaf_node->keys[slot];
+			cursor.skip = cursor.descending ? SIZE_MAX : 0;
+		}
+		size_t n;
+		if (cursor.descending) {
+			std::vector<ValType> values;
+			collect_values_(leaf_node,slot,values);
+			n = collect_reversed_(values,retval,cursor.skip,count - added);
+		} else {
+			n = collect_values_(leaf_node,slot,retval,cursor.skip,count - added);
+			cursor.skip += n;
 		}
+		added += n;
+		// the slot may have more values when the batch is full
+		if (added != count)
+			data_index = cursor.descending ? data_index - 1 : data_index + 1;
 	}
-	return retval;
+	cursor.leafpos = leafpos;
+	cursor.index = data_index;
+	cursor.version = version_;
+	return added;
 }
 
+// Implementations of mapped mode
 
 template <typename KeyType, typename ValType>
-void BPTree<KeyType,ValType>::
-			swapOutAllCache_(std::fstream &stream) {
+short BPTree<KeyType,ValType>::NodeView::
+		slotuse() const {
+
+	short slotuse;
+	block_read(block + 1,slotuse);
+	return slotuse;
+}
+
+template <typename KeyType, typename ValType>
+KeyType BPTree<KeyType,ValType>::NodeView::
+		key(size_t i) const {
+
+	KeyType key;
+	if (!KeyBytes<KeyType>::kPrefixed) {
+		context->decode_keys_(block + 3 + i*context->keysize_,&key,1);
+		return key;
+	}
+	const char *src = prefixed_keys();
+	uint16_t prefix, begin = 0, end;
+	src = block_read(src,prefix);
+	const char *ends = src + prefix;
+	if (i != 0)
+		block_read(ends + (i - 1)*sizeof(uint16_t),begin);
+	block_read(ends + i*sizeof(uint16_t),end);
+	const char *rests = ends + slotuse()*sizeof(uint16_t);
+	char bytes[kBlockSize];
+	std::memcpy(bytes,src,prefix);
+	std::memcpy(bytes + prefix,rests + begin,end - begin);
+	KeyBytes<KeyType>::assign(key,bytes,prefix + end - begin);
+	return key;
+}
+
+template <typename KeyType, typename ValType>
+const char* BPTree<KeyType,ValType>::NodeView::
+		prefixed_keys() const {
+
+	if (nodetype() == IdxFile::INNER)
+		return block + kPrefixedInnerHeader;
+	return block + kPrefixedLeafHeader;
+}
+
+template <typename KeyType, typename ValType>
+const char* BPTree<KeyType,ValType>::NodeView::
+		after_keys() const {
+
+	const char *src = prefixed_keys();
+	uint16_t prefix, end = 0;
+	src = block_read(src,prefix);
+	const char *ends = src + prefix;
+	size_t count = slotuse();
+	if (count != 0)
+		block_read(ends + (count - 1)*sizeof(uint16_t),end);
+	return ends + count*sizeof(uint16_t) + end;
+}
+
+template <typename KeyType, typename ValType>
+size_t BPTree<KeyType,ValType>::NodeView::
+		find_lower(const KeyType &key) const {
+
+	// Binary search, same as find_lower_ on a decoded node
+	size_t first = 0, count = slotuse();
+	while (count > 0) {
+		size_t step = count/2;
+		if (this->key(first + step) < key) {
+			first += step + 1;
+			count -= step + 1;
+		} else
+			count = step;
+	}
+	return first;
+}
+
+template <typename KeyType, typename ValType>
+ValType BPTree<KeyType,ValType>::NodeView::
+		data(size_t i) const {
+
+	ValType value;
+	if (KeyBytes<KeyType>::kPrefixed)
+		block_read(after_keys() + i*sizeof(ValType),value);
+	else
+		block_read(block + 3 + (context->BPOrder - 1)*context->keysize_ +
+				   i*sizeof(ValType),value);
+	return value;
+}
+
+template <typename KeyType, typename ValType>
+FilePos BPTree<KeyType,ValType>::NodeView::
+		next_leaf() const {
+
+	FilePos pos;
+	if (KeyBytes<KeyType>::kPrefixed)
+		block_read(block + 3,pos);
+	else
+		block_read(block + 3 + (context->BPOrder - 1)*(context->keysize_ + sizeof(ValType)),
+				   pos);
+	return pos;
+}
+
+template <typename KeyType, typename ValType>
+char BPTree<KeyType,ValType>::NodeView::
+		overflowptr(size_t i) const {
+
+	if (KeyBytes<KeyType>::kPrefixed)
+		return after_keys()[slotuse()*sizeof(ValType) + i];
+	return block[3 + (context->BPOrder - 1)*(context->keysize_ + sizeof(ValType)) +
+			sizeof(FilePos) + i];
+}
+
+template <typename KeyType, typename ValType>
+FilePos BPTree<KeyType,ValType>::NodeView::
+		child(size_t i) const {
+
+	FilePos pos;
+	if (KeyBytes<KeyType>::kPrefixed)
+		block_read(after_keys() + i*sizeof(FilePos),pos);
+	else
+		block_read(block + 3 + (context->BPOrder - 1)*context->keysize_ +
+				   i*sizeof(FilePos),pos);
+	return pos;
+}
 
-	for (auto &pair : cache_) {
-		write_node_to_disk_(stream,pair.first,pair.second);
-		delete pair.second;
+template <typename KeyType, typename ValType>
+typename BPTree<KeyType,ValType>::NodeView BPTree<KeyType,ValType>::
+		view_node_(FilePos nodepos) {
+
+	if (nodepos + (FilePos)blocksize_ > map_->size())
+		map_->refresh(); // the file has been extended through file_
+	NodeView view = {this, map_->at(nodepos)};
+	return view;
+}
+
+template <typename KeyType, typename ValType>
+typename BPTree<KeyType,ValType>::NodeView BPTree<KeyType,ValType>::
+		view_leaf_(const KeyType &key) {
+
+	NodeView p = view_node_(rootpos_);
+	while (p.nodetype() == IdxFile::INNER)
+		p = view_node_(p.child(p.find_lower(key)));
+	return p;
+}
+
+template <typename KeyType, typename ValType>
+size_t BPTree<KeyType,ValType>::
+		collect_view_values_(const NodeView &leaf, size_t i, std::vector<ValType> &retval,
+							 size_t skip, size_t count) {
+
+	if (!leaf.overflowptr(i)) {
+		if (skip != 0 || count == 0)
+			return 0;
+		retval.push_back(leaf.data(i));
+		return 1;
+	}
+	// duplicate key, walk through the posting list
+	size_t added = 0;
+	FilePos pos = posting_head_(leaf.data(i));
+	while (pos != 0 && added != count) {
+		NodeView p = view_node_(pos);
+		if (p.nodetype() == IdxFile::OVF) {
+			for (short j = 0; j != p.slotuse() && added != count; ++j) {
+				if (skip != 0) {
+					--skip;
+					continue;
+				}
+				retval.push_back(p.data(j));
+				++added;
+			}
+			pos = p.next_leaf();
+		} else {
+			added += collect_postings_(p.block + IdxFile::kPostingHeaderSize,p.slotuse(),
+									   retval,skip,count - added);
+			block_read(p.block + IdxFile::kPostingNextPos,pos);
+		}
+	}
+	return added;
+}
+
+template <typename KeyType, typename ValType>
+std::vector<ValType> BPTree<KeyType,ValType>::
+		find_mapped_(const KeyType &key) {
+
+	std::vector<ValType> retval;
+	NodeView leaf = view_leaf_(key);
+	size_t data_index = leaf.find_lower(key);
+	if (data_index < (size_t)leaf.slotuse() && leaf.key(data_index) == key)
+		collect_view_values_(leaf,data_index,retval);
+	return retval;
+}
+
+template <typename KeyType, typename ValType>
+size_t BPTree<KeyType,ValType>::
+		scan_mapped_(Cursor &cursor, size_t count, std::vector<ValType> &retval) {
+
+	FilePos leafpos;
+	NodeView leaf;
+	size_t data_index;
+	if (cursor.started && cursor.version == version_) {
+		leafpos = cursor.leafpos;
+		leaf = view_node_(leafpos);
+		data_index = cursor.index;
+	} else {
+		const KeyType &key = cursor.started ? cursor.key :
+				cursor.descending ? cursor.last : cursor.first;
+		leafpos = descend_(cursor,key);
+		leaf = view_node_(leafpos);
+		data_index = leaf.find_lower(key);
+		if (cursor.descending && data_index < (size_t)leaf.slotuse() &&
+				leaf.key(data_index) == key)
+			++data_index;
+	}
+	size_t added = 0;
+	while (added != count) {
+		size_t slot = data_index;
+		if (cursor.descending) {
+			if (data_index == 0) {
+				leafpos = prev_leaf_(cursor);
+				if (leafpos == 0) {
+					cursor.done = true;
+					break;
+				}
+				leaf = view_node_(leafpos);
+				data_index = leaf.slotuse();
+				continue;
+			}
+			slot = data_index - 1;
+		} else if (data_index >= (size_t)leaf.slotuse()) {
+			// continue with the next leaf
+			if (leaf.next_leaf() == 0) {
+				cursor.done = true;
+				break;
+			}
+			leafpos = leaf.next_leaf();
+			leaf = view_node_(leafpos);
+			data_index = 0;
+			continue;
+		}
+		KeyType key = leaf.key(slot);
+		if (cursor.descending ? key < cursor.first : cursor.last < key) {
+			cursor.done = true;
+			break;
+		}
+		if (!cursor.started || !(cursor.key == key)) {
+			cursor.started = true;
+			cursor.key = key;
+			cursor.skip = cursor.descending ? SIZE_MAX : 0;
+		}
+		size_t n;
+		if (cursor.descending) {
+			std::vector<ValType> values;
+			collect_view_values_(leaf,slot,values);
+			n = collect_reversed_(values,retval,cursor.skip,count - added);
+		} else {
+			n = collect_view_values_(leaf,slot,retval,cursor.skip,count - added);
+			cursor.skip += n;
+		}
+		added += n;
+		if (added != count)
+			data_index = cursor.descending ? data_index - 1 : data_index + 1;
 	}
-	cache_.clear();
+	cursor.leafpos = leafpos;
+	cursor.index = data_index;
+	cursor.version = version_;
+	return added;
 }
 
 #endif // BPTREE_HPP
@@ -0,0 +1,183 @@
+#include "bufferpool.h"
+#include <cassert>
+
+using namespace std;
+
+BufferPool::BufferPool(size_t budget)
+	: clock_hand_(0), flush_hand_(0), budget_(budget), usage_(0),
+	  dirty_percent_(kDefaultDirtyPercent), dirty_usage_(0)
+{  }
+
+BufferPool::~BufferPool() {
+	// owners are supposed to drop their pages before the pool dies
+	for (Frame &frame : frames_)
+		delete frame.page;
+}
+
+BufferPool::Frame& BufferPool::frameOf_(PageOwner *owner, FilePos pos) {
+	FrameKey key = {owner, pos};
+	return frames_[lookup_.at(key)];
+}
+
+BufferPool::Page* BufferPool::fetch(PageOwner *owner, FilePos pos) {
+	FrameKey key = {owner, pos};
+	auto iter = lookup_.find(key);
+	if (iter == lookup_.end())
+		return nullptr;
+	Frame &frame = frames_[iter->second];
+	frame.referenced = true;
+	++frame.pincount;
+	return frame.page;
+}
+
+void BufferPool::add(PageOwner *owner, FilePos pos, Page *page,
+					 size_t footprint, bool dirty) {
+	FrameKey key = {owner, pos};
+	assert(lookup_.count(key) == 0);
+	makeRoom_(footprint);
+	size_t index;
+	if (free_frames_.empty()) {
+		index = frames_.size();
+		frames_.push_back(Frame());
+	} else {
+		index = free_frames_.back();
+		free_frames_.pop_back();
+	}
+	Frame &frame = frames_[index];
+	frame.owner = owner;
+	frame.pos = pos;
+	frame.page = page;
+	frame.footprint = footprint;
+	frame.pincount = 1;
+	frame.dirty = dirty;
+	frame.referenced = true;
+	vector<size_t> &owned = owner_frames_[owner];
+	frame.owner_slot = owned.size();
+	owned.push_back(index);
+	lookup_[key] = index;
+	usage_ += footprint;
+	if (dirty) {
+		dirty_usage_ += footprint;
+		limitDirty_();
+	}
+}
+
+void BufferPool::unpin(PageOwner *owner, FilePos pos) {
+	Frame &frame = frameOf_(owner, pos);
+	assert(frame.pincount > 0);
+	--frame.pincount;
+}
+
+void BufferPool::markDirty(PageOwner *owner, FilePos pos) {
+	Frame &frame = frameOf_(owner, pos);
+	if (frame.dirty)
+		return;
+	frame.dirty = true;
+	dirty_usage_ += frame.footprint;
+	limitDirty_();
+}
+
+void BufferPool::flush(PageOwner *owner) {
+	auto iter = owner_frames_.find(owner);
+	if (iter == owner_frames_.end())
+		return;
+	for (size_t index : iter->second)
+		if (frames_[index].dirty)
+			writeBack_(frames_[index]);
+}
+
+void BufferPool::flushAll() {
+	for (Frame &frame : frames_)
+		if (frame.page != nullptr && frame.dirty)
+			writeBack_(frame);
+}
+
+void BufferPool::drop(PageOwner *owner) {
+	auto iter = owner_frames_.find(owner);
+	if (iter == owner_frames_.end())
+		return;
+	// evict_(...) takes the frame off the list
+	while (!iter->second.empty())
+		evict_(iter->second.back());
+	owner_frames_.erase(iter);
+}
+
+size_t BufferPool::writeBack(size_t count) {
+	return sweep_(count,0);
+}
+
+void BufferPool::setBudget(size_t budget) {
+	budget_ = budget;
+	makeRoom_(0);
+	limitDirty_();
+}
+
+void BufferPool::setDirtyPercent(size_t percent) {
+	assert(percent <= 100);
+	dirty_percent_ = percent;
+	limitDirty_();
+}
+
+void BufferPool::makeRoom_(size_t incoming) {
+	// every frame is visited at most twice: the first visit may only
+	// clear its reference bit
+	size_t steps = 2 * frames_.size();
+	while (usage_ + incoming > budget_ && steps-- > 0) {
+		if (clock_hand_ >= frames_.size())
+			clock_hand_ = 0;
+		Frame &frame = frames_[clock_hand_];
+		if (frame.page != nullptr && frame.pincount == 0) {
+			if (frame.referenced)
+				frame.referenced = false; // second chance
+			else
+				evict_(clock_hand_);
+		}
+		++clock_hand_;
+	}
+}
+
+void BufferPool::evict_(size_t frame_index) {
+	Frame &frame = frames_[frame_index];
+	assert(frame.pincount == 0);
+	if (frame.dirty)
+		writeBack_(frame);
+	delete frame.page;
+	FrameKey key = {frame.owner, frame.pos};
+	lookup_.erase(key);
+	// the last frame of the owner takes the place of this one
+	vector<size_t> &owned = owner_frames_[frame.owner];
+	frames_[owned.back()].owner_slot = frame.owner_slot;
+	owned[frame.owner_slot] = owned.back();
+	owned.pop_back();
+	usage_ -= frame.footprint;
+	frame.page = nullptr;
+	free_frames_.push_back(frame_index);
+}
+
+void BufferPool::writeBack_(Frame &frame) {
+	frame.owner->writeBackPage(frame.pos, frame.page);
+	frame.dirty = false;
+	dirty_usage_ -= frame.footprint;
+}
+
+size_t BufferPool::sweep_(size_t count, size_t target) {
+	// one round over the frames at most, pinned pages are left for later
+	size_t written = 0;
+	size_t steps = frames_.size();
+	while (written != count && dirty_usage_ > target && steps-- > 0) {
+		if (flush_hand_ >= frames_.size())
+			flush_hand_ = 0;
+		Frame &frame = frames_[flush_hand_];
+		if (frame.page != nullptr && frame.dirty && frame.pincount == 0) {
+			writeBack_(frame);
+			++written;
+		}
+		++flush_hand_;
+	}
+	return written;
+}
+
+void BufferPool::limitDirty_() {
+	if (dirty_usage_ > dirtyLimit())
+		sweep_(SIZE_MAX,dirtyLimit());
+}
@@ -0,0 +1,137 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+#include "diskfile.h"
+#include "kikutil.h"
+
+/*
+ * Buffer pool
+ * ----------------
+ * Caches index pages of every index of a database under one memory
+ * budget. When the budget is exceeded pages are evicted one at a time
+ * following the CLOCK policy. Pinned pages are never evicted, and only
+ * pages marked dirty are written back before being evicted.
+ *
+ * Dirty pages may take up to a share of the budget (the dirty limit).
+ * Past it, whoever marks a page dirty writes back unpinned dirty pages
+ * until the pool is under the limit again. writeBack(...)
+ * writes a few of them at a time, so that a background writer can keep
+ * the pool below the limit and nothing has much left to write at once.
+ *
+ * Pages are owned by a PageOwner (an index) which knows how to
+ * write its pages back to disk.
+ *
+ * The pool has no lock of its own. Callers serialize every call with
+ * the lock that guards the owners (NaiveDB::mutex_), a background writer
+ * calling writeBack(...) too: writing a page back runs code of its owner,
+ * and any call may evict and write back pages of other owners.
+ */
+
+class BufferPool {
+	DISALLOW_COPY_AND_ASSIGN(BufferPool);
+public:
+	// Base class for everything cached in the pool
+	struct Page {
+		virtual ~Page() {}
+	};
+
+	// Interface of page owners
+	class PageOwner {
+	public:
+		// write page back to position pos of the owner's file
+		virtual void writeBackPage(FilePos pos, Page *page) = 0;
+		virtual ~PageOwner() {}
+	};
+
+	static const size_t kDefaultBudget = 128 << 20; // in bytes
+	static const size_t kDefaultDirtyPercent = 25; // of the budget
+
+	explicit BufferPool(size_t budget = kDefaultBudget);
+	~BufferPool();
+
+	// fetch(...) returns the cached page and pins it, nullptr if not cached
+	Page* fetch(PageOwner *owner, FilePos pos);
+
+	// add(...) hands a page over to the pool, the page is returned pinned
+	// footprint is the memory charged against the budget for this page
+	void add(PageOwner *owner, FilePos pos, Page *page, size_t footprint, bool dirty);
+
+	void unpin(PageOwner *owner, FilePos pos);
+	void markDirty(PageOwner *owner, FilePos pos);
+
+	// write back every dirty page of owner, pages stay cached
+	void flush(PageOwner *owner);
+	// write back every dirty page of every owner
+	void flushAll();
+	// write back and drop every page of owner, call it before owner dies
+	void drop(PageOwner *owner);
+	// write back up to count dirty pages that are not pinned, continuing
+	// where the last call left off, pages stay cached
+	// returns how many were written, the owners' lock must be held
+	size_t writeBack(size_t count);
+
+	void setBudget(size_t budget);
+	void setDirtyPercent(size_t percent);
+	size_t budget() const { return budget_; }
+	size_t usage() const { return usage_; }
+	// bytes of the dirty pages, and how many bytes of them are allowed
+	size_t dirtyUsage() const { return dirty_usage_; }
+	size_t dirtyLimit() const { return budget_ / 100 * dirty_percent_; }
+private:
+	struct Frame {
+		PageOwner *owner;
+		FilePos pos;
+		Page *page; // nullptr if the frame is free
+		size_t footprint;
+		int pincount;
+		bool dirty;
+		bool referenced;
+		size_t owner_slot; // where the frame is in owner_frames_[owner]
+	};
+
+	struct FrameKey {
+		PageOwner *owner;
+		FilePos pos;
+		bool operator==(const FrameKey &rval) const {
+			return owner == rval.owner && pos == rval.pos;
+		}
+	};
+
+	struct FrameKeyHash {
+		size_t operator()(const FrameKey &key) const {
+			return std::hash<const void*>()(key.owner) ^
+					std::hash<FilePos>()(key.pos);
+		}
+	};
+
+	std::vector<Frame> frames_;
+	std::vector<size_t> free_frames_;
+	std::unordered_map<FrameKey, size_t, FrameKeyHash> lookup_;
+	// the frames of every owner, so that flush(...) and drop(...) do not
+	// walk the whole pool
+	std::unordered_map<PageOwner*, std::vector<size_t> > owner_frames_;
+	size_t clock_hand_;
+	// where writeBack(...) goes on from
+	size_t flush_hand_;
+	size_t budget_;
+	size_t usage_;
+	size_t dirty_percent_;
+	size_t dirty_usage_;
+
+	Frame& frameOf_(PageOwner *owner, FilePos pos);
+	// evict pages until incoming more bytes fit in the budget or
+	// every remaining page is pinned
+	void makeRoom_(size_t incoming);
+	void evict_(size_t frame_index);
+	void writeBack_(Frame &frame);
+	// write back unpinned dirty pages from flush_hand_ on, until count of
+	// them are written or at most target bytes are dirty
+	size_t sweep_(size_t count, size_t target);
+	// write back pages until the dirty ones are within the limit
+	void limitDirty_();
+};
+
+#endif // BUFFERPOOL_H
@@ -1,11 +1,139 @@
 #include "diskfile.h"
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 using namespace std;
 
-bool DatFile::isRecordDeleted(istream &is, FilePos recordpos) {
-	char byte;
-	getFromPos(is,recordpos - sizeof(char),byte);
-	return byte == 1;
+PosFile::PosFile(const string &filename) {
+	fd_ = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+	assert(fd_ != -1);
+}
+
+PosFile::~PosFile() {
+	close(fd_);
+}
+
+void PosFile::read(FilePos pos, void *buf, size_t length) const {
+	char *dest = static_cast<char*>(buf);
+	while (length > 0) {
+		ssize_t got = pread(fd_, dest, length, pos);
+		if (got == -1 && errno == EINTR)
+			continue;
+		assert(got != -1);
+		if (got == 0) {
+			// beyond end of file
+			memset(dest, 0, length);
+			return;
+		}
+		dest += got;
+		pos += got;
+		length -= got;
+	}
+}
+
+void PosFile::write(FilePos pos, const void *buf, size_t length) {
+	const char *src = static_cast<const char*>(buf);
+	while (length > 0) {
+		ssize_t put = pwrite(fd_, src, length, pos);
+		if (put == -1 && errno == EINTR)
+			continue;
+		assert(put > 0);
+		src += put;
+		pos += put;
+		length -= put;
+	}
+}
+
+FilePos PosFile::size() const {
+	struct stat buf;
+	fstat(fd_, &buf);
+	return buf.st_size;
+}
+
+void PosFile::sync() {
+	int ret = fdatasync(fd_);
+	assert(ret == 0);
+	(void)ret;
+}
+
+void syncFile(const string &filename) {
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd == -1)
+		return;
+	fsync(fd);
+	close(fd);
+}
+
+void PosFile::resize(FilePos length) {
+	int ret = ftruncate(fd_, length);
+	assert(ret == 0);
+	(void)ret;
+}
+
+MappedFile::MappedFile(const string &filename)
+	: base_(nullptr), size_(0), mapped_(0)
+{
+	fd_ = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+	assert(fd_ != -1);
+	struct stat buf;
+	fstat(fd_, &buf);
+	size_ = buf.st_size;
+	remap_(size_);
+}
+
+MappedFile::~MappedFile() {
+	munmap(base_, mapped_);
+	close(fd_);
+}
+
+void MappedFile::remap_(size_t length) {
+	// reserve at least twice as much as requested
+	size_t new_mapped = std::max((size_t)kMinMapping, 2 * length);
+	if (base_ != nullptr)
+		munmap(base_, mapped_);
+	void *addr = mmap(nullptr, new_mapped, PROT_READ | PROT_WRITE,
+					  MAP_SHARED, fd_, 0);
+	assert(addr != MAP_FAILED);
+	base_ = static_cast<char*>(addr);
+	mapped_ = new_mapped;
+}
+
+void MappedFile::resize(FilePos length) {
+	int ret = ftruncate(fd_, length);
+	assert(ret == 0);
+	(void)ret;
+	size_ = length;
+	if (size_ > mapped_)
+		remap_(size_);
+}
+
+void MappedFile::refresh() {
+	struct stat buf;
+	fstat(fd_, &buf);
+	size_ = buf.st_size;
+	if (size_ > mapped_)
+		remap_(size_);
+}
+
+void MappedFile::sync() {
+	int ret = msync(base_, size_, MS_SYNC);
+	assert(ret == 0);
+	(void)ret;
+}
+
+void MappedFile::read(FilePos pos, void *buf, size_t length) const {
+	assert(pos + length <= size_);
+	memcpy(buf, base_ + pos, length);
+}
+
+void MappedFile::write(FilePos pos, const void *buf, size_t length) {
+	if (pos + length > size_)
+		resize(pos + length);
+	memcpy(base_ + pos, buf, length);
 }
 
 bool fileExists(const char *filename) {
@@ -16,63 +144,38 @@ bool fileExists(const char *filename) {
 	return false;
 }
 
-int64_t DatFile::increasePrimaryId(fstream &stream) {
-	// increase the first 8 byte of table file
-	int64_t pid;
-	auto old_p = stream.tellp();
-	auto old_g = stream.tellg();
-	getFromPos(stream,DatFile::kPidPos,pid);
-	writeToPos(stream,DatFile::kPidPos,pid + 1);
-	stream.seekg(old_g);
-	stream.seekp(old_p);
-	return pid + 1;
+void IdxFile::markComplete(const string &filename) {
+	PosFile file(filename);
+	// the index is on disk before the mark is
+	file.sync();
+	char complete = 1;
+	file.writeAt(kCompletePos,complete);
+	file.sync();
 }
 
-int64_t DatFile::getPrimaryId(istream &is) {
-	int64_t pid;
-	auto old_g = is.tellg();
-	getFromPos(is,DatFile::kPidPos,pid);
-	is.seekg(old_g);
-	return pid;
-}
-
-FilePos DatFile::consumeFreeSpace(fstream &stream) {
+FilePos IdxFile::consumeFreeSpace(PosFile &file, size_t blocksize) {
 	FilePos next_flpos;
-	getFromPos(stream,DatFile::kFlHeadPos,next_flpos); // get a chunk from the head of free list
+	file.readAt(IdxFile::kFlHeadPos,next_flpos); // get a chunk from the head of free list
 	if (next_flpos == 0) {
 		// no space in free list
-		// return position pointing to file end
-		stream.seekp(0, stream.end);
-		// write meta info of deleted flag 0
-		char bytedat = 0;
-		binary_write(stream, bytedat);
+		// extend the file so that the block is reserved even before
+		// anything is written to it
+		FilePos endpos = file.size();
+		file.resize(endpos + blocksize);
+		return endpos;
 	} else {
-		FilePos current_chunk = next_flpos;
+		FilePos next_chunk;
 		// a free chunk is found
 		// remove it from free list
-		getFromPos(stream,next_flpos,next_flpos);
-		writeToPos(stream,DatFile::kFlHeadPos,next_flpos);
-		// set deleted flag false
-		// write 0 to deleted flag
-		char bytedat = 0;
-		writeToPos(stream,current_chunk - sizeof(char),bytedat);
+		file.readAt(next_flpos,next_chunk);
+		file.writeAt(IdxFile::kFlHeadPos,next_chunk);
+		return next_flpos;
 	}
-	return stream.tellp();
 }
 
-FilePos IdxFile::consumeFreeSpace(fstream &stream) {
+void IdxFile::releaseSpace(PosFile &file, FilePos pos) {
 	FilePos next_flpos;
-	getFromPos(stream,IdxFile::kFlHeadPos,next_flpos); // get a chunk from the head of free list
-	if (next_flpos == 0) {
-		// no space in free list
-		// return position pointing to file end
-		stream.seekp(0, stream.end);
-	} else {
-		FilePos next_chunk = next_flpos;
-		// a free chunk is found
-		// remove it from free list
-		getFromPos(stream,next_flpos,next_chunk);
-		writeToPos(stream,IdxFile::kFlHeadPos,next_chunk);
-	}
-	return stream.tellp();
+	file.readAt(IdxFile::kFlHeadPos,next_flpos);
+	file.writeAt(pos,next_flpos);
+	file.writeAt(IdxFile::kFlHeadPos,pos);
 }
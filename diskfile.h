@@ -1,13 +1,108 @@
 #ifndef DISKFILE_H
 #define DISKFILE_H
 
+#include <algorithm>
+#include <cassert>
 #include <fstream>
 #include <string>
 #include <cstdint>
+#include <cstring>
 #include "kikutil.h"
 
 typedef int64_t FilePos;
 
+// PosFile
+// ----------------
+// A file handle that stays open for the lifetime of its owner and does
+// positional (pread/pwrite) I/O, so there is no seek pointer to move and
+// no stream to open per access. Reading past the end of file yields zeros
+//
+class PosFile {
+	DISALLOW_COPY_AND_ASSIGN(PosFile);
+public:
+	// opens filename for read/write, creating an empty file if needed
+	explicit PosFile(const std::string &filename);
+	~PosFile();
+
+	void read(FilePos pos, void *buf, size_t length) const;
+	void write(FilePos pos, const void *buf, size_t length);
+
+	template <typename T>
+	void readAt(FilePos pos, T &data) const {
+		read(pos, &data, sizeof(T));
+	}
+
+	template <typename T>
+	void writeAt(FilePos pos, const T &data) {
+		write(pos, &data, sizeof(T));
+	}
+
+	FilePos size() const;
+	void resize(FilePos length);
+	// flush the file content to disk
+	void sync();
+private:
+	int fd_;
+};
+
+// flush the content of filename to disk, whichever handle wrote it
+void syncFile(const std::string &filename);
+
+// MappedFile
+// ----------------
+// A file mapped into memory with MAP_SHARED. More address space than the
+// file holds is reserved, so growing the file rarely needs a new mapping.
+// Pointers returned by at() are invalidated by resize() and write()
+// beyond the end of file
+//
+class MappedFile {
+	DISALLOW_COPY_AND_ASSIGN(MappedFile);
+public:
+	// opens filename for read/write, creating an empty file if needed
+	explicit MappedFile(const std::string &filename);
+	~MappedFile();
+
+	char* at(FilePos pos) {
+		return base_ + pos;
+	}
+
+	const char* at(FilePos pos) const {
+		return base_ + pos;
+	}
+
+	void read(FilePos pos, void *buf, size_t length) const;
+	// write(...) grows the file when writing beyond its end
+	void write(FilePos pos, const void *buf, size_t length);
+
+	template <typename T>
+	void readAt(FilePos pos, T &data) const {
+		read(pos, &data, sizeof(T));
+	}
+
+	template <typename T>
+	void writeAt(FilePos pos, const T &data) {
+		write(pos, &data, sizeof(T));
+	}
+
+	FilePos size() const {
+		return size_;
+	}
+	void resize(FilePos length);
+	// refresh() picks up growth of the file made through other handles
+	void refresh();
+	// flush the mapped pages to disk
+	void sync();
+private:
+	static const size_t kMinMapping = 1 << 20;
+
+	int fd_;
+	char *base_;
+	size_t size_;
+	size_t mapped_;
+
+	void remap_(size_t length);
+};
+
 template <typename T>
 void writeToPos(std::ostream &ofs, FilePos pos, const T &data) {
 	ofs.seekp(pos);
@@ -43,6 +138,122 @@ inline void binary_write_s(std::ostream &ofs, const std::string &str, size_t len
 		ofs.put('\0');
 }
 
+// Functions for decoding/encoding data inside a block in memory
+// each returns the position right after what it decoded/encoded
+template <typename T>
+inline const char* block_read(const char *src, T &data) {
+	std::memcpy(&data, src, sizeof(T));
+	return src + sizeof(T);
+}
+
+template <typename T>
+inline const char* block_read_array(const char *src, T *array, size_t count) {
+	std::memcpy(array, src, count * sizeof(T));
+	return src + count * sizeof(T);
+}
+
+template <typename T>
+inline char* block_write(char *dest, const T &data) {
+	std::memcpy(dest, &data, sizeof(T));
+	return dest + sizeof(T);
+}
+
+template <typename T>
+inline char* block_write_array(char *dest, const T *array, size_t count) {
+	std::memcpy(dest, array, count * sizeof(T));
+	return dest + count * sizeof(T);
+}
+
+// String stored in a '\0' padded slot of length bytes
+inline const char* block_read_s(const char *src, std::string &str, size_t length) {
+	str.assign(src, strnlen(src, length));
+	return src + length;
+}
+
+// dest must already be zero-filled
+inline char* block_write_s(char *dest, const std::string &str, size_t length) {
+	std::memcpy(dest, str.data(), std::min(str.length(), length));
+	return dest + length;
+}
+
+// Keys of an index in slots of keysize bytes each: fixed-width keys are
+// stored as they are in memory, strings '\0' padded
+template <typename T>
+inline const char* block_read_keys(const char *src, T *keys, size_t count, size_t keysize) {
+	assert(keysize == sizeof(T));
+	return block_read_array(src, keys, count);
+}
+
+inline const char* block_read_keys(const char *src, std::string *keys, size_t count,
+								   size_t keysize) {
+	for (size_t i = 0; i != count; ++i)
+		src = block_read_s(src, keys[i], keysize);
+	return src;
+}
+
+template <typename T>
+inline char* block_write_keys(char *dest, const T *keys, size_t count, size_t keysize) {
+	assert(keysize == sizeof(T));
+	return block_write_array(dest, keys, count);
+}
+
+inline char* block_write_keys(char *dest, const std::string *keys, size_t count,
+							  size_t keysize) {
+	for (size_t i = 0; i != count; ++i)
+		dest = block_write_s(dest, keys[i], keysize);
+	return dest;
+}
+
+// The bytes of std::string keys, which an index stores as a prefix shared
+// by the keys of a node followed by the rest of every key instead of in
+// slots (see BPTree). Other keys are not prefixed and only have slots,
+// FixedKey included so that its nodes still load with a memcpy
+template <typename T>
+struct KeyBytes {
+	static const bool kPrefixed = false;
+
+	static size_t length(const T &) { return sizeof(T); }
+	static const char* data(const T &key) { return reinterpret_cast<const char*>(&key); }
+	static void assign(T &key, const char *src, size_t length) {
+		assert(length == sizeof(T));
+		std::memcpy(&key, src, length);
+	}
+};
+
+template <>
+struct KeyBytes<std::string> {
+	static const bool kPrefixed = true;
+
+	static size_t length(const std::string &key) { return key.length(); }
+	static const char* data(const std::string &key) { return key.data(); }
+	static void assign(std::string &key, const char *src, size_t length) {
+		key.assign(src, length);
+	}
+};
+
+// Unsigned LEB128 varint, 7 bits per byte, at most 10 bytes
+inline char* varint_write(char *dest, uint64_t value) {
+	while (value >= 0x80) {
+		*dest++ = (char)(value | 0x80);
+		value >>= 7;
+	}
+	*dest++ = (char)value;
+	return dest;
+}
+
+inline const char* varint_read(const char *src, uint64_t &value) {
+	uint64_t byte = (unsigned char)*src++;
+	value = byte;
+	if (byte < 0x80)
+		return src; // the common case of a small number
+	value &= 0x7f;
+	for (int shift = 7; byte >= 0x80; shift += 7) {
+		byte = (unsigned char)*src++;
+		value |= (byte & 0x7f) << shift;
+	}
+	return src;
+}
+
 bool fileExists(const char* filename);
 
 namespace DatFile {
@@ -52,16 +263,9 @@ const FilePos kPidPos = 0;
 const FilePos kFlHeadPos = 8;
 const FilePos kRecordStartPos = 17;
 
-int64_t increasePrimaryId(std::fstream &stream);
-int64_t getPrimaryId(std::istream &is);
-bool isRecordDeleted(std::istream &is, FilePos recordpos);
-
-// consumeFreeSpace
-// ----------------
-// consume a piece of free space in free list (or append to the
-// end of file, return position which is ready for r/w
-//
-FilePos consumeFreeSpace(std::fstream &stream);
+// records follow each other from kRecordStartPos, each one after a
+// byte telling whether it is deleted (1). Freed records are linked from
+// kFlHeadPos through their first 8 bytes, see NaiveDB::consumeFreeSpace_
 
 }
 
@@ -73,15 +277,48 @@ const FilePos kKeySizePos = 8;
 const FilePos kValSizePos = 12;
 const FilePos kBlockSizePos = 16;
 const FilePos kRootPointerPos = 20;
+// 1 once the index holds every record of its table, past the header of
+// a hash index. An index built for records already there is marked only
+// when the build is on disk, one without the mark is built again
+const FilePos kCompletePos = 512;
 
-enum NodeType { SINGLE = 0, INNER = 1, LEAF = 2, OVF = 3};
+// B+tree only, a hash index keeps the number of buckets there
+const FilePos kKeyFormatPos = 28;
+// how the keys of B+tree nodes are stored, see KeyBytes
+enum KeyFormat { SLOT_KEYS = 0, PREFIX_KEYS = 1 };
+
+// OVF chains are only written by older versions, POSTING replaces them
+enum NodeType { SINGLE = 0, INNER = 1, LEAF = 2, OVF = 3, POSTING = 4};
+
+// Posting block layout, the values of a duplicate key stored as
+// zigzag varint deltas, each block starting from 0
+const size_t kPostingCountPos = 1;
+const size_t kPostingUsedPos = 3;
+const size_t kPostingNextPos = 5;
+const size_t kPostingTailPos = 13; // meaningful in the first block only
+const size_t kPostingLastPos = 21;
+const size_t kPostingHeaderSize = 29;
+
+// Hash index layout (see HashIndex), the header keeps 0 where a B+tree
+// has its root pointer
+const FilePos kHashBucketsPos = 28;
+const FilePos kHashFreePos = 36;
+const FilePos kHashSegmentsPos = 44;
+// bucket block: slot_use(2) next(8), then the keys and the values
+const size_t kHashNextPos = 2;
+const size_t kHashBucketHeaderSize = 10;
 
 // consumeFreeSpace
 // ----------------
-// consume a piece of free space in free list (or append to the
-// end of file, return position which is ready for r/w
+// consume a block in free list (or extend the file by blocksize bytes),
+// return position of the block which is ready for r/w
 //
-FilePos consumeFreeSpace(std::fstream &stream);
+FilePos consumeFreeSpace(PosFile &file, size_t blocksize);
+// put the block at pos at the head of the free list
+void releaseSpace(PosFile &file, FilePos pos);
+
+// sync the index in filename, then mark it complete (see kCompletePos)
+void markComplete(const std::string &filename);
 }
 
 #endif // DISKFILE_H
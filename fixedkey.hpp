@@ -0,0 +1,87 @@
+/*
+ * Fixed-width string keys
+ * ----------------
+ * A string key held inline in N bytes, '\0' padded, instead of in a
+ * std::string. Nodes of such keys are flat: no allocation per key, and
+ * copying or comparing keys is a memcpy or memcmp. Keys longer than N
+ * bytes are cut, so N must be at least the length of the column.
+ *
+ * Ordered as the std::string keys of the same column (strings without
+ * '\0' compare the same padded). The keys are kept in slots on disk, not
+ * prefixed like std::string keys (see KeyBytes): a node of them is
+ * loaded and stored with memcpy.
+ */
+#ifndef FIXEDKEY_HPP
+#define FIXEDKEY_HPP
+
+#include <algorithm>
+#include <string>
+#include <cstring>
+#include <cassert>
+#include "diskfile.h"
+
+template <size_t N>
+struct FixedKey {
+	char bytes[N];
+
+	FixedKey() {
+		std::memset(bytes,0,N);
+	}
+	FixedKey(const std::string &str) {
+		size_t length = std::min(str.length(),N);
+		std::memcpy(bytes,str.data(),length);
+		std::memset(bytes + length,0,N - length);
+	}
+
+	size_t length() const {
+		return strnlen(bytes,N);
+	}
+	std::string str() const {
+		return std::string(bytes,length());
+	}
+
+	bool operator<(const FixedKey &rval) const {
+		return std::memcmp(bytes,rval.bytes,N) < 0;
+	}
+	bool operator>(const FixedKey &rval) const {
+		return rval < *this;
+	}
+	bool operator<=(const FixedKey &rval) const {
+		return !(rval < *this);
+	}
+	bool operator>=(const FixedKey &rval) const {
+		return !(*this < rval);
+	}
+	bool operator==(const FixedKey &rval) const {
+		return std::memcmp(bytes,rval.bytes,N) == 0;
+	}
+	bool operator!=(const FixedKey &rval) const {
+		return !(*this == rval);
+	}
+};
+
+// keys in slots of keysize bytes, see block_read_keys in diskfile.h
+template <size_t N>
+inline const char* block_read_keys(const char *src, FixedKey<N> *keys, size_t count,
+								   size_t keysize) {
+	assert(keysize <= N);
+	for (size_t i = 0; i != count; ++i) {
+		std::memcpy(keys[i].bytes,src,keysize);
+		std::memset(keys[i].bytes + keysize,0,N - keysize);
+		src += keysize;
+	}
+	return src;
+}
+
+template <size_t N>
+inline char* block_write_keys(char *dest, const FixedKey<N> *keys, size_t count,
+							  size_t keysize) {
+	assert(keysize <= N);
+	for (size_t i = 0; i != count; ++i) {
+		std::memcpy(dest,keys[i].bytes,keysize);
+		dest += keysize;
+	}
+	return dest;
+}
+
+#endif // FIXEDKEY_HPP
@@ -0,0 +1,612 @@
+/*
+ * Hash index
+ * ----------------
+ * Disk-backed linear hashing for columns only ever looked up by exact
+ * match. A lookup reads the header and one bucket block (plus overflow
+ * blocks, which stay rare) instead of descending a B+tree.
+ *
+ * Buckets are split one at a time in a fixed order, each time an insert
+ * has to start an overflow block, so the table grows with the data and
+ * never rehashes as a whole. The buckets live in segments: the first
+ * one holds kInitialBuckets buckets, every later one as many as all the
+ * segments before it, so the header can point at all of them.
+ */
+#ifndef HASHINDEX_HPP
+#define HASHINDEX_HPP
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+#include "bufferpool.h"
+#include "diskfile.h"
+#include "fixedkey.hpp"
+#include "kikutil.h"
+#include "wal.h"
+
+// Hash functions of keys, the buckets on disk depend on them so they
+// must not change between runs (std::hash may)
+inline uint64_t mix64(uint64_t x) {
+	// finalizer of MurmurHash3
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+inline uint64_t hash_key(int32_t key) {
+	return mix64((uint64_t)(int64_t)key);
+}
+
+inline uint64_t hash_key(int64_t key) {
+	return mix64((uint64_t)key);
+}
+
+inline uint64_t hash_bytes(const char *bytes, size_t length) {
+	// FNV-1a
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i != length; ++i) {
+		h ^= (unsigned char)bytes[i];
+		h *= 0x100000001b3ULL;
+	}
+	return mix64(h);
+}
+
+inline uint64_t hash_key(const std::string &key) {
+	return hash_bytes(key.data(),key.length());
+}
+
+// the same as the std::string of the key, the padding left out
+template <size_t N>
+inline uint64_t hash_key(const FixedKey<N> &key) {
+	return hash_bytes(key.bytes,key.length());
+}
+
+template <typename A, typename B>
+inline uint64_t hash_key(const std::pair<A,B> &key) {
+	return mix64(hash_key(key.first) ^ (hash_key(key.second) >> 1));
+}
+
+// The HashIndex class
+// Same interface as BPTree for exact match, no range scans
+// Blocks are cached in a BufferPool, which may be shared with trees
+template <typename KeyType, typename ValType>
+class HashIndex : public BufferPool::PageOwner {
+	DISALLOW_COPY_AND_ASSIGN(HashIndex);
+public:
+	// bytes of a bucket or overflow block, also the header block
+	static const size_t kBucketSize = 4096;
+	// slots of a bucket block with 4 byte keys and 8 byte values
+	static const size_t kMaxSlots = 340;
+	// buckets of the first segment, a power of 2
+	static const size_t kInitialBuckets = 4;
+	static const size_t kMaxSegments = 40;
+	size_t BucketSlots;
+private:
+	// Block 0, only the fields after the common index header are its own
+	struct Header : public BufferPool::Page {
+		uint64_t buckets;
+		FilePos free; // first free overflow block, linked through next
+		FilePos segments[kMaxSegments];
+	};
+
+	// A bucket, or an overflow block of one. A zeroed block is an empty
+	// bucket, so segments need not be written when they are reserved
+	struct Bucket : public BufferPool::Page {
+		short slotuse;
+		FilePos next; // overflow block, 0 if none
+		KeyType keys[kMaxSlots];
+		ValType data[kMaxSlots];
+	};
+
+	std::string filename_;
+	PosFile file_;
+	size_t keysize_;
+	size_t valsize_;
+
+	BufferPool *pool_;
+	// non-null when the index was not given a pool and made its own
+	BufferPool *own_pool_;
+	// blocks pinned by the running operation
+	std::vector<FilePos> pinned_;
+
+	// changes are logged to wal_ when it is not nullptr
+	Wal *wal_;
+	// blocks changed by the running operation, logged when it finishes
+	std::vector<FilePos> logged_;
+
+	// Private helper member functions
+
+	void create_empty_index_();
+	Header* load_header_();
+	Bucket* load_bucket_(FilePos pos);
+	BufferPool::Page* load_page_(FilePos pos);
+	// write_page_(...) marks the block dirty, see BPTree::write_node_
+	void write_page_(FilePos pos, BufferPool::Page *page);
+	// encode the block at pos, return the bytes it covers, which for
+	// the header start at IdxFile::kHashBucketsPos
+	size_t encode_page_(FilePos pos, const BufferPool::Page *page, char *block) const;
+	void write_page_to_disk_(FilePos pos, const BufferPool::Page *page);
+	void unpin_all_();
+	void log_changes_();
+	// release the blocks after an update, logging the changes if needed
+	void finish_update_();
+
+	// the bucket of key when there are buckets of them
+	static uint64_t bucket_of_(const KeyType &key, uint64_t buckets);
+	FilePos bucket_pos_(const Header *header, uint64_t bucket) const;
+	// a block for an overflow chain, from the free list or the end of file
+	FilePos alloc_block_(Header *header);
+	// split the next bucket in line into itself and a new last bucket
+	void split_(Header *header);
+	// rewrite the chain starting at pos with entries, taking its blocks
+	// from spare first
+	void fill_chain_(Header *header, FilePos pos,
+					 const std::vector<std::pair<KeyType,ValType> > &entries,
+					 std::vector<FilePos> &spare);
+	void insert_(const KeyType &key, const ValType &value);
+public:
+	// Public methods
+
+	// wal makes insert log its changes, the caller commits them
+	HashIndex(const std::string &filename, size_t keysize = 0, size_t valsize = 0,
+			  BufferPool *pool = nullptr, Wal *wal = nullptr);
+
+	~HashIndex();
+
+	// BufferPool::PageOwner
+	void writeBackPage(FilePos pos, BufferPool::Page *page);
+
+	std::vector<ValType> find(const KeyType &key);
+
+	void insert(const KeyType &key, const ValType &value);
+
+	// insert many entries as one operation
+	void insertBatch(std::vector<std::pair<KeyType,ValType> > entries);
+
+	// fill an empty index with entries, written straight to the file and
+	// synced instead of logged like BPTree::bulkLoad
+	void bulkLoad(const std::vector<std::pair<KeyType,ValType> > &entries);
+};
+
+// Implementations of class HashIndex
+
+template <typename KeyType, typename ValType>
+HashIndex<KeyType,ValType>::
+		HashIndex(const std::string &filename, size_t keysize, size_t valsize,
+				  BufferPool *pool, Wal *wal)
+			: filename_(filename), file_(filename), pool_(pool), own_pool_(nullptr),
+			  wal_(wal)
+{
+
+	static_assert(sizeof(ValType) >= sizeof(FilePos),"ValType too short!");
+
+	if (keysize == 0)
+		keysize = sizeof(KeyType);
+	if (valsize == 0)
+		valsize = sizeof(ValType);
+	keysize_ = keysize;
+	valsize_ = valsize;
+	BucketSlots = (kBucketSize - IdxFile::kHashBucketHeaderSize)/(keysize + valsize);
+	assert(BucketSlots <= kMaxSlots);
+
+	if (pool_ == nullptr) {
+		own_pool_ = new BufferPool();
+		pool_ = own_pool_;
+	}
+
+	if (file_.size() == 0)
+		create_empty_index_();
+
+	// a segment reserved before a crash may have been redone from the
+	// log without the file being extended over it, overflow blocks must
+	// not be taken from it
+	Header *header = load_header_();
+	ON_SCOPE_EXIT([this]() { unpin_all_(); });
+	for (size_t seg = kMaxSegments; seg != 0; --seg) {
+		if (header->segments[seg - 1] == 0)
+			continue;
+		size_t count = seg == 1 ? kInitialBuckets : kInitialBuckets << (seg - 2);
+		FilePos end = header->segments[seg - 1] + count*kBucketSize;
+		if (file_.size() < end)
+			file_.resize(end);
+		break;
+	}
+}
+
+template <typename KeyType, typename ValType>
+HashIndex<KeyType,ValType>::~HashIndex() {
+
+	pool_->drop(this);
+	delete own_pool_;
+}
+
+template <typename KeyType, typename ValType>
+void HashIndex<KeyType,ValType>::
+		writeBackPage(FilePos pos, BufferPool::Page *page) {
+
+	// with a log, blocks are only unpinned once the log has them on disk
+	write_page_to_disk_(pos,page);
+}
+
+template <typename KeyType, typename ValType>
+void HashIndex<KeyType,ValType>::
+		create_empty_index_() {
+
+	FilePos pos = 0;
+	file_.writeAt(IdxFile::kFlHeadPos,pos);
+	int32_t size = sizeof(KeyType);
+	file_.writeAt(IdxFile::kKeySizePos,size);
+	size = sizeof(ValType);
+	file_.writeAt(IdxFile::kValSizePos,size);
+	size = kBucketSize;
+	file_.writeAt(IdxFile::kBlockSizePos,size);
+	// no root: tells a hash index from a B+tree
+	file_.writeAt(IdxFile::kRootPointerPos,pos);
+	Header header;
+	header.buckets = kInitialBuckets;
+	header.free = 0;
+	std::memset(header.segments,0,sizeof(header.segments));
+	header.segments[0] = kBucketSize;
+	write_page_to_disk_(0,&header);
+	// the first segment is all empty buckets
+	file_.resize(kBucketSize + kInitialBuckets*kBucketSize);
+}
+
+template <typename KeyType, typename ValType>
+BufferPool::Page* HashIndex<KeyType,ValType>::
+		load_page_(FilePos pos) {
+
+	BufferPool::Page *page = pool_->fetch(this,pos);
+	if (page == nullptr) {
+		// fetch the whole block with a single read and decode it in memory
+		char block[kBucketSize];
+		file_.read(pos,block,kBucketSize);
+		const char *src = block;
+		if (pos == 0) {
+			Header *header = new Header();
+			src += IdxFile::kHashBucketsPos;
+			src = block_read(src,header->buckets);
+			src = block_read(src,header->free);
+			src = block_read_array(src,header->segments,kMaxSegments);
+			page = header;
+			pool_->add(this,pos,page,sizeof(Header),false);
+		} else {
+			Bucket *bucket = new Bucket();
+			src = block_read(src,bucket->slotuse);
+			src = block_read(src,bucket->next);
+			src = block_read_keys(src,bucket->keys,bucket->slotuse,keysize_);
+			src += (BucketSlots - bucket->slotuse)*keysize_;
+			src = block_read_array(src,bucket->data,bucket->slotuse);
+			page = bucket;
+			pool_->add(this,pos,page,sizeof(Bucket),false);
+		}
+	}
+	// keep the block in memory until the operation finishes
+	pinned_.push_back(pos);
+	return page;
+}
+
+template <typename KeyType, typename ValType>
+typename HashIndex<KeyType,ValType>::Header* HashIndex<KeyType,ValType>::
+		load_header_() {
+
+	return static_cast<Header*>(load_page_(0));
+}
+
+template <typename KeyType, typename ValType>
+typename HashIndex<KeyType,ValType>::Bucket* HashIndex<KeyType,ValType>::
+		load_bucket_(FilePos pos) {
+
+	return static_cast<Bucket*>(load_page_(pos));
+}
+
+template <typename KeyType, typename ValType>
+size_t HashIndex<KeyType,ValType>::
+		encode_page_(FilePos pos, const BufferPool::Page *page, char *block) const {
+
+	char *dest = block;
+	if (pos == 0) {
+		const Header *header = static_cast<const Header*>(page);
+		dest = block_write(dest,header->buckets);
+		dest = block_write(dest,header->free);
+		dest = block_write_array(dest,header->segments,kMaxSegments);
+		return dest - block;
+	}
+	const Bucket *bucket = static_cast<const Bucket*>(page);
+	dest = block_write(dest,bucket->slotuse);
+	dest = block_write(dest,bucket->next);
+	dest = block_write_keys(dest,bucket->keys,bucket->slotuse,keysize_);
+	dest += (BucketSlots - bucket->slotuse)*keysize_;
+	dest = block_write_array(dest,bucket->data,bucket->slotuse);
+	assert(dest <= block + kBucketSize);
+	return kBucketSize;
+}
+
+template <typename KeyType, typename ValType>
+void HashIndex<KeyType,ValType>::
+		write_page_to_disk_(FilePos pos, const BufferPool::Page *page) {
+
+	char block[kBucketSize] = {};
+	size_t length = encode_page_(pos,page,block);
+	file_.write(pos == 0 ? IdxFile::kHashBucketsPos : pos,block,length);
+}
+
+template <typename KeyType, typename ValType>
+void HashIndex<KeyType,ValType>::
+		write_page_(FilePos pos, BufferPool::Page *page) {
+
+	BufferPool::Page *cached = pool_->fetch(this,pos);
+	if (cached != nullptr) {
+		// already cached, written back when evicted
+		assert(cached == page);
+		pool_->markDirty(this,pos);
+		pool_->unpin(this,pos);
+	} else {
+		pool_->add(this,pos,page,pos == 0 ? sizeof(Header) : sizeof(Bucket),true);
+		pinned_.push_back(pos);
+	}
+	if (wal_ != nullptr)
+		logged_.push_back(pos);
+}
+
+template <typename KeyType, typename ValType>
+void HashIndex<KeyType,ValType>::
+		unpin_all_() {
+
+	for (FilePos pos : pinned_)
+		pool_->unpin(this,pos);
+	pinned_.clear();
+}
+
+template <typename KeyType, typename ValType>
+void HashIndex<KeyType,ValType>::
+		log_changes_() {
+
+	std::sort(logged_.begin(),logged_.end());
+	logged_.erase(std::unique(logged_.begin(),logged_.end()),logged_.end());
+	for (FilePos pos : logged_) {
+		// still pinned by the running operation
+		BufferPool::Page *page = pool_->fetch(this,pos);
+		assert(page != nullptr);
+		char block[kBucketSize] = {};
+		size_t length = encode_page_(pos,page,block);
+		wal_->append(filename_,pos == 0 ? IdxFile::kHashBucketsPos : pos,block,length);
+		pool_->unpin(this,pos);
+	}
+	logged_.clear();
+	std::vector<FilePos> pinned;
+	pinned.swap(pinned_);
+	wal_->afterDurable([this, pinned]() {
+		for (FilePos pos : pinned)
+			pool_->unpin(this,pos);
+	});
+}
+
+template <typename KeyType, typename ValType>
+void HashIndex<KeyType,ValType>::
+		finish_update_() {
+
+	if (wal_ != nullptr)
+		log_changes_();
+	else
+		unpin_all_();
+}
+
+template <typename KeyType, typename ValType>
+uint64_t HashIndex<KeyType,ValType>::
+		bucket_of_(const KeyType &key, uint64_t buckets) {
+
+	// buckets below buckets - low have been split already, their keys
+	// are spread over twice as many buckets
+	uint64_t low = kInitialBuckets;
+	while (low*2 <= buckets)
+		low *= 2;
+	uint64_t h = hash_key(key);
+	uint64_t bucket = h & (low*2 - 1);
+	if (bucket >= buckets)
+		bucket = h & (low - 1);
+	return bucket;
+}
+
+template <typename KeyType, typename ValType>
+FilePos HashIndex<KeyType,ValType>::
+		bucket_pos_(const Header *header, uint64_t bucket) const {
+
+	size_t seg = 0;
+	uint64_t first = 0, count = kInitialBuckets;
+	while (bucket >= first + count) {
+		first += count;
+		count = first;
+		++seg;
+	}
+	assert(header->segments[seg] != 0);
+	return header->segments[seg] + (bucket - first)*kBucketSize;
+}
+
+template <typename KeyType, typename ValType>
+FilePos HashIndex<KeyType,ValType>::
+		alloc_block_(Header *header) {
+
+	if (header->free == 0)
+		return IdxFile::consumeFreeSpace(file_,kBucketSize);
+	FilePos pos = header->free;
+	header->free = load_bucket_(pos)->next;
+	write_page_(0,header);
+	return pos;
+}
+
+template <typename KeyType, typename ValType>
+std::vector<ValType> HashIndex<KeyType,ValType>::
+		find(const KeyType &key) {
+
+	ON_SCOPE_EXIT([this]() { unpin_all_(); });
+	std::vector<ValType> retval;
+	Header *header = load_header_();
+	FilePos pos = bucket_pos_(header,bucket_of_(key,header->buckets));
+	while (pos != 0) {
+		Bucket *bucket = load_bucket_(pos);
+		for (short i = 0; i != bucket->slotuse; ++i)
+			if (bucket->keys[i] == key)
+				retval.push_back(bucket->data[i]);
+		pos = bucket->next;
+	}
+	return retval;
+}
+
+template <typename KeyType, typename ValType>
+void HashIndex<KeyType,ValType>::
+		insert(const KeyType &key, const ValType &value) {
+
+	ON_SCOPE_EXIT([this]() { finish_update_(); });
+	insert_(key,value);
+}
+
+template <typename KeyType, typename ValType>
+void HashIndex<KeyType,ValType>::
+		insertBatch(std::vector<std::pair<KeyType,ValType> > entries) {
+
+	ON_SCOPE_EXIT([this]() { finish_update_(); });
+	for (auto &entry : entries) {
+		insert_(entry.first,entry.second);
+		if (wal_ == nullptr)
+			unpin_all_(); // keep a long batch from pinning the whole index
+	}
+}
+
+template <typename KeyType, typename ValType>
+void HashIndex<KeyType,ValType>::
+		bulkLoad(const std::vector<std::pair<KeyType,ValType> > &entries) {
+
+	Wal *wal = wal_;
+	wal_ = nullptr;
+	insertBatch(entries);
+	pool_->flush(this);
+	file_.sync();
+	wal_ = wal;
+}
+
+template <typename KeyType, typename ValType>
+void HashIndex<KeyType,ValType>::
+		insert_(const KeyType &key, const ValType &value) {
+
+	Header *header = load_header_();
+	FilePos pos = bucket_pos_(header,bucket_of_(key,header->buckets));
+	Bucket *bucket = load_bucket_(pos);
+	while (bucket->next != 0) {
+		pos = bucket->next;
+		bucket = load_bucket_(pos);
+	}
+	if ((size_t)bucket->slotuse != BucketSlots) {
+		bucket->keys[bucket->slotuse] = key;
+		bucket->data[bucket->slotuse] = value;
+		bucket->slotuse += 1;
+		write_page_(pos,bucket);
+		return;
+	}
+	// the chain is full, overflow and let the table grow by a bucket
+	FilePos overflow_pos = alloc_block_(header);
+	Bucket *overflow = load_bucket_(overflow_pos);
+	overflow->slotuse = 1;
+	overflow->next = 0;
+	overflow->keys[0] = key;
+	overflow->data[0] = value;
+	bucket->next = overflow_pos;
+	write_page_(overflow_pos,overflow);
+	write_page_(pos,bucket);
+	split_(header);
+}
+
+template <typename KeyType, typename ValType>
+void HashIndex<KeyType,ValType>::
+		split_(Header *header) {
+
+	uint64_t low = kInitialBuckets;
+	while (low*2 <= header->buckets)
+		low *= 2;
+	uint64_t old_bucket = header->buckets - low;
+	uint64_t new_bucket = header->buckets;
+	// the first bucket of a segment reserves the whole segment
+	size_t seg = 0;
+	for (uint64_t first = kInitialBuckets; first <= new_bucket; first *= 2)
+		++seg;
+	assert(seg < kMaxSegments);
+	if (header->segments[seg] == 0) {
+		FilePos segpos = file_.size();
+		file_.resize(segpos + new_bucket*kBucketSize);
+		header->segments[seg] = segpos;
+	}
+	header->buckets += 1;
+	write_page_(0,header);
+
+	// take the chain of old_bucket apart
+	std::vector<std::pair<KeyType,ValType> > stay, move;
+	std::vector<FilePos> spare;
+	FilePos old_pos = bucket_pos_(header,old_bucket);
+	for (FilePos pos = old_pos; pos != 0; ) {
+		Bucket *bucket = load_bucket_(pos);
+		if (pos != old_pos)
+			spare.push_back(pos);
+		for (short i = 0; i != bucket->slotuse; ++i) {
+			std::pair<KeyType,ValType> entry(bucket->keys[i],bucket->data[i]);
+			if (bucket_of_(entry.first,header->buckets) == old_bucket)
+				stay.push_back(entry);
+			else
+				move.push_back(entry);
+		}
+		pos = bucket->next;
+	}
+	// the chains are rewritten from the front, blocks are reused from the
+	// back so that the first overflow block goes last
+	std::reverse(spare.begin(),spare.end());
+	fill_chain_(header,old_pos,stay,spare);
+	fill_chain_(header,bucket_pos_(header,new_bucket),move,spare);
+	// what is left over goes to the free list
+	for (FilePos pos : spare) {
+		Bucket *bucket = load_bucket_(pos);
+		bucket->slotuse = 0;
+		bucket->next = header->free;
+		header->free = pos;
+		write_page_(pos,bucket);
+	}
+	write_page_(0,header);
+}
+
+template <typename KeyType, typename ValType>
+void HashIndex<KeyType,ValType>::
+		fill_chain_(Header *header, FilePos pos,
+					const std::vector<std::pair<KeyType,ValType> > &entries,
+					std::vector<FilePos> &spare) {
+
+	Bucket *bucket = load_bucket_(pos);
+	bucket->slotuse = 0;
+	bucket->next = 0;
+	for (auto &entry : entries) {
+		if ((size_t)bucket->slotuse == BucketSlots) {
+			FilePos next_pos;
+			if (spare.empty()) {
+				next_pos = alloc_block_(header);
+			} else {
+				next_pos = spare.back();
+				spare.pop_back();
+			}
+			bucket->next = next_pos;
+			write_page_(pos,bucket);
+			pos = next_pos;
+			bucket = load_bucket_(pos);
+			bucket->slotuse = 0;
+			bucket->next = 0;
+		}
+		bucket->keys[bucket->slotuse] = entry.first;
+		bucket->data[bucket->slotuse] = entry.second;
+		bucket->slotuse += 1;
+	}
+	write_page_(pos,bucket);
+}
+
+#endif // HASHINDEX_HPP
@@ -0,0 +1,102 @@
+#include "idslots.h"
+#include <cassert>
+
+using namespace std;
+
+IdSlots::IdSlots(const string &filename, Wal *wal)
+	: filename_(filename), file_(filename), wal_(wal)
+{
+	if (file_.size() == 0)
+		file_.resize(sizeof(FilePos));
+}
+
+FilePos IdSlots::get(int64_t id) const {
+	FilePos slotpos = id * sizeof(FilePos);
+	if (id < 1 || slotpos + sizeof(FilePos) > (size_t)file_.size())
+		return 0;
+	// the latest range holding id wins
+	for (auto range = pending_.rbegin(); range != pending_.rend(); ++range) {
+		if (id >= range->first && id < range->first + (int64_t)range->second.size())
+			return range->second[id - range->first];
+	}
+	FilePos pos;
+	file_.readAt(slotpos,pos);
+	return pos;
+}
+
+void IdSlots::set(int64_t id, FilePos pos) {
+	setRange(id,vector<FilePos>(1,pos));
+}
+
+void IdSlots::setRange(int64_t first, const vector<FilePos> &positions) {
+	assert(first >= 1);
+	if (positions.empty())
+		return;
+	FilePos slotpos = first * sizeof(FilePos);
+	size_t length = positions.size() * sizeof(FilePos);
+	// grow ahead so that most inserts do not resize the file
+	if (slotpos + length > (size_t)file_.size())
+		file_.resize(slotpos + length + kGrowth * sizeof(FilePos));
+	if (wal_ == nullptr) {
+		file_.write(slotpos,positions.data(),length);
+		return;
+	}
+	// write ahead: the mapping gets the slots once the log has them on disk
+	wal_->append(filename_,slotpos,positions.data(),length);
+	pending_.push_back(make_pair(first,positions));
+	wal_->afterDurable([this]() {
+		auto &range = pending_.front();
+		file_.write(range.first * sizeof(FilePos),range.second.data(),
+					range.second.size() * sizeof(FilePos));
+		pending_.pop_front();
+	});
+}
+
+void IdSlots::bulkLoad(const vector<pair<int64_t,FilePos> > &entries) {
+	Wal *wal = wal_;
+	wal_ = nullptr;
+	for (auto &entry : entries)
+		set(entry.first,entry.second);
+	wal_ = wal;
+	file_.sync();
+}
+
+bool IdSlots::complete() const {
+	int64_t complete;
+	file_.readAt(kCompletePos,complete);
+	return complete == kComplete;
+}
+
+void IdSlots::markComplete() {
+	file_.sync();
+	int64_t complete = kComplete;
+	file_.writeAt(kCompletePos,complete);
+	file_.sync();
+}
+
+bool IdSlots::scan(int64_t &next, int64_t last, bool descending, size_t count,
+				   vector<FilePos> &retval) const {
+	// ids without a slot have no record
+	int64_t slots = file_.size() / sizeof(FilePos) - 1;
+	size_t found = 0;
+	if (descending) {
+		int64_t end = max(last,(int64_t)1);
+		for (next = min(next,slots); next >= end && found != count; --next) {
+			FilePos pos = get(next);
+			if (pos != 0) {
+				retval.push_back(pos);
+				++found;
+			}
+		}
+		return next < end;
+	}
+	int64_t end = min(last,slots);
+	for (next = max(next,(int64_t)1); next <= end && found != count; ++next) {
+		FilePos pos = get(next);
+		if (pos != 0) {
+			retval.push_back(pos);
+			++found;
+		}
+	}
+	return next > end;
+}
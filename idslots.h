@@ -0,0 +1,67 @@
+#ifndef IDSLOTS_H
+#define IDSLOTS_H
+
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+#include <cstdint>
+#include "diskfile.h"
+#include "kikutil.h"
+#include "wal.h"
+
+/*
+ * Id slots
+ * ----------------
+ * Where the record of every primary id is in tabname.dat, for tables
+ * whose id is addressed densely instead of through an index. Ids are
+ * handed out one after another from 1, so the position of id is kept
+ * at id * 8 in tabname_id.slots and found with a single read, the first
+ * 8 bytes say whether the slots were filled to the end.
+ * Records may take the place of ones freed earlier, which is why the
+ * position is stored rather than computed from the id.
+ *
+ * A slot holding 0 has no record. The file is grown kGrowth slots at a
+ * time and read through a memory mapping. With a log, slots are only
+ * written to the mapping once the log has them on disk, until then they
+ * are kept in pending_ and looked up there first.
+ */
+
+class IdSlots {
+	DISALLOW_COPY_AND_ASSIGN(IdSlots);
+public:
+	// wal makes set(...) log its changes, the caller commits them and
+	// calls Wal::applyDurable() to write them to the file
+	explicit IdSlots(const std::string &filename, Wal *wal = nullptr);
+
+	// the position of the record of id, 0 if there is none
+	FilePos get(int64_t id) const;
+	void set(int64_t id, FilePos pos);
+	// set(...) for the consecutive ids from first
+	void setRange(int64_t first, const std::vector<FilePos> &positions);
+	// fill empty slots with id -> position entries, written straight to
+	// the file and synced instead of logged like BPTree::bulkLoad
+	void bulkLoad(const std::vector<std::pair<int64_t,FilePos> > &entries);
+	// whether markComplete() was called on the file, slots whose fill
+	// was cut short are started over
+	bool complete() const;
+	// sync the slots, then mark them as holding every record
+	void markComplete();
+	// append to retval the positions of the records of ids from next to
+	// last (down to last if descending), at most count of them, and move
+	// next past the ids looked at; returns true once last is passed
+	bool scan(int64_t &next, int64_t last, bool descending, size_t count,
+			  std::vector<FilePos> &retval) const;
+private:
+	static const size_t kGrowth = 4096; // slots
+	static const FilePos kCompletePos = 0;
+	static const int64_t kComplete = 1; // never the position of a record
+
+	std::string filename_;
+	MappedFile file_;
+	Wal *wal_;
+	// logged ranges of slots not yet durable, first id -> positions
+	std::deque<std::pair<int64_t,std::vector<FilePos> > > pending_;
+};
+
+#endif // IDSLOTS_H
@@ -5,8 +5,10 @@
 #include <ctime>
 #include <clocale>
 #include <cctype>
+#include <functional>
 #include <ncurses.h>
 #include "naivedb.h"
+#include "timeline.h"
 #include "tweetop.h"
 
 using namespace std;
@@ -23,8 +25,10 @@ void viewTweets();
 void findPeople();
 void viewPeople(RecordHandle handle);
 void listFriends();
-void tweetPageView(const vector<TweetLine> &alltweets);
-void userPageView(const vector<RecordHandle> &allusers_handle);
+void tweetPageView(Timeline &timeline, vector<TweetLine> &alltweets);
+void resetHomeTimeline();
+// more(count) returns up to count more users, fewer only at the end
+void userPageView(std::function<vector<RecordHandle>(size_t)> more);
 
 /* Helper functions */
 void inputUntilCorrect(const char *prompt, char *input, bool(*test)(char*), const char *failprompt);
@@ -39,6 +43,10 @@ bool validTweet(char *tweet);
 /* Global variables */
 NaiveDB *db;
 int64_t uid;
+// home timeline of uid, kept over views and refreshed, with the tweets
+// read from it so far
+Timeline *home_timeline = nullptr;
+vector<TweetLine> home_tweets;
 
 void debug() {
 	db = new NaiveDB("benchmark.xml");
@@ -66,6 +74,7 @@ int main() {
 	cbreak();
 
 	db = new NaiveDB("db.xml");
+	TweetOp::prepareHomeTimelines(db);
 
 	welcome();
 
@@ -146,7 +155,20 @@ void newTweet() {
 
 void viewTweets() {
 	clear();
-	vector<TweetLine> alltweets;
+	if (home_timeline != nullptr) {
+		// only the tweets posted since the last view are read
+		home_timeline->refresh(home_tweets);
+		tweetPageView(*home_timeline,home_tweets);
+		clear();
+		return;
+	}
+	if (db->hasTable("hometl")) {
+		// materialized already
+		home_timeline = new Timeline(db,uid);
+		tweetPageView(*home_timeline,home_tweets);
+		clear();
+		return;
+	}
 	DBData uid_d(DBType::INT64);
 	uid_d.int64 = uid;
 	vector<RecordHandle> query_res = db->query("afob","a",uid_d);
@@ -157,38 +179,35 @@ void viewTweets() {
 			following_list.push_back(db->get(x,"b").int64);
 	}
 	following_list.push_back(uid);
-	for (int64_t publisher : following_list) {
-		DBData publisher_d(DBType::INT64);
-		publisher_d.int64 = publisher;
-		vector<RecordHandle> tweets_handle = db->query("tweets","publisher",publisher_d);
-		for (RecordHandle x : tweets_handle) {
-			bool deleted = db->get(x,"deleted").boolean;
-			if (!deleted) {
-				int32_t time = db->get(x,"time").int32;
-				int64_t author = db->get(x,"author").int64;
-				string content = db->get(x,"content").str;
-				alltweets.push_back(TweetLine(content,publisher,author,time));
-			}
-		}
-	}
-	// sort tweets by time
-	sort(alltweets.begin(),alltweets.end());
-	// show these tweets
-	tweetPageView(alltweets);
+	// show their tweets, newest first
+	home_timeline = new Timeline(db,following_list);
+	tweetPageView(*home_timeline,home_tweets);
 	clear();
 }
 
+// the set of publishers changes on follow and unfollow, the home timeline
+// is read again on the next view
+void resetHomeTimeline() {
+	delete home_timeline;
+	home_timeline = nullptr;
+	home_tweets.clear();
+}
+
 
-void tweetPageView(const vector<TweetLine> &alltweets) {
+void tweetPageView(Timeline &timeline, vector<TweetLine> &alltweets) {
 	static const int kTweetPerPage = 15;
 	int page = 1;
-	int max_page = (alltweets.size() - 1)/kTweetPerPage + 1;
-	if (alltweets.empty())
-		max_page = 1;
 	bool noexit = true;
 	while (noexit) {
+		// read up to this page, and one tweet more to tell if there is a next page
+		size_t wanted = (size_t)page*kTweetPerPage + 1;
+		if (alltweets.size() < wanted) {
+			vector<TweetLine> more = timeline.next(wanted - alltweets.size());
+			alltweets.insert(alltweets.end(),more.begin(),more.end());
+		}
+		bool has_next = alltweets.size() > (size_t)page*kTweetPerPage;
 		clear();
-		printw("Page : %d/%d\n",page,max_page);
+		printw("Page : %d%s\n",page,has_next ? " (more)" : "");
 		// print tweet
 		for (int i = (page-1)*kTweetPerPage;
 			 i < std::min(alltweets.size(),(size_t)page*kTweetPerPage);
@@ -223,7 +242,7 @@ void tweetPageView(const vector<TweetLine> &alltweets) {
 		noecho();
 		while (keypress = getch()) {
 			if (keypress == 'j' || keypress == 'J') {
-				if (page < max_page) {
+				if (has_next) {
 					++page;
 					break;
 				}
@@ -280,17 +299,7 @@ void viewPeople(RecordHandle handle) {
 	noecho();
 
 	if (id != uid) {
-		bool following = false;
-		DBData uid_d(DBType::INT64);
-		uid_d.int64 = uid;
-		vector<RecordHandle> query_res = db->query("afob","a",uid_d);
-		for (RecordHandle handle : query_res) {
-			if (id == db->get(handle,"b").int64 &&
-					db->get(handle,"deleted").boolean == false) {
-				following = true;
-				break;
-			}
-		}
+		bool following = TweetOp::isFollowing(db,uid,id);
 
 		if (following) {
 			printw("[u] to unfo [v] to view tweets [x] to return\n");
@@ -298,23 +307,13 @@ void viewPeople(RecordHandle handle) {
 			while (keypress = getch()) {
 				if (keypress == 'u' || keypress == 'U') {
 					TweetOp::unfollow(db,uid,id);
+					resetHomeTimeline();
 					break;
 				}
 				if (keypress == 'v' || keypress == 'V') {
-					DBData publisher_d(DBType::INT64);
-					publisher_d.int64 = id;
-					vector<RecordHandle> tweets_handle = db->query("tweets","publisher",publisher_d);
+					Timeline timeline(db,vector<int64_t>(1,id));
 					vector<TweetLine> alltweets;
-					for (RecordHandle x : tweets_handle) {
-						bool deleted = db->get(x,"deleted").boolean;
-						if (!deleted) {
-							int32_t time = db->get(x,"time").int32;
-							int64_t author = db->get(x,"author").int64;
-							string content = db->get(x,"content").str;
-							alltweets.push_back(TweetLine(content,id,author,time));
-						}
-					}
-					tweetPageView(alltweets);
+					tweetPageView(timeline,alltweets);
 				}
 				if (keypress == 'x' || keypress == 'X')
 					break;
@@ -325,23 +324,13 @@ void viewPeople(RecordHandle handle) {
 			while (keypress = getch()) {
 				if (keypress == 'f' || keypress == 'F') {
 					TweetOp::follow(db,uid,id);
+					resetHomeTimeline();
 					break;
 				}
 				if (keypress == 'v' || keypress == 'V') {
-					DBData publisher_d(DBType::INT64);
-					publisher_d.int64 = id;
-					vector<RecordHandle> tweets_handle = db->query("tweets","publisher",publisher_d);
+					Timeline timeline(db,vector<int64_t>(1,id));
 					vector<TweetLine> alltweets;
-					for (RecordHandle x : tweets_handle) {
-						bool deleted = db->get(x,"deleted").boolean;
-						if (!deleted) {
-							int32_t time = db->get(x,"time").int32;
-							int64_t author = db->get(x,"author").int64;
-							string content = db->get(x,"content").str;
-							alltweets.push_back(TweetLine(content,id,author,time));
-						}
-					}
-					tweetPageView(alltweets);
+					tweetPageView(timeline,alltweets);
 				}
 				if (keypress == 'x' || keypress == 'X')
 					break;
@@ -354,19 +343,24 @@ void viewPeople(RecordHandle handle) {
 	clear();
 }
 
-void userPageView(const vector<RecordHandle> &allusers_handle) {
+void userPageView(std::function<vector<RecordHandle>(size_t)> more) {
 	static const int kUserPerPage = 15;
 	int page = 1;
-	int max_page = (allusers_handle.size() - 1)/kUserPerPage + 1;
-	if (allusers_handle.empty())
-		max_page = 1;
+	vector<RecordHandle> allusers_handle; // users read so far
 	bool noexit = true;
 	while (noexit) {
+		// read up to this page, and one user more to tell if there is a next page
+		size_t wanted = (size_t)page*kUserPerPage + 1;
+		if (allusers_handle.size() < wanted) {
+			vector<RecordHandle> users = more(wanted - allusers_handle.size());
+			allusers_handle.insert(allusers_handle.end(),users.begin(),users.end());
+		}
+		bool has_next = allusers_handle.size() > (size_t)page*kUserPerPage;
 		clear();
-		printw("Page : %d/%d\n",page,max_page);
+		printw("Page : %d%s\n",page,has_next ? " (more)" : "");
 		// print user
 		for (int i = (page-1)*kUserPerPage;
-			 i != std::min(allusers_handle.size(),(size_t)page*kUserPerPage);
+			 i < std::min(allusers_handle.size(),(size_t)page*kUserPerPage);
 			 ++i) {
 			RecordHandle handle = allusers_handle[i];
 			printw("[%d] %s\n",i,db->get(handle,"user").str.c_str());
@@ -378,7 +372,7 @@ void userPageView(const vector<RecordHandle> &allusers_handle) {
 		noecho();
 		while (keypress = getch()) {
 			if (keypress == 'j' || keypress == 'J') {
-				if (page < max_page) {
+				if (has_next) {
 					++page;
 					break;
 				}
@@ -450,17 +444,22 @@ void findPeople() {
 			male_b = true;
 		else
 			male_b = false;
-		vector<RecordHandle> query_res = db->rangeQuery("userinfo","birthday",
-														birthday_f_d,birthday_l_d);
-		vector<RecordHandle> allusers_handle;
-		for (RecordHandle handle : query_res) {
-			if (db->get(handle,"deleted").boolean == false &&
-					db->get(handle,"male").boolean == male_b) {
-				// user that meet the requirement
-				allusers_handle.push_back(handle);
+		// users are read from the index only as the pages are turned
+		QueryCursor cursor = db->openRangeQuery("userinfo","birthday",
+												birthday_f_d,birthday_l_d);
+		userPageView([&cursor,male_b](size_t count) {
+			vector<RecordHandle> users;
+			while (users.size() != count && !cursor.done) {
+				for (RecordHandle handle : db->next(cursor,count - users.size())) {
+					if (db->get(handle,"deleted").boolean == false &&
+							db->get(handle,"male").boolean == male_b) {
+						// user that meet the requirement
+						users.push_back(handle);
+					}
+				}
 			}
-		}
-		userPageView(allusers_handle);
+			return users;
+		});
 		break;
 	}
 	case '3': {
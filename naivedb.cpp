@@ -1,4 +1,5 @@
 #include <cassert>
+#include <cstdio>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/xml_parser.hpp>
 #include "naivedb.h"
@@ -7,6 +8,216 @@
 using namespace std;
 using namespace boost::property_tree;
 
+namespace {
+
+// How the keys of an index are held in memory: integers and pairs as
+// they are, strings inline in the narrowest FixedKey that fits the column
+// or in a std::string when the column is longer than all of them
+enum class KeyRep {
+	INT32, INT64, FIXED16, FIXED32, FIXED64, STRING, PAIR
+};
+
+KeyRep keyRep(DBType type, size_t length) {
+	switch (type) {
+	case DBType::INT32:
+		return KeyRep::INT32;
+	case DBType::INT64:
+		return KeyRep::INT64;
+	case DBType::STRING:
+		if (length <= 16)
+			return KeyRep::FIXED16;
+		if (length <= 32)
+			return KeyRep::FIXED32;
+		if (length <= 64)
+			return KeyRep::FIXED64;
+		return KeyRep::STRING;
+	case DBType::PAIR:
+		return KeyRep::PAIR;
+	default:
+		assert(0);
+	}
+}
+
+// DBKey<KeyType>::of(...) a value as a key of an index, set(...) stores
+// a key back in a value of the column
+template <typename KeyType>
+struct DBKey;
+
+template <>
+struct DBKey<int32_t> {
+	static int32_t of(const DBData &value) { return value.int32; }
+	static void set(DBData &value, int32_t key) { value.int32 = key; }
+};
+
+template <>
+struct DBKey<int64_t> {
+	static int64_t of(const DBData &value) { return value.int64; }
+	static void set(DBData &value, int64_t key) { value.int64 = key; }
+};
+
+template <>
+struct DBKey<string> {
+	static const string& of(const DBData &value) { return value.str; }
+	static void set(DBData &value, const string &key) { value.str = key; }
+};
+
+template <size_t N>
+struct DBKey<FixedKey<N> > {
+	static FixedKey<N> of(const DBData &value) { return FixedKey<N>(value.str); }
+	static void set(DBData &value, const FixedKey<N> &key) { value.str = key.str(); }
+};
+
+template <>
+struct DBKey<DBPair> {
+	static const DBPair& of(const DBData &value) { return value.pair; }
+	static void set(DBData &value, const DBPair &key) { value.pair = key; }
+};
+
+// entries(...) keys[i] -> values[i] for every i, as keys of type KeyType
+template <typename KeyType, typename ValType>
+vector<pair<KeyType,ValType> > entries(const vector<DBData> &keys,
+									   const vector<ValType> &values) {
+	vector<pair<KeyType,ValType> > retval;
+	retval.reserve(keys.size());
+	for (size_t i = 0; i != keys.size(); ++i)
+		retval.push_back(make_pair(KeyType(DBKey<KeyType>::of(keys[i])),values[i]));
+	return retval;
+}
+
+// newTree(...) an index of keys of type, length is the size of string keys
+// a hash index when hashed, a BPTree of nodes of blocksize otherwise
+template <typename KeyType, typename ValType>
+void* newTree(const string &filename, bool hashed, size_t length, BufferPool *pool,
+			  bool mapped, Wal *wal, size_t blocksize) {
+	if (hashed)
+		return new HashIndex<KeyType,ValType>(filename,length,0,pool,wal);
+	return new BPTree<KeyType,ValType>(filename,length,0,pool,mapped,wal,blocksize);
+}
+
+// deleteTree(...) delete an index created by newTree(...)
+template <typename KeyType, typename ValType>
+void deleteTree(void *bptree, bool hashed) {
+	if (hashed)
+		delete static_cast<HashIndex<KeyType,ValType>*>(bptree);
+	else
+		delete static_cast<BPTree<KeyType,ValType>*>(bptree);
+}
+
+// index...(...) the exact match operations, which both kinds of index have
+template <typename KeyType, typename ValType>
+vector<ValType> indexFind(void *index, bool hashed, const DBData &key) {
+	if (hashed)
+		return static_cast<HashIndex<KeyType,ValType>*>(index)->find(DBKey<KeyType>::of(key));
+	return static_cast<BPTree<KeyType,ValType>*>(index)->find(DBKey<KeyType>::of(key));
+}
+
+template <typename KeyType, typename ValType>
+void indexInsert(void *index, bool hashed, const DBData &key, const ValType &value) {
+	if (hashed)
+		static_cast<HashIndex<KeyType,ValType>*>(index)->insert(DBKey<KeyType>::of(key),value);
+	else
+		static_cast<BPTree<KeyType,ValType>*>(index)->insert(DBKey<KeyType>::of(key),value);
+}
+
+template <typename KeyType, typename ValType>
+void indexInsertBatch(void *index, bool hashed, const vector<DBData> &keys,
+					  const vector<ValType> &values) {
+	if (hashed)
+		static_cast<HashIndex<KeyType,ValType>*>(index)->insertBatch(
+				entries<KeyType>(keys,values));
+	else
+		static_cast<BPTree<KeyType,ValType>*>(index)->insertBatch(
+				entries<KeyType>(keys,values));
+}
+
+template <typename KeyType, typename ValType>
+void indexBulkLoad(void *index, bool hashed, const vector<DBData> &keys,
+				   const vector<ValType> &values) {
+	if (hashed)
+		static_cast<HashIndex<KeyType,ValType>*>(index)->bulkLoad(
+				entries<KeyType>(keys,values));
+	else
+		static_cast<BPTree<KeyType,ValType>*>(index)->bulkLoad(
+				entries<KeyType>(keys,values));
+}
+
+// indexModify(...) runs BPTree::modify, a hash index includes no columns
+template <typename KeyType, typename ValType>
+bool indexModify(void *index, const DBData &key, const ValType &value) {
+	return static_cast<BPTree<KeyType,ValType>*>(index)->modify(DBKey<KeyType>::of(key),value);
+}
+
+template <typename KeyType, typename ValType>
+vector<ValType> indexRangeFind(void *index, const DBData &first, const DBData &last) {
+	return static_cast<BPTree<KeyType,ValType>*>(index)->rangeFind(
+			DBKey<KeyType>::of(first),DBKey<KeyType>::of(last));
+}
+
+// indexScan(...) runs BPTree::scan with cursor
+template <typename KeyType, typename ValType>
+vector<ValType> indexScan(void *index, QueryCursor &cursor, size_t count) {
+	BPTree<KeyType,ValType> *tree = static_cast<BPTree<KeyType,ValType>*>(index);
+	typename BPTree<KeyType,ValType>::Cursor tree_cursor =
+			tree->openCursor(DBKey<KeyType>::of(cursor.first),DBKey<KeyType>::of(cursor.last),
+							 cursor.descending);
+	tree_cursor.started = cursor.started;
+	tree_cursor.done = cursor.done;
+	tree_cursor.key = DBKey<KeyType>::of(cursor.key);
+	tree_cursor.skip = cursor.skip;
+	tree_cursor.leafpos = cursor.leafpos;
+	tree_cursor.index = cursor.index;
+	tree_cursor.version = cursor.version;
+	tree_cursor.path.swap(cursor.path);
+	tree_cursor.path_index.swap(cursor.path_index);
+	vector<ValType> retval;
+	tree->scan(tree_cursor,count,retval);
+	cursor.started = tree_cursor.started;
+	cursor.done = tree_cursor.done;
+	DBKey<KeyType>::set(cursor.key,tree_cursor.key);
+	cursor.skip = tree_cursor.skip;
+	cursor.leafpos = tree_cursor.leafpos;
+	cursor.index = tree_cursor.index;
+	cursor.version = tree_cursor.version;
+	cursor.path.swap(tree_cursor.path);
+	cursor.path_index.swap(tree_cursor.path_index);
+	return retval;
+}
+
+// widen(...) value of an integer or boolean column as int64, narrow(...)
+// turns it back into a value of type
+int64_t widen(const DBData &value) {
+	switch (value.type) {
+	case DBType::BOOLEAN:
+		return value.boolean;
+	case DBType::INT32:
+		return value.int32;
+	case DBType::INT64:
+		return value.int64;
+	default:
+		assert(0);
+	}
+}
+
+DBData narrow(DBType type, int64_t value) {
+	DBData retval(type);
+	switch (type) {
+	case DBType::BOOLEAN:
+		retval.boolean = (char)value;
+		break;
+	case DBType::INT32:
+		retval.int32 = (int)value;
+		break;
+	case DBType::INT64:
+		retval.int64 = value;
+		break;
+	default:
+		assert(0);
+	}
+	return retval;
+}
+
+}
+
 bool DBData::operator ==(const DBData &rval) {
 	if (type != rval.type)
 		return false;
@@ -19,6 +230,8 @@ bool DBData::operator ==(const DBData &rval) {
 		return int64 == rval.int64;
 	case DBType::STRING:
 		return str == rval.str;
+	case DBType::PAIR:
+		return pair == rval.pair;
 	default:
 		assert(0);
 	}
@@ -28,6 +241,24 @@ bool DBData::operator !=(const DBData &rval) {
 	return !(*this == rval);
 }
 
+bool DBData::operator <(const DBData &rval) const {
+	assert(type == rval.type);
+	switch (type) {
+	case DBType::BOOLEAN:
+		return boolean < rval.boolean;
+	case DBType::INT32:
+		return int32 < rval.int32;
+	case DBType::INT64:
+		return int64 < rval.int64;
+	case DBType::STRING:
+		return str < rval.str;
+	case DBType::PAIR:
+		return pair < rval.pair;
+	default:
+		assert(0);
+	}
+}
+
 DBData NaiveDB::getDBData_(fstream &stream,DBType type) {
 	DBData retval;
 	retval.type = type;
@@ -67,120 +298,432 @@ DBData NaiveDB::getDBData_(fstream &stream,DBType type) {
 	}
 }
 
-DBData NaiveDB::getDBDataAtPos_(fstream &stream, DBType type, FilePos pos) {
-	stream.seekg(pos);
-	return getDBData_(stream,type);
-}
-
-bool NaiveDB::compareDBDataAtPos_(fstream &stream, FilePos pos, DBData comp) {
-	DBData gotval = getDBDataAtPos_(stream,comp.type,pos);
-	return gotval == comp;
-}
-
-std::vector<FilePos> NaiveDB::rangeFindInBPTree_(void* bptree,const Column &col,DBData first,DBData last) {
+DBData NaiveDB::decodeDBData_(const char *src, const Column &col) {
+	DBData retval;
+	retval.type = col.type;
 	switch (col.type) {
+	case DBType::BOOLEAN:
+		retval.boolean = *src;
+		return retval;
 	case DBType::INT32: {
-		BPTree<int32_t,FilePos> *tree = static_cast<BPTree<int32_t,FilePos>*>(bptree);
-		return tree->rangeFind(first.int32,last.int32);
-	}
-	case DBType::INT64: {
-		BPTree<int64_t,FilePos> *tree = static_cast<BPTree<int64_t,FilePos>*>(bptree);
-		return tree->rangeFind(first.int64,last.int64);
-	}
-	case DBType::STRING: {
-		BPTree<string,FilePos> *tree = static_cast<BPTree<string,FilePos>*>(bptree);
-		return tree->rangeFind(first.str,last.str);
+		int32_t int32;
+		block_read(src,int32);
+		retval.int32 = int32;
+		return retval;
 	}
-	default: {
+	case DBType::INT64:
+		block_read(src,retval.int64);
+		return retval;
+	case DBType::STRING:
+		block_read_s(src,retval.str,col.length);
+		return retval;
+	default:
 		assert(0);
 	}
-	}
 }
 
-void NaiveDB::deleteBPTree_(void *bptree, const Column &col) {
+void NaiveDB::encodeDBData_(char *dest, const Column &col, const DBData &val) {
+	assert(val.type == col.type);
 	switch (col.type) {
+	case DBType::BOOLEAN:
+		block_write(dest,val.boolean);
+		break;
 	case DBType::INT32: {
-		BPTree<int32_t,FilePos> *tree = static_cast<BPTree<int32_t,FilePos>*>(bptree);
-		delete tree;
+		int32_t int32 = val.int32;
+		block_write(dest,int32);
 		break;
 	}
-	case DBType::INT64: {
-		BPTree<int64_t,FilePos> *tree = static_cast<BPTree<int64_t,FilePos>*>(bptree);
-		delete tree;
+	case DBType::INT64:
+		block_write(dest,val.int64);
 		break;
-	}
-	case DBType::STRING: {
-		BPTree<string,FilePos> *tree = static_cast<BPTree<string,FilePos>*>(bptree);
-		delete tree;
+	case DBType::STRING:
+		// dest is zero-filled by caller
+		block_write_s(dest,val.str,col.length);
 		break;
-	}
-	default: {
+	default:
 		assert(0);
 	}
+}
+
+DBData NaiveDB::getDBDataAtPos_(Table &tab, const Column &col, FilePos pos) {
+	if (!tab.pending.empty()) {
+		vector<char> field(col.length);
+		readDatAtPos_(tab,pos,field.data(),field.size());
+		return decodeDBData_(field.data(),col);
 	}
+	if (tab.mapped)
+		return decodeDBData_(tab.mapptr->at(pos),col);
+	tab.fileptr->seekg(pos);
+	return getDBData_(*tab.fileptr,col.type);
 }
 
-std::vector<FilePos> NaiveDB::findInBPTree_(void *bptree, const Column &col, DBData key) {
-	switch (col.type) {
-	case DBType::INT32: {
-		BPTree<int32_t,FilePos> *tree = static_cast<BPTree<int32_t,FilePos>*>(bptree);
-		return tree->find(key.int32);
+bool NaiveDB::compareDBDataAtPos_(Table &tab, const Column &col, FilePos pos, const DBData &comp) {
+	DBData gotval = getDBDataAtPos_(tab,col,pos);
+	return gotval == comp;
+}
+
+void NaiveDB::readDatAtPos_(Table &tab, FilePos pos, char *data, size_t length) {
+	if (tab.pending.empty()) {
+		readStoredDat_(tab,pos,data,length);
+		return;
 	}
-	case DBType::INT64: {
-		BPTree<int64_t,FilePos> *tree = static_cast<BPTree<int64_t,FilePos>*>(bptree);
-		return tree->find(key.int64);
+	// the file may not have grown to the pending writes yet
+	FilePos stored = storedDatSize_(tab);
+	size_t in_file = pos >= stored ? 0 : min((FilePos)length,stored - pos);
+	if (in_file > 0)
+		readStoredDat_(tab,pos,data,in_file);
+	memset(data + in_file,0,length - in_file);
+	// later writes go over earlier ones
+	for (auto &write : tab.pending) {
+		FilePos first = max(pos,write.first);
+		FilePos last = min(pos + length,write.first + write.second.size());
+		if (first < last)
+			memcpy(data + (first - pos),write.second.data() + (first - write.first),
+				   last - first);
 	}
-	case DBType::STRING: {
-		BPTree<string,FilePos> *tree = static_cast<BPTree<string,FilePos>*>(bptree);
-		return tree->find(key.str);
+}
+
+void NaiveDB::writeDatAtPos_(Table &tab, FilePos pos, const char *data, size_t length) {
+	if (wal_ == nullptr) {
+		storeDat_(tab,pos,data,length);
+		return;
 	}
-	default: {
+	// write ahead: the file gets the bytes once the log has them on disk
+	wal_->append(tab.filename,pos,data,length);
+	tab.pending.push_back(make_pair(pos,vector<char>(data,data + length)));
+	wal_->afterDurable([this,&tab]() {
+		auto &write = tab.pending.front();
+		storeDat_(tab,write.first,write.second.data(),write.second.size());
+		tab.pending.pop_front();
+	});
+}
+
+void NaiveDB::readStoredDat_(Table &tab, FilePos pos, char *data, size_t length) {
+	if (tab.mapped) {
+		tab.mapptr->read(pos,data,length);
+	} else {
+		tab.fileptr->seekg(pos);
+		tab.fileptr->read(data,length);
+	}
+}
+
+void NaiveDB::storeDat_(Table &tab, FilePos pos, const char *data, size_t length) {
+	if (tab.mapped) {
+		tab.mapptr->write(pos,data,length);
+	} else {
+		tab.fileptr->seekp(pos);
+		tab.fileptr->write(data,length);
+	}
+}
+
+FilePos NaiveDB::storedDatSize_(Table &tab) {
+	if (tab.mapped)
+		return tab.mapptr->size();
+	tab.fileptr->seekg(0,tab.fileptr->end);
+	return tab.fileptr->tellg();
+}
+
+FilePos NaiveDB::datFileSize_(Table &tab) {
+	FilePos size = storedDatSize_(tab);
+	for (auto &write : tab.pending)
+		size = max(size,write.first + (FilePos)write.second.size());
+	return size;
+}
+
+bool NaiveDB::isRecordDeleted_(Table &tab, FilePos recordpos) {
+	char deleted;
+	readDatAtPos_(tab,recordpos - sizeof(char),&deleted,sizeof(deleted));
+	return deleted == 1;
+}
+
+int64_t NaiveDB::increasePrimaryId_(Table &tab, int64_t count) {
+	int64_t pid;
+	readDatAtPos_(tab,DatFile::kPidPos,(char*)&pid,sizeof(pid));
+	int64_t new_pid = pid + count;
+	writeDatAtPos_(tab,DatFile::kPidPos,(const char*)&new_pid,sizeof(new_pid));
+	return pid + 1;
+}
+
+FilePos NaiveDB::consumeFreeSpace_(Table &tab) {
+	FilePos head;
+	readDatAtPos_(tab,DatFile::kFlHeadPos,(char*)&head,sizeof(head));
+	char deleted = 0;
+	if (head == 0) {
+		// append the deleted flag, the record follows it
+		FilePos flagpos = datFileSize_(tab);
+		writeDatAtPos_(tab,flagpos,&deleted,sizeof(deleted));
+		return flagpos + sizeof(deleted);
+	}
+	// take the first chunk off the free list
+	FilePos next;
+	readDatAtPos_(tab,head,(char*)&next,sizeof(next));
+	writeDatAtPos_(tab,DatFile::kFlHeadPos,(const char*)&next,sizeof(next));
+	writeDatAtPos_(tab,head - sizeof(deleted),&deleted,sizeof(deleted));
+	return head;
+}
+
+inline string indexFilename(const string &tabname, const string &colname) {
+	return tabname + "_" + colname + ".idx";
+}
+
+inline string slotsFilename(const string &tabname) {
+	return tabname + "_id.slots";
+}
+
+template <typename ValType>
+std::vector<ValType> NaiveDB::rangeFindInBPTree_(void* bptree,const Column &col,DBData first,DBData last) {
+	switch (keyRep(col.type,col.length)) {
+	case KeyRep::INT32:
+		return indexRangeFind<int32_t,ValType>(bptree,first,last);
+	case KeyRep::INT64:
+		return indexRangeFind<int64_t,ValType>(bptree,first,last);
+	case KeyRep::FIXED16:
+		return indexRangeFind<FixedKey<16>,ValType>(bptree,first,last);
+	case KeyRep::FIXED32:
+		return indexRangeFind<FixedKey<32>,ValType>(bptree,first,last);
+	case KeyRep::FIXED64:
+		return indexRangeFind<FixedKey<64>,ValType>(bptree,first,last);
+	case KeyRep::STRING:
+		return indexRangeFind<string,ValType>(bptree,first,last);
+	case KeyRep::PAIR:
+		return indexRangeFind<DBPair,ValType>(bptree,first,last);
+	default:
+		assert(0);
+	}
+}
+
+template <typename ValType>
+std::vector<ValType> NaiveDB::scanBPTree_(void* bptree,const Column &col,QueryCursor &cursor,size_t count) {
+	switch (keyRep(col.type,col.length)) {
+	case KeyRep::INT32:
+		return indexScan<int32_t,ValType>(bptree,cursor,count);
+	case KeyRep::INT64:
+		return indexScan<int64_t,ValType>(bptree,cursor,count);
+	case KeyRep::FIXED16:
+		return indexScan<FixedKey<16>,ValType>(bptree,cursor,count);
+	case KeyRep::FIXED32:
+		return indexScan<FixedKey<32>,ValType>(bptree,cursor,count);
+	case KeyRep::FIXED64:
+		return indexScan<FixedKey<64>,ValType>(bptree,cursor,count);
+	case KeyRep::STRING:
+		return indexScan<string,ValType>(bptree,cursor,count);
+	case KeyRep::PAIR:
+		return indexScan<DBPair,ValType>(bptree,cursor,count);
+	default:
 		assert(0);
 	}
+}
+
+template <typename ValType>
+std::vector<ValType> NaiveDB::findInBPTree_(void *bptree, const Column &col, DBData key) {
+	switch (keyRep(col.type,col.length)) {
+	case KeyRep::INT32:
+		return indexFind<int32_t,ValType>(bptree,col.hashed,key);
+	case KeyRep::INT64:
+		return indexFind<int64_t,ValType>(bptree,col.hashed,key);
+	case KeyRep::FIXED16:
+		return indexFind<FixedKey<16>,ValType>(bptree,col.hashed,key);
+	case KeyRep::FIXED32:
+		return indexFind<FixedKey<32>,ValType>(bptree,col.hashed,key);
+	case KeyRep::FIXED64:
+		return indexFind<FixedKey<64>,ValType>(bptree,col.hashed,key);
+	case KeyRep::STRING:
+		return indexFind<string,ValType>(bptree,col.hashed,key);
+	case KeyRep::PAIR:
+		return indexFind<DBPair,ValType>(bptree,col.hashed,key);
+	default:
+		assert(0);
 	}
 }
 
-void NaiveDB::insertInBPTree_(void* bptree,const Column &col,DBData key, FilePos value) {
+template <typename ValType>
+void NaiveDB::insertBatchInBPTree_(void* bptree,const Column &col,
+								   const vector<DBData> &keys,
+								   const vector<ValType> &values) {
 
-	switch (col.type) {
-	case DBType::INT32: {
-		BPTree<int32_t,FilePos> *tree = static_cast<BPTree<int32_t,FilePos>*>(bptree);
-		tree->insert(key.int32,value);
+	switch (keyRep(col.type,col.length)) {
+	case KeyRep::INT32:
+		indexInsertBatch<int32_t,ValType>(bptree,col.hashed,keys,values);
+		return;
+	case KeyRep::INT64:
+		indexInsertBatch<int64_t,ValType>(bptree,col.hashed,keys,values);
+		return;
+	case KeyRep::FIXED16:
+		indexInsertBatch<FixedKey<16>,ValType>(bptree,col.hashed,keys,values);
 		return;
+	case KeyRep::FIXED32:
+		indexInsertBatch<FixedKey<32>,ValType>(bptree,col.hashed,keys,values);
+		return;
+	case KeyRep::FIXED64:
+		indexInsertBatch<FixedKey<64>,ValType>(bptree,col.hashed,keys,values);
+		return;
+	case KeyRep::STRING:
+		indexInsertBatch<string,ValType>(bptree,col.hashed,keys,values);
+		return;
+	case KeyRep::PAIR:
+		indexInsertBatch<DBPair,ValType>(bptree,col.hashed,keys,values);
+		return;
+	default:
+		assert(0);
 	}
-	case DBType::INT64: {
-		BPTree<int64_t,FilePos> *tree = static_cast<BPTree<int64_t,FilePos>*>(bptree);
-		tree->insert(key.int64,value);
+}
+
+template <typename ValType>
+void NaiveDB::bulkLoadBPTree_(void* bptree,const Column &col,
+							  const vector<DBData> &keys,
+							  const vector<ValType> &values) {
+
+	switch (keyRep(col.type,col.length)) {
+	case KeyRep::INT32:
+		indexBulkLoad<int32_t,ValType>(bptree,col.hashed,keys,values);
 		return;
+	case KeyRep::INT64:
+		indexBulkLoad<int64_t,ValType>(bptree,col.hashed,keys,values);
+		return;
+	case KeyRep::FIXED16:
+		indexBulkLoad<FixedKey<16>,ValType>(bptree,col.hashed,keys,values);
+		return;
+	case KeyRep::FIXED32:
+		indexBulkLoad<FixedKey<32>,ValType>(bptree,col.hashed,keys,values);
+		return;
+	case KeyRep::FIXED64:
+		indexBulkLoad<FixedKey<64>,ValType>(bptree,col.hashed,keys,values);
+		return;
+	case KeyRep::STRING:
+		indexBulkLoad<string,ValType>(bptree,col.hashed,keys,values);
+		return;
+	case KeyRep::PAIR:
+		indexBulkLoad<DBPair,ValType>(bptree,col.hashed,keys,values);
+		return;
+	default:
+		assert(0);
 	}
-	case DBType::STRING: {
-		BPTree<string,FilePos> *tree = static_cast<BPTree<string,FilePos>*>(bptree);
-		tree->insert(key.str,value);
+}
+
+template <typename ValType>
+void NaiveDB::insertInBPTree_(void* bptree,const Column &col,DBData key, const ValType &value) {
+
+	switch (keyRep(col.type,col.length)) {
+	case KeyRep::INT32:
+		indexInsert<int32_t,ValType>(bptree,col.hashed,key,value);
+		return;
+	case KeyRep::INT64:
+		indexInsert<int64_t,ValType>(bptree,col.hashed,key,value);
+		return;
+	case KeyRep::FIXED16:
+		indexInsert<FixedKey<16>,ValType>(bptree,col.hashed,key,value);
+		return;
+	case KeyRep::FIXED32:
+		indexInsert<FixedKey<32>,ValType>(bptree,col.hashed,key,value);
+		return;
+	case KeyRep::FIXED64:
+		indexInsert<FixedKey<64>,ValType>(bptree,col.hashed,key,value);
+		return;
+	case KeyRep::STRING:
+		indexInsert<string,ValType>(bptree,col.hashed,key,value);
 		return;
+	case KeyRep::PAIR:
+		indexInsert<DBPair,ValType>(bptree,col.hashed,key,value);
+		return;
+	default:
+		assert(0);
 	}
-	default: {
+}
+
+bool NaiveDB::modifyInBPTree_(void* bptree,const Column &col,DBData key, const CoveredPos &value) {
+
+	switch (keyRep(col.type,col.length)) {
+	case KeyRep::INT32:
+		return indexModify<int32_t,CoveredPos>(bptree,key,value);
+	case KeyRep::INT64:
+		return indexModify<int64_t,CoveredPos>(bptree,key,value);
+	case KeyRep::FIXED16:
+		return indexModify<FixedKey<16>,CoveredPos>(bptree,key,value);
+	case KeyRep::FIXED32:
+		return indexModify<FixedKey<32>,CoveredPos>(bptree,key,value);
+	case KeyRep::FIXED64:
+		return indexModify<FixedKey<64>,CoveredPos>(bptree,key,value);
+	case KeyRep::STRING:
+		return indexModify<string,CoveredPos>(bptree,key,value);
+	case KeyRep::PAIR:
+		return indexModify<DBPair,CoveredPos>(bptree,key,value);
+	default:
 		assert(0);
 	}
+}
+
+template <typename ValType>
+void* NaiveDB::newTree_(const string &tabname, const Column &col) {
+	string filename = indexFilename(tabname,col.name);
+	// string keys are as long as the column, the others as their type
+	size_t length = col.type == DBType::STRING ? col.length : 0;
+	switch (keyRep(col.type,col.length)) {
+	case KeyRep::INT32:
+		return newTree<int32_t,ValType>(filename,col.hashed,length,&pool_,col.index_mapped,wal_,
+											col.index_blocksize);
+	case KeyRep::INT64:
+		return newTree<int64_t,ValType>(filename,col.hashed,length,&pool_,col.index_mapped,wal_,
+											col.index_blocksize);
+	case KeyRep::FIXED16:
+		return newTree<FixedKey<16>,ValType>(filename,col.hashed,length,&pool_,col.index_mapped,wal_,
+											col.index_blocksize);
+	case KeyRep::FIXED32:
+		return newTree<FixedKey<32>,ValType>(filename,col.hashed,length,&pool_,col.index_mapped,wal_,
+											col.index_blocksize);
+	case KeyRep::FIXED64:
+		return newTree<FixedKey<64>,ValType>(filename,col.hashed,length,&pool_,col.index_mapped,wal_,
+											col.index_blocksize);
+	case KeyRep::STRING:
+		return newTree<string,ValType>(filename,col.hashed,length,&pool_,col.index_mapped,wal_,
+											col.index_blocksize);
+	case KeyRep::PAIR:
+		return newTree<DBPair,ValType>(filename,col.hashed,length,&pool_,col.index_mapped,wal_,
+											col.index_blocksize);
+	default:
+		assert(0);
 	}
 }
 
-void* NaiveDB::newBPTree_(const string &tabname, const Column &col) {
-	void* addr;
-	string filename = tabname + "_" + col.name + ".idx";
-	switch (col.type) {
-	case DBType::INT32:
-		addr = new BPTree<int32_t,FilePos>(filename);
-		return addr;
-	case DBType::INT64:
-		addr = new BPTree<int64_t,FilePos>(filename);
-		return addr;
-	case DBType::STRING:
-		addr = new BPTree<string,FilePos>(filename,col.length);
-		return addr;
+template <typename ValType>
+void NaiveDB::deleteTree_(void *bptree, const Column &col) {
+	switch (keyRep(col.type,col.length)) {
+	case KeyRep::INT32:
+		deleteTree<int32_t,ValType>(bptree,col.hashed);
+		return;
+	case KeyRep::INT64:
+		deleteTree<int64_t,ValType>(bptree,col.hashed);
+		return;
+	case KeyRep::FIXED16:
+		deleteTree<FixedKey<16>,ValType>(bptree,col.hashed);
+		return;
+	case KeyRep::FIXED32:
+		deleteTree<FixedKey<32>,ValType>(bptree,col.hashed);
+		return;
+	case KeyRep::FIXED64:
+		deleteTree<FixedKey<64>,ValType>(bptree,col.hashed);
+		return;
+	case KeyRep::STRING:
+		deleteTree<string,ValType>(bptree,col.hashed);
+		return;
+	case KeyRep::PAIR:
+		deleteTree<DBPair,ValType>(bptree,col.hashed);
+		return;
 	default:
 		assert(0);
 	}
+}
 
+void* NaiveDB::newBPTree_(const string &tabname, const Column &col) {
+	if (col.included.empty())
+		return newTree_<FilePos>(tabname,col);
+	return newTree_<CoveredPos>(tabname,col);
+}
+
+void NaiveDB::deleteBPTree_(void *bptree, const Column &col) {
+	if (col.included.empty())
+		deleteTree_<FilePos>(bptree,col);
+	else
+		deleteTree_<CoveredPos>(bptree,col);
 }
 
 void NaiveDB::debug() {
@@ -203,7 +746,34 @@ inline DBType getTypeFromStr(const string &str) {
 void NaiveDB::loadMeta_(const string &dbname) {
 	ptree pt;
 	read_xml(dbname, pt);
+	// <bufferpool> optional, memory budget of index cache in MB
+	size_t pool_mb = pt.get<size_t>("database.bufferpool",
+			BufferPool::kDefaultBudget >> 20);
+	pool_.setBudget(pool_mb << 20);
+	// <dirtypercent> optional, share of the budget dirty pages may take
+	pool_.setDirtyPercent(pt.get<size_t>("database.dirtypercent",
+			BufferPool::kDefaultDirtyPercent));
+	// <wal> optional, file name of the write-ahead log
+	string walname = pt.get<string>("database.wal","");
+	if (!walname.empty())
+		wal_ = new Wal(walname);
 	pt = pt.get_child("database.tables");
+	// <include> optional, the integer or boolean columns an index carries
+	auto included = [](const Table &tab, const ptree &index) {
+		vector<size_t> retval;
+		ptree include_pt = index.get_child("include",ptree());
+		for (auto include_iter : include_pt) {
+			size_t pos = tab.colname_index.at(include_iter.second.get_value<string>());
+			assert(pos != 0); // the id is not known to the rows inserted
+			DBType type = tab.schema[pos].type;
+			assert(type == DBType::INT32 || type == DBType::INT64 ||
+				   type == DBType::BOOLEAN);
+			(void)type;
+			retval.push_back(pos);
+		}
+		assert(retval.size() <= kMaxIncluded);
+		return retval;
+	};
 
 	// For every table
 	for (auto tab_iter : pt) {
@@ -211,13 +781,32 @@ void NaiveDB::loadMeta_(const string &dbname) {
 		// Get table name
 		string tabname = tab_pt.get<string>("name");
 		// Initialize table
+		tables_[tabname].filename = tabname + ".dat";
 		tables_[tabname].data_length = 0;
+		// <storage> optional, "mmap" maps tabname.dat into memory
+		tables_[tabname].mapped =
+				tab_pt.get<string>("storage","stream") == "mmap";
+		tables_[tabname].fileptr = nullptr;
+		tables_[tabname].mapptr = nullptr;
 
 		// add pid info in schema
 		Column idcol;
 		idcol.name = "id";
 		idcol.length = 8;
-		idcol.indexed = true;
+		// <idindexstorage> optional, "mmap" maps the id index into memory
+		idcol.index_mapped =
+				tab_pt.get<string>("idindexstorage","pool") == "mmap";
+		// <idindextype> optional, "hash" makes the id index a HashIndex,
+		// "dense" replaces it with IdSlots
+		string idindextype = tab_pt.get<string>("idindextype","btree");
+		idcol.hashed = idindextype == "hash";
+		assert(!(idcol.hashed && idcol.index_mapped));
+		// <idindexblocksize> optional, bytes of a node of the id index
+		idcol.index_blocksize = tab_pt.get<size_t>("idindexblocksize",kBlockSize);
+		assert(!idcol.hashed || idcol.index_blocksize == kBlockSize);
+		tables_[tabname].dense_ids = idindextype == "dense";
+		tables_[tabname].id_slots = nullptr;
+		idcol.indexed = !tables_[tabname].dense_ids;
 		idcol.type = DBType::INT64;
 		idcol.unique = true;
 		idcol.offset = 0;
@@ -256,11 +845,25 @@ void NaiveDB::loadMeta_(const string &dbname) {
 				newcol.indexed = true;
 			else
 				newcol.indexed = false;
+			// <indexstorage> optional, "mmap" maps the index into memory
+			newcol.index_mapped =
+					col.get<string>("indexstorage","pool") == "mmap";
+			// <indextype> optional, "hash" makes the index a HashIndex,
+			// which only finds exact matches
+			newcol.hashed = col.get<string>("indextype","btree") == "hash";
+			// <indexblocksize> optional, bytes of a node of the index,
+			// larger nodes make for fewer reads of long range scans
+			newcol.index_blocksize = col.get<size_t>("indexblocksize",kBlockSize);
 			// <unique>
 			if (col.get<string>("unique") == "yes")
 				newcol.unique = true;
 			else
 				newcol.unique = false;
+			// a hash index keeps duplicates in overflow blocks splits
+			// can not spread, it is for unique columns only
+			assert(!newcol.hashed || (newcol.indexed && newcol.unique &&
+									  !newcol.index_mapped &&
+									  newcol.index_blocksize == kBlockSize));
 			// set offset
 			newcol.offset = tables_[tabname].data_length;
 
@@ -271,29 +874,284 @@ void NaiveDB::loadMeta_(const string &dbname) {
 			// add column size to the table size counter
 			tables_[tabname].data_length += newcol.length;
 		}
+		// included columns may come after the indexed one
+		for (auto col_iter : cols_pt) {
+			ptree col = col_iter.second;
+			Table &tab = tables_[tabname];
+			Column &indexcol = tab.schema[tab.colname_index.at(col.get<string>("name"))];
+			indexcol.included = included(tab,col);
+			assert(indexcol.included.empty() || (indexcol.indexed && !indexcol.hashed));
+		}
+		// <indexes> optional, composite indexes over two integer columns
+		ptree indexes_pt = tab_pt.get_child("indexes",ptree());
+		for (auto index_iter : indexes_pt) {
+			ptree index = index_iter.second;
+			Column newindex;
+			newindex.name = index.get<string>("name");
+			newindex.indexed = true;
+			newindex.index_mapped =
+					index.get<string>("indexstorage","pool") == "mmap";
+			newindex.hashed = false;
+			newindex.index_blocksize = index.get<size_t>("indexblocksize",kBlockSize);
+			newindex.unique = false;
+			newindex.type = DBType::PAIR;
+			newindex.length = 0;
+			newindex.offset = 0;
+			for (auto part_iter : index.get_child("columns")) {
+				size_t part = tables_[tabname].colname_index.at(
+						part_iter.second.get_value<string>());
+				assert(part != 0); // id is unique on its own
+				DBType type = tables_[tabname].schema[part].type;
+				assert(type == DBType::INT32 || type == DBType::INT64);
+				(void)type;
+				newindex.parts.push_back(part);
+			}
+			assert(newindex.parts.size() == 2);
+			newindex.included = included(tables_[tabname],index);
+			assert(tables_[tabname].colname_index.count(newindex.name) == 0);
+			tables_[tabname].composites.push_back(newindex);
+		}
 	}
 }
 
 void NaiveDB::loadIndex_() {
+	// indexes whose build was cut short, or added to the schema of a
+	// table that already has records
+	vector<pair<string,const Column*> > missing;
 	for (auto &iter : tables_) {
 		string tabname = iter.first;
-		for (Column &col : iter.second.schema)
+		Table &tab = iter.second;
+		// the id index or slots of the other mode would not be kept up to
+		// date, they are dropped
+		string slotsname = slotsFilename(tabname);
+		if (tab.dense_ids) {
+			remove(indexFilename(tabname,"id").c_str());
+			tab.id_slots = new IdSlots(slotsname,wal_);
+			if (!tab.id_slots->complete()) {
+				// new, or filled by a build that was cut short
+				delete tab.id_slots;
+				remove(slotsname.c_str());
+				tab.id_slots = new IdSlots(slotsname,wal_);
+				if (datFileSize_(tab) > DatFile::kRecordStartPos)
+					missing.push_back(make_pair(tabname,&tab.schema[0]));
+				else
+					tab.id_slots->markComplete();
+			}
+		} else
+			remove(slotsname.c_str());
+		vector<const Column*> indexes;
+		for (const Column &col : tab.schema)
 			if (col.indexed)
-				iter.second.bptree[col.name] = newBPTree_(tabname,col);
+				indexes.push_back(&col);
+		for (const Column &index : tab.composites)
+			indexes.push_back(&index);
+		for (const Column *col : indexes) {
+			string filename = indexFilename(tabname,col->name);
+			if (fileExists(filename.c_str())) {
+				// an index whose included columns or kind changed is built
+				// again, a hash index has no root. So is a B+tree of long
+				// string keys written before its nodes were prefixed, a
+				// B+tree whose nodes are not of the size asked for, or an
+				// index whose build was cut short
+				int32_t valsize = 0, blocksize = 0;
+				FilePos rootpos = 0;
+				char format = IdxFile::SLOT_KEYS, complete = 0;
+				PosFile file(filename);
+				file.readAt(IdxFile::kValSizePos,valsize);
+				file.readAt(IdxFile::kRootPointerPos,rootpos);
+				file.readAt(IdxFile::kBlockSizePos,blocksize);
+				file.readAt(IdxFile::kCompletePos,complete);
+				if (rootpos != 0)
+					file.readAt(IdxFile::kKeyFormatPos,format);
+				char expected = keyRep(col->type,col->length) == KeyRep::STRING ?
+						IdxFile::PREFIX_KEYS : IdxFile::SLOT_KEYS;
+				// a changed <indexblocksize> costs a whole build, say so
+				bool resized = (size_t)blocksize != col->index_blocksize;
+				if (resized)
+					fprintf(stderr,"%s: blocks of %d bytes instead of %zu, building it again\n",
+							filename.c_str(),blocksize,col->index_blocksize);
+				if (valsize != (int32_t)(col->included.empty() ? sizeof(FilePos) :
+										 sizeof(CoveredPos)) ||
+					(rootpos == 0) != col->hashed || (rootpos != 0 && format != expected) ||
+					resized || complete != 1)
+					remove(filename.c_str());
+			}
+			bool created = !fileExists(filename.c_str());
+			tab.bptree[col->name] = newBPTree_(tabname,*col);
+			if (!created)
+				continue;
+			if (datFileSize_(tab) > DatFile::kRecordStartPos)
+				missing.push_back(make_pair(tabname,col));
+			else
+				IdxFile::markComplete(filename);
+		}
+	}
+	if (missing.empty())
+		return;
+	// nothing in the log may be redone into the new index files
+	if (wal_ != nullptr)
+		checkpoint_();
+	for (auto &index : missing)
+		buildIndex_(index.first,*index.second);
+}
+
+NaiveDB::Column& NaiveDB::indexColumn_(Table &tab, const string &name) {
+	auto iter = tab.colname_index.find(name);
+	if (iter != tab.colname_index.end())
+		return tab.schema.at(iter->second);
+	for (Column &index : tab.composites)
+		if (index.name == name)
+			return index;
+	throw out_of_range(name);
+}
+
+DBData NaiveDB::indexKey_(Table &tab, const Column &index, const vector<DBData> *row,
+						  FilePos recordpos) {
+	if (index.type != DBType::PAIR) {
+		if (row != nullptr)
+			return (*row)[tab.colname_index.at(index.name) - 1];
+		return getDBDataAtPos_(tab,index,recordpos + index.offset);
 	}
+	DBData key(DBType::PAIR);
+	int64_t values[2];
+	for (size_t i = 0; i != 2; ++i) {
+		const Column &part = tab.schema[index.parts[i]];
+		values[i] = widen(row != nullptr ? (*row)[index.parts[i] - 1] :
+				getDBDataAtPos_(tab,part,recordpos + part.offset));
+	}
+	key.pair = DBPair(values[0],values[1]);
+	return key;
+}
+
+CoveredPos NaiveDB::coveredValue_(Table &tab, const Column &index,
+								  const vector<DBData> *row, FilePos recordpos) {
+	CoveredPos value;
+	value.pos = recordpos;
+	for (size_t i = 0; i != kMaxIncluded; ++i) {
+		if (i == index.included.size()) {
+			value.included[i] = 0;
+			continue;
+		}
+		const Column &col = tab.schema[index.included[i]];
+		value.included[i] = widen(row != nullptr ? (*row)[index.included[i] - 1] :
+				getDBDataAtPos_(tab,col,recordpos + col.offset));
+	}
+	return value;
+}
+
+void NaiveDB::modifyCovered_(Table &tab, const Column &index, FilePos recordpos) {
+	DBData key = indexKey_(tab,index,nullptr,recordpos);
+	bool found = modifyInBPTree_(tab.bptree[index.name],index,key,
+								 coveredValue_(tab,index,nullptr,recordpos));
+	assert(found);
+}
+void NaiveDB::insertInIndex_(Table &tab, const Column &col, const vector<DBData> &row,
+							 FilePos recordpos) {
+	DBData key = indexKey_(tab,col,&row,recordpos);
+	if (col.included.empty())
+		insertInBPTree_(tab.bptree[col.name],col,key,recordpos);
+	else
+		insertInBPTree_(tab.bptree[col.name],col,key,coveredValue_(tab,col,&row,recordpos));
+}
+
+vector<RecordHandle> NaiveDB::handles_(const string &tabname, const Column &col,
+									   const vector<FilePos> &values) {
+	vector<RecordHandle> retval;
+	for (FilePos x : values)
+		retval.push_back(RecordHandle(tabname,x));
+	return retval;
 }
 
-NaiveDB::NaiveDB(const string &dbname) {
+vector<RecordHandle> NaiveDB::handles_(const string &tabname, const Column &col,
+									   const vector<CoveredPos> &values) {
+	vector<RecordHandle> retval;
+	for (const CoveredPos &x : values) {
+		RecordHandle handle(tabname,x.pos);
+		for (size_t i = 0; i != col.included.size(); ++i) {
+			handle.included_cols[i] = col.included[i];
+			handle.included[i] = x.included[i];
+		}
+		retval.push_back(handle);
+	}
+	return retval;
+}
+
+NaiveDB::NaiveDB(const string &dbname) : wal_(nullptr), stopping_(false) {
 	loadMeta_(dbname);
+	// bring the data files up to date before anybody opens them
+	if (wal_ != nullptr)
+		wal_->replay();
 	prepareDatFile_();
 	loadIndex_();
+	checkpointer_ = thread(&NaiveDB::checkpointLoop_,this);
+}
+
+void NaiveDB::checkpointLoop_() {
+	unique_lock<mutex> lock(mutex_);
+	while (!stopping_) {
+		checkpointer_wakeup_.wait_for(lock,chrono::milliseconds(kCheckpointInterval));
+		// pages of durable operations can only be written back once they
+		// are let go of
+		applyDurable_();
+		// pages are written back a few at a time between operations, the
+		// pages still pinned belong to operations that are not durable
+		while (!stopping_ && pool_.dirtyUsage() > pool_.dirtyLimit() / 2) {
+			if (pool_.writeBack(kCheckpointPages) == 0)
+				break;
+			lock.unlock();
+			this_thread::yield();
+			lock.lock();
+		}
+	}
+}
+
+void NaiveDB::checkpoint_() {
+	// nothing may be held back once the log is gone
+	wal_->sync();
+	wal_->applyDurable();
+	pool_.flushAll();
+	for (auto &pair : tables_) {
+		Table &tab = pair.second;
+		if (tab.fileptr != nullptr)
+			tab.fileptr->flush();
+		syncFile(tab.filename);
+		if (tab.id_slots != nullptr)
+			syncFile(slotsFilename(pair.first));
+		for (Column &col : tab.schema)
+			if (col.indexed)
+				syncFile(indexFilename(pair.first,col.name));
+		for (Column &index : tab.composites)
+			syncFile(indexFilename(pair.first,index.name));
+	}
+	wal_->truncate();
+}
+
+uint64_t NaiveDB::commit_() {
+	if (wal_ == nullptr)
+		return 0;
+	return wal_->commit();
+}
+
+void NaiveDB::waitDurable_(uint64_t lsn) {
+	if (wal_ != nullptr)
+		wal_->waitDurable(lsn);
+}
+
+void NaiveDB::applyDurable_() {
+	if (wal_ != nullptr)
+		wal_->applyDurable();
 }
 
 void NaiveDB::prepareDatFile_() {
 	for (auto &pair : tables_) {
-		string filename = pair.first + ".dat";
 		Table &tab = pair.second;
-		if (!fileExists(filename.c_str())) {
+		const string &filename = tab.filename;
+		if (tab.mapped) {
+			tab.mapptr = new MappedFile(filename);
+			// an empty dat file holds only the zeroed header
+			if (tab.mapptr->size() == 0)
+				tab.mapptr->resize(DatFile::kRecordStartPos - 1);
+		} else if (!fileExists(filename.c_str())) {
 			// create an empty dat file
 			tab.fileptr = new fstream(filename, ios::out | ios::binary);
 			char byte = 0;
@@ -305,77 +1163,175 @@ void NaiveDB::prepareDatFile_() {
 	}
 }
 
-void NaiveDB::insert(const string &tabname, std::vector<DBData> line) {
+bool NaiveDB::hasTable(const string &tabname) const {
+	return tables_.count(tabname) != 0;
+}
+
+int64_t NaiveDB::lastId(const string &tabname) {
+	lock_guard<mutex> lock(mutex_);
+	Table &target_tab = tables_.at(tabname);
+	int64_t pid;
+	readDatAtPos_(target_tab,DatFile::kPidPos,(char*)&pid,sizeof(pid));
+	return pid;
+}
+
+RecordHandle NaiveDB::insert(const string &tabname, std::vector<DBData> line) {
+	uint64_t lsn;
+	FilePos record_pos;
+	{
+		lock_guard<mutex> lock(mutex_);
+		applyDurable_();
+		if (wal_ != nullptr && wal_->size() > kWalCheckpointSize)
+			checkpoint_();
+		record_pos = insert_(tabname,line);
+		lsn = commit_();
+	}
+	waitDurable_(lsn);
+	return RecordHandle(tabname,record_pos);
+}
+
+FilePos NaiveDB::insert_(const string &tabname, std::vector<DBData> &line) {
 	Table &target_tab = tables_.at(tabname);
-	int64_t new_pid = DatFile::increasePrimaryId(*target_tab.fileptr);
+	int64_t new_pid;
+	FilePos record_pos;
 	// find a free chunk and modify meta information
-	FilePos record_pos = DatFile::consumeFreeSpace(*target_tab.fileptr);
-	// write primary id
-	binary_write(*target_tab.fileptr, new_pid);
-	// create index for id
+	new_pid = increasePrimaryId_(target_tab,1);
+	record_pos = consumeFreeSpace_(target_tab);
+	// compose the record in memory and write it at once
+	vector<char> record(target_tab.data_length,0);
 	DBData id_d(DBType::INT64);
 	id_d.int64 = new_pid;
-	insertInBPTree_(target_tab.bptree["id"],
-			target_tab.schema[0],id_d,record_pos);
-	// write each column
-	// i starts from 1 because pid has already been written
+	encodeDBData_(record.data(),target_tab.schema[0],id_d);
+	// i starts from 1 because pid has already been encoded
+	for (size_t i = 1; i != target_tab.schema.size(); ++i) {
+		const Column &col = target_tab.schema[i];
+		encodeDBData_(record.data() + col.offset,col,line[i-1]);
+	}
+	writeDatAtPos_(target_tab,record_pos,record.data(),record.size());
+	// create index for id
+	if (target_tab.id_slots != nullptr)
+		target_tab.id_slots->set(new_pid,record_pos);
+	else
+		insertInBPTree_(target_tab.bptree["id"],
+				target_tab.schema[0],id_d,record_pos);
 	for (size_t i = 1; i != target_tab.schema.size(); ++i) {
-		switch (target_tab.schema[i].type) {
-		case DBType::BOOLEAN:
-			binary_write(*target_tab.fileptr, line[i-1].boolean);
-			break;
-		case DBType::INT32:
-			binary_write(*target_tab.fileptr, line[i-1].int32);
-			break;
-		case DBType::INT64:
-			binary_write(*target_tab.fileptr, line[i-1].int64);
-			break;
-		case DBType::STRING:
-			binary_write_s(*target_tab.fileptr,line[i-1].str,target_tab.schema[i].length);
-			break;
-		default:
-			// DBType::ERROR falls in
-			assert(0);
-		}
 		// create index for this column
-		if (target_tab.schema[i].indexed) {
-			string colname = target_tab.schema[i].name;
-			insertInBPTree_(target_tab.bptree[colname],
-							target_tab.schema[i],line[i-1],record_pos);
+		if (target_tab.schema[i].indexed)
+			insertInIndex_(target_tab,target_tab.schema[i],line,record_pos);
+	}
+	for (const Column &index : target_tab.composites)
+		insertInIndex_(target_tab,index,line,record_pos);
+	return record_pos;
+}
+
+void NaiveDB::insertBatch(const string &tabname, const vector<vector<DBData> > &rows) {
+	uint64_t lsn = 0;
+	for (size_t first = 0; first < rows.size(); first += kBatchChunk) {
+		size_t last = min(rows.size(),first + kBatchChunk);
+		lock_guard<mutex> lock(mutex_);
+		applyDurable_();
+		if (wal_ != nullptr && wal_->size() > kWalCheckpointSize)
+			checkpoint_();
+		insertBatch_(tabname,rows,first,last);
+		lsn = commit_();
+	}
+	waitDurable_(lsn);
+}
+
+void NaiveDB::insertBatch_(const string &tabname, const vector<vector<DBData> > &rows,
+						   size_t first, size_t last) {
+	Table &target_tab = tables_.at(tabname);
+	size_t count = last - first;
+	int64_t first_pid = increasePrimaryId_(target_tab,count);
+	// the records go to the end of file in one piece, the free list is
+	// left for single inserts
+	size_t slotsize = target_tab.data_length + sizeof(char);
+	FilePos blockpos = datFileSize_(target_tab);
+	vector<char> block(count*slotsize,0); // deleted flags are 0
+	vector<FilePos> record_pos(count);
+	for (size_t k = 0; k != count; ++k) {
+		char *record = block.data() + k*slotsize + sizeof(char);
+		record_pos[k] = blockpos + k*slotsize + sizeof(char);
+		DBData id_d(DBType::INT64);
+		id_d.int64 = first_pid + k;
+		encodeDBData_(record,target_tab.schema[0],id_d);
+		for (size_t i = 1; i != target_tab.schema.size(); ++i) {
+			const Column &col = target_tab.schema[i];
+			encodeDBData_(record + col.offset,col,rows[first + k][i-1]);
 		}
 	}
+	writeDatAtPos_(target_tab,blockpos,block.data(),block.size());
+	// update every index with all the keys of this batch
+	vector<DBData> keys(count);
+	for (size_t k = 0; k != count; ++k) {
+		keys[k].type = DBType::INT64;
+		keys[k].int64 = first_pid + k;
+	}
+	if (target_tab.id_slots != nullptr)
+		target_tab.id_slots->setRange(first_pid,record_pos);
+	else
+		insertBatchInBPTree_(target_tab.bptree["id"],target_tab.schema[0],keys,record_pos);
+	vector<const Column*> indexes;
+	for (size_t i = 1; i != target_tab.schema.size(); ++i)
+		if (target_tab.schema[i].indexed)
+			indexes.push_back(&target_tab.schema[i]);
+	for (const Column &index : target_tab.composites)
+		indexes.push_back(&index);
+	for (const Column *col : indexes) {
+		for (size_t k = 0; k != count; ++k)
+			keys[k] = indexKey_(target_tab,*col,&rows[first + k],record_pos[k]);
+		if (col->included.empty()) {
+			insertBatchInBPTree_(target_tab.bptree[col->name],*col,keys,record_pos);
+			continue;
+		}
+		vector<CoveredPos> values(count);
+		for (size_t k = 0; k != count; ++k)
+			values[k] = coveredValue_(target_tab,*col,&rows[first + k],record_pos[k]);
+		insertBatchInBPTree_(target_tab.bptree[col->name],*col,keys,values);
+	}
 }
 
 DBData NaiveDB::get(RecordHandle handle, const string &dest_col) {
+	lock_guard<mutex> lock(mutex_);
 	Table &target_tab = tables_.at(handle.tabname);
 	int dest_col_index = target_tab.colname_index.at(dest_col);
-	Column destcol = target_tab.schema.at(dest_col_index);
-	return getDBDataAtPos_(*target_tab.fileptr,destcol.type,handle.filepos + destcol.offset);
+	const Column &destcol = target_tab.schema.at(dest_col_index);
+	// carried by the handle when the index that found it included it
+	for (size_t i = 0; i != kMaxIncluded; ++i)
+		if (handle.included_cols[i] == dest_col_index)
+			return narrow(destcol.type,handle.included[i]);
+	return getDBDataAtPos_(target_tab,destcol,handle.filepos + destcol.offset);
 }
 
 std::vector<RecordHandle> NaiveDB::query(const string &tabname,
 					const string &key_col, DBData key) {
+	lock_guard<mutex> lock(mutex_);
 	std::vector<RecordHandle> retval;
 	Table &target_tab = tables_.at(tabname);
-	int col_index = target_tab.colname_index.at(key_col);
-	Column col = target_tab.schema.at(col_index);
+	Column col = indexColumn_(target_tab,key_col);
+	if (target_tab.id_slots != nullptr && key_col == "id") {
+		// dense ids, a single read of the slot
+		FilePos pos = target_tab.id_slots->get(key.int64);
+		if (pos != 0)
+			retval.push_back(RecordHandle(tabname,pos));
+		return retval;
+	}
 	if (col.indexed) {
 		// indexed way
-		vector<FilePos> retpos = findInBPTree_(target_tab.bptree[key_col],col,key);
-		for (FilePos &x : retpos)
-			retval.push_back(RecordHandle(tabname,x));
-		return retval;
+		void *tree = target_tab.bptree[key_col];
+		if (col.included.empty())
+			return handles_(tabname,col,findInBPTree_<FilePos>(tree,col,key));
+		return handles_(tabname,col,findInBPTree_<CoveredPos>(tree,col,key));
 	} else {
 		// full scan
 		FilePos current_record = DatFile::kRecordStartPos;
-		target_tab.fileptr->seekg(0,target_tab.fileptr->end);
-		FilePos eofpos = target_tab.fileptr->tellg();
+		FilePos eofpos = datFileSize_(target_tab);
 		if (col.unique) {
 			for (; current_record < eofpos;
 					 current_record += target_tab.data_length + 1) {
-				if (DatFile::isRecordDeleted(*target_tab.fileptr,current_record))
+				if (isRecordDeleted_(target_tab,current_record))
 					continue;
-				if (compareDBDataAtPos_(*target_tab.fileptr,current_record + col.offset,key)) {
+				if (compareDBDataAtPos_(target_tab,col,current_record + col.offset,key)) {
 					RecordHandle record(tabname,current_record);
 					retval.push_back(record);
 					return retval;
@@ -385,9 +1341,9 @@ std::vector<RecordHandle> NaiveDB::query(const string &tabname,
 		} else {
 			for (; current_record < eofpos;
 					 current_record += target_tab.data_length + 1) {
-				if (DatFile::isRecordDeleted(*target_tab.fileptr,current_record))
+				if (isRecordDeleted_(target_tab,current_record))
 					continue;
-				if (compareDBDataAtPos_(*target_tab.fileptr,current_record + col.offset,key)) {
+				if (compareDBDataAtPos_(target_tab,col,current_record + col.offset,key)) {
 					RecordHandle record(tabname,current_record);
 					retval.push_back(record);
 				}
@@ -399,52 +1355,228 @@ std::vector<RecordHandle> NaiveDB::query(const string &tabname,
 
 std::vector<RecordHandle> NaiveDB::rangeQuery(const string &tabname,
 				  const string &key_col, DBData first, DBData last) {
+	lock_guard<mutex> lock(mutex_);
 	std::vector<RecordHandle> retval;
 	Table &target_tab = tables_.at(tabname);
-	int col_index = target_tab.colname_index.at(key_col);
-	Column col = target_tab.schema.at(col_index);
-	if (col.indexed) {
-		vector<FilePos> retpos = rangeFindInBPTree_(target_tab.bptree[key_col],col,first,last);
-		for (FilePos &x : retpos)
-			retval.push_back(RecordHandle(tabname,x));
+	Column col = indexColumn_(target_tab,key_col);
+	if (target_tab.id_slots != nullptr && key_col == "id") {
+		int64_t next = first.int64;
+		vector<FilePos> positions;
+		target_tab.id_slots->scan(next,last.int64,false,(size_t)-1,positions);
+		retval = handles_(tabname,col,positions);
+	} else if (col.indexed) {
+		assert(!col.hashed); // a hash index only finds exact matches
+		void *tree = target_tab.bptree[key_col];
+		if (col.included.empty())
+			retval = handles_(tabname,col,rangeFindInBPTree_<FilePos>(tree,col,first,last));
+		else
+			retval = handles_(tabname,col,rangeFindInBPTree_<CoveredPos>(tree,col,first,last));
 	} else
 		assert(0); // no trolling me, please don't rangeQuery on unindexed column
 	return retval;
 }
 
+QueryCursor NaiveDB::openRangeQuery(const string &tabname,
+				  const string &key_col, DBData first, DBData last, bool descending) {
+	lock_guard<mutex> lock(mutex_);
+	Table &target_tab = tables_.at(tabname);
+	const Column &col = indexColumn_(target_tab,key_col);
+	assert((col.indexed && !col.hashed) ||
+		   (target_tab.id_slots != nullptr && key_col == "id"));
+	QueryCursor cursor;
+	cursor.tabname = tabname;
+	cursor.key_col = key_col;
+	cursor.first = first;
+	cursor.last = last;
+	cursor.descending = descending;
+	cursor.started = false;
+	cursor.done = false;
+	cursor.key = DBData(col.type);
+	cursor.skip = 0;
+	cursor.leafpos = 0;
+	cursor.index = 0;
+	cursor.version = 0;
+	return cursor;
+}
+
+std::vector<RecordHandle> NaiveDB::next(QueryCursor &cursor, size_t count) {
+	lock_guard<mutex> lock(mutex_);
+	Table &target_tab = tables_.at(cursor.tabname);
+	const Column &col = indexColumn_(target_tab,cursor.key_col);
+	if (target_tab.id_slots != nullptr && cursor.key_col == "id") {
+		// key is the next id to look at
+		if (!cursor.started) {
+			cursor.key.int64 = cursor.descending ? cursor.last.int64 : cursor.first.int64;
+			cursor.started = true;
+		}
+		vector<FilePos> positions;
+		if (!cursor.done)
+			cursor.done = target_tab.id_slots->scan(cursor.key.int64,
+					cursor.descending ? cursor.first.int64 : cursor.last.int64,
+					cursor.descending,count,positions);
+		return handles_(cursor.tabname,col,positions);
+	}
+	void *tree = target_tab.bptree[cursor.key_col];
+	if (col.included.empty())
+		return handles_(cursor.tabname,col,scanBPTree_<FilePos>(tree,col,cursor,count));
+	return handles_(cursor.tabname,col,scanBPTree_<CoveredPos>(tree,col,cursor,count));
+}
+
+void NaiveDB::rebuildIndex(const string &tabname, const string &colname) {
+	lock_guard<mutex> lock(mutex_);
+	Table &target_tab = tables_.at(tabname);
+	const Column &col = indexColumn_(target_tab,colname);
+	// nothing in the log may be redone into the new index file
+	if (wal_ != nullptr)
+		checkpoint_();
+	if (target_tab.id_slots != nullptr && colname == "id") {
+		delete target_tab.id_slots;
+		remove(slotsFilename(tabname).c_str());
+		target_tab.id_slots = new IdSlots(slotsFilename(tabname),wal_);
+		buildIndex_(tabname,col);
+		return;
+	}
+	assert(col.indexed);
+	// start over from an empty index file
+	deleteBPTree_(target_tab.bptree[colname],col);
+	string filename = indexFilename(tabname,colname);
+	remove(filename.c_str());
+	target_tab.bptree[colname] = newBPTree_(tabname,col);
+	buildIndex_(tabname,col);
+}
+
+void NaiveDB::buildIndex_(const string &tabname, const Column &col) {
+	Table &target_tab = tables_.at(tabname);
+	// collect the key of every record, ordered by key then position
+	vector<pair<DBData,FilePos> > entries;
+	FilePos eofpos = datFileSize_(target_tab);
+	for (FilePos current_record = DatFile::kRecordStartPos; current_record < eofpos;
+			current_record += target_tab.data_length + 1) {
+		if (isRecordDeleted_(target_tab,current_record))
+			continue;
+		entries.push_back(make_pair(
+				indexKey_(target_tab,col,nullptr,current_record),
+				current_record));
+	}
+	stable_sort(entries.begin(),entries.end(),
+			[](const pair<DBData,FilePos> &lval, const pair<DBData,FilePos> &rval) {
+				return lval.first < rval.first;
+			});
+	if (target_tab.id_slots != nullptr && col.name == "id") {
+		vector<pair<int64_t,FilePos> > slots;
+		for (auto &entry : entries)
+			slots.push_back(make_pair(entry.first.int64,entry.second));
+		target_tab.id_slots->bulkLoad(slots);
+		target_tab.id_slots->markComplete();
+		return;
+	}
+	vector<DBData> keys;
+	vector<FilePos> values;
+	for (auto &entry : entries) {
+		keys.push_back(entry.first);
+		values.push_back(entry.second);
+	}
+	void *tree = target_tab.bptree[col.name];
+	if (col.included.empty()) {
+		bulkLoadBPTree_(tree,col,keys,values);
+	} else {
+		vector<CoveredPos> covered;
+		for (FilePos value : values)
+			covered.push_back(coveredValue_(target_tab,col,nullptr,value));
+		bulkLoadBPTree_(tree,col,keys,covered);
+	}
+	IdxFile::markComplete(indexFilename(tabname,col.name));
+}
+
 void NaiveDB::modify(RecordHandle handle, const string &colname, DBData val) {
+	uint64_t lsn;
+	{
+		lock_guard<mutex> lock(mutex_);
+		applyDurable_();
+		if (wal_ != nullptr && wal_->size() > kWalCheckpointSize)
+			checkpoint_();
+		modify_(handle,colname,val);
+		lsn = commit_();
+	}
+	waitDurable_(lsn);
+}
+
+void NaiveDB::modifyBatch(vector<RecordHandle> handles, const string &colname, DBData val) {
+	uint64_t lsn = 0;
+	for (size_t first = 0; first < handles.size(); first += kBatchChunk) {
+		size_t last = min(handles.size(),first + kBatchChunk);
+		lock_guard<mutex> lock(mutex_);
+		applyDurable_();
+		if (wal_ != nullptr && wal_->size() > kWalCheckpointSize)
+			checkpoint_();
+		for (size_t i = first; i != last; ++i)
+			modify_(handles[i],colname,val);
+		lsn = commit_();
+	}
+	waitDurable_(lsn);
+}
+
+void NaiveDB::modify_(RecordHandle &handle, const string &colname, DBData &val) {
 	Table &target_tab = tables_.at(handle.tabname);
 	int col_index = target_tab.colname_index.at(colname);
 	Column col = target_tab.schema.at(col_index);
-	target_tab.fileptr->seekp(handle.filepos + col.offset);
-	assert(val.type == col.type);
-	switch (val.type) {
-	case DBType::BOOLEAN:
-		binary_write(*target_tab.fileptr, val.boolean);
-		break;
-	case DBType::INT32:
-		binary_write(*target_tab.fileptr, val.int32);
-		break;
-	case DBType::INT64:
-		binary_write(*target_tab.fileptr, val.int64);
-		break;
-	case DBType::STRING:
-		binary_write_s(*target_tab.fileptr, val.str, col.length);
-		break;
-	default:
-		assert(0);
-	}
+	vector<char> field(col.length,0);
+	encodeDBData_(field.data(),col,val);
+	writeDatAtPos_(target_tab,handle.filepos + col.offset,field.data(),field.size());
 
 	if (col.indexed)
 		assert(0); // muhahahaha
+	for (const Column &index : target_tab.composites)
+		for (size_t part : index.parts)
+			assert(part != (size_t)col_index);
+	// the entries of the indexes including the column carry its value
+	for (const Column &index : target_tab.schema)
+		for (size_t included : index.included)
+			if (included == (size_t)col_index)
+				modifyCovered_(target_tab,index,handle.filepos);
+	for (const Column &index : target_tab.composites)
+		for (size_t included : index.included)
+			if (included == (size_t)col_index)
+				modifyCovered_(target_tab,index,handle.filepos);
 }
 
 NaiveDB::~NaiveDB() {
+	{
+		lock_guard<mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	checkpointer_wakeup_.notify_one();
+	checkpointer_.join();
+	// the indexes may only drop their pages once nothing is held back
+	if (wal_ != nullptr) {
+		wal_->sync();
+		wal_->applyDurable();
+	}
 	for (pair<std::string,Table> x : tables_) {
-		x.second.fileptr->close();
+		if (x.second.fileptr != nullptr)
+			x.second.fileptr->close();
 		delete x.second.fileptr;
+		delete x.second.mapptr;
+		delete x.second.id_slots;
 		for (Column &col : x.second.schema)
 			if (col.indexed)
 				deleteBPTree_(x.second.bptree[col.name],col);
+		for (Column &index : x.second.composites)
+			deleteBPTree_(x.second.bptree[index.name],index);
+	}
+	if (wal_ != nullptr) {
+		// everything is written back, the log is not needed anymore
+		for (auto &pair : tables_) {
+			syncFile(pair.second.filename);
+			if (pair.second.dense_ids)
+				syncFile(slotsFilename(pair.first));
+			for (Column &col : pair.second.schema)
+				if (col.indexed)
+					syncFile(indexFilename(pair.first,col.name));
+			for (Column &index : pair.second.composites)
+				syncFile(indexFilename(pair.first,index.name));
+		}
+		wal_->truncate();
+		delete wal_;
 	}
 }
@@ -1,13 +1,22 @@
 #ifndef NAIVEDB_H
 #define NAIVEDB_H
 
+#include <condition_variable>
+#include <deque>
 #include <fstream>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 #include <string>
 #include <cstdint>
 #include "kikutil.h"
+#include "bufferpool.h"
 #include "bptree.hpp"
+#include "fixedkey.hpp"
+#include "hashindex.hpp"
+#include "idslots.h"
+#include "wal.h"
 
 /*
  * Disk storage
@@ -18,32 +27,161 @@
  * indexes are stored in tabname_colname.idx file
  *
  * File schema can be found in filescheme.txt
+ *
+ * Besides the indexes of single columns, <indexes> of a table may declare
+ * composite indexes over two integer columns, queried like a column of
+ * type PAIR named after the index. A composite index sorts by its first
+ * column, then by the second one, so it finds a pair at once and hands
+ * out the rows of one first value ordered by the second.
+ *
+ * An index may <include> up to kMaxIncluded integer or boolean columns,
+ * whose values are stored next to the record position in the index. The
+ * records it finds carry them, so get() on those columns does not read
+ * tabname.dat. modify() on an included column updates those indexes too.
+ *
+ * <indextype>hash</indextype> on a unique column (<idindextype> for the
+ * id) keeps its index in a HashIndex instead of a BPTree. Such a column
+ * is found by query() in about one block read but can not be range
+ * queried.
+ *
+ * <indexblocksize> of a B+tree index (<idindexblocksize> for the id)
+ * sets the size of its nodes, a power of two from 1024 to 65536 bytes
+ * (kBlockSize if left out). Larger nodes make a range scan read fewer of
+ * them, at the cost of more bytes written by every insert. An index
+ * file of another block size is built again.
+ *
+ * <idindextype>dense</idindextype> drops the index of id altogether, the
+ * position of the record of every id is kept in tabname_id.slots (see
+ * IdSlots), so inserts have one index less to update and the record of
+ * an id is one read away.
+ *
+ * With <wal> set in foo.xml every insert and modify is logged to a
+ * write-ahead log and made durable before returning, concurrent callers
+ * share one sync of the log. The log is replayed on startup and emptied
+ * on clean shutdown or when it outgrows kWalCheckpointSize. Nothing an
+ * operation changed reaches a data file before it is durable: index
+ * pages stay pinned and writes to tabname.dat wait in memory, to be let
+ * go of under mutex_ by a later operation or by a checkpoint.
+ *
+ * A checkpointer thread writes dirty index pages back in the background,
+ * kCheckpointPages at a time, whenever they take more than half of the
+ * dirty limit of the buffer pool (<dirtypercent> of <bufferpool>). So the
+ * pool seldom has to write pages back in the middle of an operation, and
+ * a checkpoint or shutdown has little left to write.
  */
 
+// most columns an index may include
+const size_t kMaxIncluded = 2;
+
 struct RecordHandle {
 	std::string tabname;
 	FilePos filepos;
+	// the columns included in the index that found the record, by
+	// position in the schema (-1 for none), and their values
+	int included_cols[kMaxIncluded];
+	int64_t included[kMaxIncluded];
 
 	RecordHandle(const std::string &table,FilePos offset) :
-		tabname(table), filepos(offset) {}
+		tabname(table), filepos(offset) {
+		for (size_t i = 0; i != kMaxIncluded; ++i)
+			included_cols[i] = -1;
+	}
+};
+
+// value of an index with included columns: the record and the values
+// of those columns, widened to int64
+struct CoveredPos {
+	FilePos pos;
+	int64_t included[kMaxIncluded];
+};
+
+// in posting lists the included values follow the position delta as
+// zigzag varints
+template <>
+struct PostingCoding<CoveredPos> {
+	static const size_t kMaxExtra = 10*kMaxIncluded;
+
+	static int64_t position(const CoveredPos &value) { return value.pos; }
+	static void setPosition(CoveredPos &value, int64_t pos) { value.pos = pos; }
+	static char* writeExtra(char *dest, const CoveredPos &value) {
+		for (int64_t x : value.included)
+			dest = varint_write(dest,((uint64_t)x << 1) ^ (uint64_t)(x >> 63));
+		return dest;
+	}
+	static const char* readExtra(const char *src, CoveredPos &value) {
+		for (int64_t &x : value.included) {
+			uint64_t zigzag;
+			src = varint_read(src,zigzag);
+			x = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+		}
+		return src;
+	}
 };
 
 enum class DBType {
-	INT32, INT64, STRING, BOOLEAN, ERROR
+	INT32, INT64, STRING, BOOLEAN, PAIR, ERROR
+};
+
+// key of a composite index, the values of its columns; plain data, the
+// index copies keys with memcpy
+struct DBPair {
+	int64_t first;
+	int64_t second;
+
+	DBPair() = default;
+	DBPair(int64_t firstval, int64_t secondval) : first(firstval), second(secondval) {}
+
+	bool operator<(const DBPair &rval) const {
+		return first < rval.first || (first == rval.first && second < rval.second);
+	}
+	bool operator>(const DBPair &rval) const {
+		return rval < *this;
+	}
+	bool operator==(const DBPair &rval) const {
+		return first == rval.first && second == rval.second;
+	}
 };
 
+// hashed like the std::pair of its parts
+inline uint64_t hash_key(const DBPair &key) {
+	return hash_key(std::make_pair(key.first,key.second));
+}
+
 struct DBData {
 	DBType type;
 	char boolean;
 	int int32;
 	int64_t int64;
 	std::string str;
+	DBPair pair;
 
 	DBData() = default;
 	DBData(DBType fromtype) : type(fromtype) {}
 
 	bool operator==(const DBData &rval);
 	bool operator!=(const DBData &rval);
+	// order of values of the same type, as their indexes sort them
+	bool operator<(const DBData &rval) const;
+};
+
+// Position of a rangeQuery read a batch at a time, see openRangeQuery
+// Plain values, a copy of a cursor saves its position. Besides done, the
+// fields are BPTree::Cursor of the index with the keys as DBData
+struct QueryCursor {
+	std::string tabname;
+	std::string key_col;
+	DBData first;
+	DBData last;
+	bool descending;
+	bool started;
+	bool done; // every record in the range has been handed out
+	DBData key;
+	size_t skip;
+	FilePos leafpos;
+	size_t index;
+	uint64_t version;
+	std::vector<FilePos> path;
+	std::vector<size_t> path_index;
 };
 
 class NaiveDB {
@@ -54,21 +192,64 @@ private:
 	struct Column {
 		std::string name;
 		bool indexed;
+		// index file read through a memory mapping, see BPTree
+		bool index_mapped;
+		// the index is a HashIndex rather than a BPTree, see hashindex.hpp
+		bool hashed;
+		// bytes of a node of a B+tree index, kBlockSize for a hash index
+		size_t index_blocksize;
 		bool unique;
 		DBType type;
 		size_t length;
 		size_t offset;
+		// composite index only: positions of its columns in schema
+		std::vector<size_t> parts;
+		// indexes only: positions in schema of the included columns, the
+		// index holds CoveredPos values when there are any
+		std::vector<size_t> included;
 	};
 	struct Table {
+		std::string filename;
 		size_t data_length;
+		// tabname.dat is either accessed through a stream (fileptr) or
+		// mapped into memory (mapptr), the other pointer is nullptr
+		bool mapped;
 		std::fstream *fileptr;
+		MappedFile *mapptr;
 		std::vector<Column> schema;
 		std::unordered_map<std::string,int> colname_index;
+		// composite indexes, columns of type PAIR that are not stored
+		std::vector<Column> composites;
 		std::unordered_map<std::string, void*> bptree;
+		// with a log, writes to tabname.dat wait here until their
+		// operation is durable, readDatAtPos_ lays them over the file
+		std::deque<std::pair<FilePos, std::vector<char> > > pending;
+		// dense ids: the records are found through id_slots instead of an
+		// index of id, which is left out of bptree
+		bool dense_ids;
+		IdSlots *id_slots;
 	};
 	// Data members
 
+	// caches the nodes of every index, declared before anything using it
+	BufferPool pool_;
 	std::unordered_map<std::string, Table> tables_;
+	// write-ahead log, nullptr if disabled
+	Wal *wal_;
+	// serializes every operation on the database
+	std::mutex mutex_;
+	// runs checkpointLoop_(), woken every kCheckpointInterval or to stop
+	std::thread checkpointer_;
+	std::condition_variable checkpointer_wakeup_;
+	bool stopping_;
+
+	static const FilePos kWalCheckpointSize = 64 << 20;
+	// rows of insertBatch (records of modifyBatch) handled (and logged)
+	// as one operation
+	static const size_t kBatchChunk = 4096;
+	// dirty pages written back by the checkpointer between two operations
+	static const size_t kCheckpointPages = 64;
+	static const int kCheckpointInterval = 100; // in ms
 
 	// Helper functions
 
@@ -77,35 +258,150 @@ private:
 
 	void loadMeta_(const std::string &dbname);
 	void loadIndex_();
+	// the column or composite index called name
+	Column& indexColumn_(Table &tab, const std::string &name);
+	// the key of index for a row of the values of tab's columns (the
+	// id left out) or for the record at recordpos when row is nullptr
+	DBData indexKey_(Table &tab, const Column &index, const std::vector<DBData> *row,
+					 FilePos recordpos);
+	// the value of index for the record at recordpos, whose values are
+	// row or are read from tabname.dat when row is nullptr (see indexKey_)
+	CoveredPos coveredValue_(Table &tab, const Column &index,
+							 const std::vector<DBData> *row, FilePos recordpos);
+	// add the record at recordpos holding row to the index of col
+	void insertInIndex_(Table &tab, const Column &col, const std::vector<DBData> &row,
+						FilePos recordpos);
+	// store the included values of the record at recordpos, read from
+	// tabname.dat, in its entry of index
+	void modifyCovered_(Table &tab, const Column &index, FilePos recordpos);
+	// handles of the records at the values found in the index of col
+	std::vector<RecordHandle> handles_(const std::string &tabname, const Column &col,
+									   const std::vector<FilePos> &values);
+	std::vector<RecordHandle> handles_(const std::string &tabname, const Column &col,
+									   const std::vector<CoveredPos> &values);
+	// fill the empty index of col from tabname.dat with a bulk load, then
+	// mark it complete
+	void buildIndex_(const std::string &tabname, const Column &col);
+	// write every change out to the data files and empty the log
+	void checkpoint_();
+	// body of the checkpointer thread
+	void checkpointLoop_();
+	// seal the logged changes of the running operation, 0 without a log
+	uint64_t commit_();
+	// wait for the operation committed as lsn to be durable, call it
+	// without holding mutex_ so that concurrent commits can be batched
+	void waitDurable_(uint64_t lsn);
+	// let go of the changes of every durable operation, see Wal
+	void applyDurable_();
+	// reserve count primary ids of tab and return the first of them
+	int64_t increasePrimaryId_(Table &tab,int64_t count);
+	// room for a record of tab, taken off the free list or appended,
+	// with its deleted flag cleared
+	FilePos consumeFreeSpace_(Table &tab);
+	// return the position of the new record
+	FilePos insert_(const std::string &tabname, std::vector<DBData> &line);
+	// insert rows[first, last) as one operation
+	void insertBatch_(const std::string &tabname,
+					  const std::vector<std::vector<DBData> > &rows,
+					  size_t first, size_t last);
+	void modify_(RecordHandle &handle, const std::string &colname, DBData &val);
 	DBData getDBData_(std::fstream &stream,DBType type);
-	DBData getDBDataAtPos_(std::fstream &stream,DBType type,FilePos pos);
-	bool compareDBDataAtPos_(std::fstream &stream,FilePos pos,DBData comp);
+	// decode/encode a value of col inside a record in memory
+	DBData decodeDBData_(const char *src,const Column &col);
+	void encodeDBData_(char *dest,const Column &col,const DBData &val);
+	DBData getDBDataAtPos_(Table &tab,const Column &col,FilePos pos);
+	bool compareDBDataAtPos_(Table &tab,const Column &col,FilePos pos,const DBData &comp);
+	// read/write raw bytes of tabname.dat in whichever mode it is opened
+	// writes are logged when the log is enabled, and held in tab.pending
+	// until their operation is durable
+	void readDatAtPos_(Table &tab,FilePos pos,char *data,size_t length);
+	void writeDatAtPos_(Table &tab,FilePos pos,const char *data,size_t length);
+	// the same on the file itself
+	void readStoredDat_(Table &tab,FilePos pos,char *data,size_t length);
+	void storeDat_(Table &tab,FilePos pos,const char *data,size_t length);
+	FilePos storedDatSize_(Table &tab);
+	// the size of tabname.dat with the pending writes
+	FilePos datFileSize_(Table &tab);
+	bool isRecordDeleted_(Table &tab,FilePos recordpos);
 
 	// The Following Functions are for Simple Reflection Mechanism
+	// ValType is FilePos, or CoveredPos for an index with included columns
 	// create an BPTree of correspondnet type
 	void* newBPTree_(const std::string &tabname,const Column &col);
+	template <typename ValType>
+	void* newTree_(const std::string &tabname,const Column &col);
 	// insert in BPTree of correspondent type
-	void insertInBPTree_(void* bptree,const Column &col,DBData key,FilePos value);
+	template <typename ValType>
+	void insertInBPTree_(void* bptree,const Column &col,DBData key,const ValType &value);
+	// modify in BPTree of correspondent type, only indexes with included
+	// columns carry anything to modify
+	bool modifyInBPTree_(void* bptree,const Column &col,DBData key,const CoveredPos &value);
+	// insert keys[i] -> values[i] for every i in BPTree of correspondent type
+	template <typename ValType>
+	void insertBatchInBPTree_(void* bptree,const Column &col,
+							  const std::vector<DBData> &keys,
+							  const std::vector<ValType> &values);
+	// bulk load sorted keys[i] -> values[i] into an empty BPTree of correspondent type
+	template <typename ValType>
+	void bulkLoadBPTree_(void* bptree,const Column &col,
+						 const std::vector<DBData> &keys,
+						 const std::vector<ValType> &values);
 	// find in BPTree of correspondent type
-	std::vector<FilePos> findInBPTree_(void* bptree,const Column &col,DBData key);
+	template <typename ValType>
+	std::vector<ValType> findInBPTree_(void* bptree,const Column &col,DBData key);
 	// rangeFind in BPTree of correspondent type
-	std::vector<FilePos> rangeFindInBPTree_(void* bptree,const Column &col,DBData first,DBData last);
+	template <typename ValType>
+	std::vector<ValType> rangeFindInBPTree_(void* bptree,const Column &col,DBData first,DBData last);
+	// scan in BPTree of correspondent type
+	template <typename ValType>
+	std::vector<ValType> scanBPTree_(void* bptree,const Column &col,QueryCursor &cursor,size_t count);
 	// delete the BPTree of correspondnet type, only call this function on destructor
 	void deleteBPTree_(void* bptree,const Column &col);
+	template <typename ValType>
+	void deleteTree_(void* bptree,const Column &col);
 public:
 	// Public methods
 
 	void debug(); // run debug commands
-	void insert(const std::string &tabname, std::vector<DBData> line);
+	// true if the schema has tabname, for optional tables
+	bool hasTable(const std::string &tabname) const;
+	// the largest primary id given out in tabname so far, ids grow with
+	// every insert so it marks what has been inserted up to now
+	int64_t lastId(const std::string &tabname);
+	RecordHandle insert(const std::string &tabname, std::vector<DBData> line);
+	// insert many rows at once: ids and space at the end of tabname.dat
+	// are reserved for all of them, the records are written in one pass
+	// and each index is updated in key order
+	void insertBatch(const std::string &tabname,
+					 const std::vector<std::vector<DBData> > &rows);
+	// the indexes including colname are updated, handles found before
+	// keep carrying the old value
 	void modify(RecordHandle handle, const std::string &colname,
 				DBData val);
+	// set colname of many records to val, as one operation with a single
+	// wait for the log instead of one per record
+	void modifyBatch(std::vector<RecordHandle> handles, const std::string &colname,
+					 DBData val);
 	std::vector<RecordHandle> query(const std::string &tabname,
 							   const std::string &key_col,
 							   DBData key);
 	std::vector<RecordHandle> rangeQuery(const std::string &tabname,
 							   const std::string &key_col,
 							   DBData first, DBData last);
+	// the records of rangeQuery(...) without reading them yet, next(...)
+	// hands them out in the same order, or in reverse if descending, so
+	// the latest count records are next(cursor,count) away
+	QueryCursor openRangeQuery(const std::string &tabname,
+							   const std::string &key_col,
+							   DBData first, DBData last,
+							   bool descending = false);
+	// next(...) returns up to count more records of the cursor, fewer
+	// only at the end; the database may change between calls
+	std::vector<RecordHandle> next(QueryCursor &cursor, size_t count);
 	DBData get(RecordHandle handle, const std::string &dest_col);
+	// rebuild the index of colname from tabname.dat with a bulk load,
+	// which leaves the index packed
+	void rebuildIndex(const std::string &tabname, const std::string &colname);
 	// Constructor and destructor
 
 	NaiveDB(const std::string &dbname);
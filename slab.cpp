@@ -0,0 +1,50 @@
+#include "slab.h"
+#include <cassert>
+
+using namespace std;
+
+Slab::Slab(size_t chunksize)
+	: chunksize_(chunksize), free_(nullptr), live_(0)
+{
+	// keep the chunk after every header aligned
+	size_t align = sizeof(Header);
+	stride_ = sizeof(Header) + (chunksize + align - 1)/align*align;
+}
+
+Slab::~Slab() {
+	assert(live_ == 0);
+	for (char *block : blocks_)
+		delete[] block;
+}
+
+void* Slab::allocate() {
+	if (free_ == nullptr)
+		grow_();
+	Header *header = free_;
+	free_ = header->next;
+	header->owner = this;
+	++live_;
+	return header + 1;
+}
+
+void Slab::release(void *p) {
+	if (p == nullptr)
+		return;
+	Header *header = static_cast<Header*>(p) - 1;
+	Slab *owner = header->owner;
+	assert(owner->live_ > 0);
+	header->next = owner->free_;
+	owner->free_ = header;
+	--owner->live_;
+}
+
+void Slab::grow_() {
+	// new[] of char is aligned for any type
+	char *block = new char[stride_ * kChunksPerBlock];
+	blocks_.push_back(block);
+	for (size_t i = kChunksPerBlock; i-- > 0; ) {
+		Header *header = reinterpret_cast<Header*>(block + i*stride_);
+		header->next = free_;
+		free_ = header;
+	}
+}
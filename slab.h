@@ -0,0 +1,58 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <vector>
+#include <cstddef>
+#include "kikutil.h"
+
+/*
+ * Slab
+ * ----------------
+ * Hands out chunks of one size, carved kChunksPerBlock at a time from
+ * larger blocks and recycled through a free list, so that nodes loaded
+ * and evicted over and over do not go through the general allocator
+ * every time.
+ *
+ * Every chunk starts with a header pointing back at its slab, which is
+ * how release(...) finds where a chunk goes back to. The memory handed
+ * out follows the header and is aligned for any type. Blocks are only
+ * returned when the slab dies, by which time every chunk must have been
+ * released.
+ *
+ * Not thread-safe, a slab belongs to one owner (a BPTree).
+ */
+
+class Slab {
+	DISALLOW_COPY_AND_ASSIGN(Slab);
+public:
+	static const size_t kChunksPerBlock = 32;
+
+	// every chunk holds chunksize bytes
+	explicit Slab(size_t chunksize);
+	~Slab();
+
+	void* allocate();
+	// give back memory from allocate() of any slab
+	static void release(void *p);
+
+	size_t chunkSize() const { return chunksize_; }
+	// chunks allocated and not released yet
+	size_t live() const { return live_; }
+private:
+	union Header {
+		Slab *owner; // while allocated
+		Header *next; // while on the free list
+		std::max_align_t align;
+	};
+
+	// carve a new block into free chunks
+	void grow_();
+
+	size_t chunksize_;
+	size_t stride_; // bytes from one chunk to the next, header included
+	std::vector<char*> blocks_;
+	Header *free_;
+	size_t live_;
+};
+
+#endif // SLAB_H
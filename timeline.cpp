@@ -0,0 +1,134 @@
+#include "timeline.h"
+#include <algorithm>
+#include <iterator>
+#include <ctime>
+#include <limits>
+
+using namespace std;
+
+Timeline::Timeline(NaiveDB *db, const vector<int64_t> &publishers)
+	: db_(db), home_(false), owner_(0)
+{
+	refreshed_ = time(0);
+	last_id_ = db_->lastId("tweets");
+	streams_.resize(publishers.size());
+	for (size_t i = 0; i != publishers.size(); ++i) {
+		DBData first(DBType::PAIR), last(DBType::PAIR);
+		first.pair = DBPair(publishers[i],numeric_limits<int32_t>::min());
+		last.pair = DBPair(publishers[i],numeric_limits<int32_t>::max());
+		Stream &stream = streams_[i];
+		stream.publisher = publishers[i];
+		stream.cursor = db_->openRangeQuery("tweets","publisher_time",first,last,true);
+		stream.left = 0;
+		advance_(i);
+	}
+}
+
+Timeline::Timeline(NaiveDB *db, int64_t owner)
+	: db_(db), home_(true), owner_(owner)
+{
+	DBData first(DBType::INT64), last(DBType::INT64);
+	first.int64 = TweetOp::homeSlot(owner,0);
+	last.int64 = TweetOp::homeSlot(owner,TweetOp::kLastHomeTime);
+	refreshed_ = time(0);
+	last_id_ = db_->lastId("hometl");
+	streams_.resize(1);
+	streams_[0].publisher = owner;
+	streams_[0].cursor = db_->openRangeQuery("hometl","slot",first,last,true);
+	streams_[0].left = 0;
+	advance_(0);
+}
+
+void Timeline::readBatch_(size_t i) {
+	Stream &stream = streams_[i];
+	if (stream.left != 0 || stream.cursor.done)
+		return;
+	// newest first, the stream is read from the back
+	vector<RecordHandle> rows = db_->next(stream.cursor,kBatch);
+	stream.tweets.assign(rows.rbegin(),rows.rend());
+	stream.left = stream.tweets.size();
+}
+
+void Timeline::advance_(size_t i) {
+	Stream &stream = streams_[i];
+	readBatch_(i);
+	if (stream.left == 0)
+		return;
+	--stream.left;
+	const RecordHandle &handle = stream.tweets[stream.left];
+	Head head;
+	if (home_)
+		head.time = (int32_t)db_->get(handle,"slot").int64;
+	else
+		head.time = db_->get(handle,"time").int32;
+	head.filepos = handle.filepos;
+	head.stream = i;
+	heads_.push(head);
+}
+
+vector<TweetLine> Timeline::next(size_t count) {
+	vector<TweetLine> retval;
+	while (retval.size() != count && !heads_.empty()) {
+		Head head = heads_.top();
+		heads_.pop();
+		Stream &stream = streams_[head.stream];
+		RecordHandle handle = stream.tweets[stream.left];
+		advance_(head.stream);
+		readTweet_(handle,stream.publisher,retval);
+	}
+	return retval;
+}
+
+void Timeline::readTweet_(RecordHandle handle, int64_t publisher, vector<TweetLine> &tweets) {
+	if (home_) {
+		// follow the row to the tweet
+		if (db_->get(handle,"deleted").boolean)
+			return;
+		publisher = db_->get(handle,"publisher").int64;
+		handle = RecordHandle("tweets",db_->get(handle,"tweet").int64);
+	}
+	if (db_->get(handle,"deleted").boolean)
+		return;
+	int64_t author = db_->get(handle,"author").int64;
+	int32_t time = db_->get(handle,"time").int32;
+	string content = db_->get(handle,"content").str;
+	tweets.push_back(TweetLine(content,publisher,author,time));
+}
+
+size_t Timeline::refresh(vector<TweetLine> &cached) {
+	// the new high-water mark is taken first, anything inserted while
+	// refreshing is left to the next refresh
+	int64_t last_id = db_->lastId(home_ ? "hometl" : "tweets");
+	// rows inserted since the last refresh carry a time after it, give
+	// or take kFanOutDelay
+	int64_t now = time(0);
+	int64_t since = max(refreshed_ - kFanOutDelay,(int64_t)0);
+	vector<TweetLine> fresh;
+	for (Stream &stream : streams_) {
+		vector<RecordHandle> rows;
+		if (home_) {
+			DBData first(DBType::INT64), last(DBType::INT64);
+			first.int64 = TweetOp::homeSlot(owner_,since);
+			last.int64 = TweetOp::homeSlot(owner_,TweetOp::kLastHomeTime);
+			rows = db_->rangeQuery("hometl","slot",first,last);
+		} else {
+			DBData first(DBType::PAIR), last(DBType::PAIR);
+			first.pair = DBPair(stream.publisher,since);
+			last.pair = DBPair(stream.publisher,numeric_limits<int32_t>::max());
+			rows = db_->rangeQuery("tweets","publisher_time",first,last);
+		}
+		for (RecordHandle row : rows) {
+			int64_t id = db_->get(row,"id").int64;
+			if (id > last_id_ && id <= last_id)
+				readTweet_(row,stream.publisher,fresh);
+		}
+	}
+	refreshed_ = now;
+	last_id_ = last_id;
+	stable_sort(fresh.begin(),fresh.end());
+	vector<TweetLine> merged;
+	merged.reserve(fresh.size() + cached.size());
+	merge(fresh.begin(),fresh.end(),cached.begin(),cached.end(),back_inserter(merged));
+	cached.swap(merged);
+	return fresh.size();
+}
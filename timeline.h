@@ -0,0 +1,96 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <queue>
+#include <vector>
+#include <cstdint>
+#include "naivedb.h"
+#include "tweetop.h"
+
+/*
+ * Timeline
+ * ----------------
+ * Tweets of a set of publishers, newest first, read a page at a time.
+ *
+ * The composite index publisher_time of tweets keeps the tweets of every
+ * publisher sorted by time, so each publisher is a stream read a batch
+ * at a time with a descending cursor. The streams are merged newest
+ * first with a heap holding the head of each of them: the index includes
+ * the time and deleted flag of the tweets, and the other columns are
+ * read only for the tweets handed out by next(). A page costs
+ * O(page size * log(publishers)) record reads no matter how many tweets
+ * the publishers have.
+ *
+ * The home timeline of a user may be read from the materialized hometl
+ * table instead (see TweetOp::homeSlot), which is a single stream read
+ * the same way with a descending cursor over the slots of the user.
+ *
+ * next() pages through the tweets as they were when the timeline was
+ * created, refresh() picks up the ones posted since. The high-water mark
+ * is the primary id of tweets (hometl rows for a home timeline), new
+ * tweets are found in the recent end of every stream, not by reading it
+ * again.
+ */
+
+class Timeline {
+	DISALLOW_COPY_AND_ASSIGN(Timeline);
+public:
+	Timeline(NaiveDB *db, const std::vector<int64_t> &publishers);
+	// home timeline of owner, db must have the hometl table
+	Timeline(NaiveDB *db, int64_t owner);
+
+	// next(...) returns up to count more tweets, fewer only at the end
+	std::vector<TweetLine> next(size_t count);
+	// true when every tweet has been handed out
+	bool end() const { return heads_.empty(); }
+	// refresh(...) merges the tweets posted since the timeline was created
+	// or last refreshed into cached, which is sorted newest first as
+	// next() hands tweets out, and returns how many there were
+	size_t refresh(std::vector<TweetLine> &cached);
+private:
+	struct Stream {
+		int64_t publisher;
+		// the rows not read yet, newest first
+		QueryCursor cursor;
+		// the batch read last, rows of tweets, or of hometl when home_ is
+		// set, oldest first
+		std::vector<RecordHandle> tweets;
+		size_t left; // tweets[0, left) are not merged yet
+	};
+	struct Head {
+		int32_t time;
+		FilePos filepos;
+		size_t stream;
+		// the newest tweet on top, the later posted one on equal times
+		bool operator<(const Head &rval) const {
+			if (time != rval.time)
+				return time < rval.time;
+			return filepos < rval.filepos;
+		}
+	};
+
+	// push the next tweet of stream i to heads_, if there is one
+	void advance_(size_t i);
+	// read the next batch of stream i once the last one is merged
+	void readBatch_(size_t i);
+	// append the tweet of handle (a row of tweets or hometl) to tweets,
+	// unless it has been deleted
+	void readTweet_(RecordHandle handle, int64_t publisher, std::vector<TweetLine> &tweets);
+
+	static const size_t kBatch = 32; // rows
+	// a tweet may be inserted, or reach a home timeline, this long after
+	// the time it carries
+	static const int64_t kFanOutDelay = 60; // seconds
+
+	NaiveDB *db_;
+	bool home_;
+	int64_t owner_;
+	// high-water mark: rows with a larger id are left to refresh(),
+	// which looks for them among the rows newer than refreshed_
+	int64_t last_id_;
+	int64_t refreshed_;
+	std::vector<Stream> streams_;
+	std::priority_queue<Head> heads_;
+};
+
+#endif // TIMELINE_H
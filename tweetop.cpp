@@ -1,10 +1,163 @@
 #include "tweetop.h"
 #include <ctime>
+#include <limits>
+#include <unordered_map>
 
 using namespace std;
 
+namespace {
+
+// owner of the hometl row marking the fill of prepareHomeTimelines done,
+// ids start at 1 so it is nobody's home timeline
+const int64_t kFilledOwner = 0;
+
+// followers(...) ids of the users following uid
+vector<int64_t> followers(NaiveDB *db, int64_t uid) {
+	DBData uid_d(DBType::INT64);
+	uid_d.int64 = uid;
+	vector<int64_t> retval;
+	for (RecordHandle handle : db->query("afob","b",uid_d))
+		if (db->get(handle,"deleted").boolean == false)
+			retval.push_back(db->get(handle,"a").int64);
+	return retval;
+}
+
+// edge(...) the afob row of uid following id, found with the composite
+// index on (a,b); there is at most one, unfollowing only marks it deleted
+vector<RecordHandle> edge(NaiveDB *db, int64_t uid, int64_t id) {
+	DBData edge_d = DBData();
+	edge_d.type = DBType::PAIR;
+	edge_d.pair = DBPair(uid,id);
+	return db->query("afob","a_b",edge_d);
+}
+
+// homeLine(...) hometl row putting tweet on the home timeline of owner
+vector<DBData> homeLine(int64_t owner, int64_t publisher, RecordHandle tweet, int32_t time) {
+	vector<DBData> line;
+	DBData dbd(DBType::INT64);
+	dbd.int64 = TweetOp::homeSlot(owner,time);
+	line.push_back(dbd); // slot
+	dbd.int64 = publisher;
+	line.push_back(dbd); // publisher
+	dbd.int64 = tweet.filepos;
+	line.push_back(dbd); // tweet
+	dbd.type = DBType::BOOLEAN;
+	dbd.boolean = false;
+	line.push_back(dbd); // deleted
+	return line;
+}
+
+// homeRow(...) the hometl row putting tweet on the home timeline of
+// owner, found by its slot; there is at most one
+vector<RecordHandle> homeRow(NaiveDB *db, int64_t owner, RecordHandle tweet, int32_t time) {
+	DBData slot_d(DBType::INT64);
+	slot_d.int64 = TweetOp::homeSlot(owner,time);
+	vector<RecordHandle> retval;
+	for (RecordHandle handle : db->query("hometl","slot",slot_d))
+		if (db->get(handle,"tweet").int64 == tweet.filepos)
+			retval.push_back(handle);
+	return retval;
+}
+
+// fanOut(...) push a new tweet of uid to the home timelines
+void fanOut(NaiveDB *db, int64_t uid, RecordHandle tweet, int32_t time) {
+	if (!db->hasTable("hometl"))
+		return;
+	vector<vector<DBData> > lines;
+	lines.push_back(homeLine(uid,uid,tweet,time));
+	for (int64_t follower : followers(db,uid))
+		lines.push_back(homeLine(follower,uid,tweet,time));
+	db->insertBatch("hometl",lines);
+}
+
+// backfill(...) put the tweets of id on the home timeline of uid
+void backfill(NaiveDB *db, int64_t uid, int64_t id) {
+	if (!db->hasTable("hometl"))
+		return;
+	// publisher_time includes deleted and time, tweets.dat is not read
+	DBData first(DBType::PAIR), last(DBType::PAIR);
+	first.pair = DBPair(id,numeric_limits<int32_t>::min());
+	last.pair = DBPair(id,numeric_limits<int32_t>::max());
+	DBData deleted_d(DBType::BOOLEAN);
+	deleted_d.boolean = false;
+	// rows pruned by an earlier unfollow are taken back instead of
+	// inserted again
+	vector<vector<DBData> > lines;
+	vector<RecordHandle> pruned;
+	for (RecordHandle tweet : db->rangeQuery("tweets","publisher_time",first,last)) {
+		if (db->get(tweet,"deleted").boolean)
+			continue;
+		int32_t time = db->get(tweet,"time").int32;
+		vector<RecordHandle> rows = homeRow(db,uid,tweet,time);
+		if (rows.empty())
+			lines.push_back(homeLine(uid,id,tweet,time));
+		else if (db->get(rows[0],"deleted").boolean)
+			pruned.push_back(rows[0]);
+	}
+	db->modifyBatch(pruned,"deleted",deleted_d);
+	db->insertBatch("hometl",lines);
+}
+
+// prune(...) take the tweets of id off the home timeline of uid
+void prune(NaiveDB *db, int64_t uid, int64_t id) {
+	if (!db->hasTable("hometl"))
+		return;
+	// the rows are looked up by the tweets of id, not by scanning the
+	// whole home timeline of uid
+	DBData first(DBType::PAIR), last(DBType::PAIR);
+	first.pair = DBPair(id,numeric_limits<int32_t>::min());
+	last.pair = DBPair(id,numeric_limits<int32_t>::max());
+	DBData deleted_d(DBType::BOOLEAN);
+	deleted_d.boolean = true;
+	// the rows go in one operation, not one log sync each
+	vector<RecordHandle> rows;
+	for (RecordHandle tweet : db->rangeQuery("tweets","publisher_time",first,last))
+		for (RecordHandle handle : homeRow(db,uid,tweet,db->get(tweet,"time").int32))
+			if (db->get(handle,"deleted").boolean == false)
+				rows.push_back(handle);
+	db->modifyBatch(rows,"deleted",deleted_d);
+}
+
+}
+
 namespace TweetOp {
 
+void prepareHomeTimelines(NaiveDB *db) {
+	if (!db->hasTable("hometl"))
+		return;
+	DBData mark_d(DBType::INT64);
+	mark_d.int64 = homeSlot(kFilledOwner,0);
+	if (!db->query("hometl","slot",mark_d).empty())
+		return; // filled already
+	// a fill cut short left some of the rows in, they are looked up so
+	// that none goes in twice
+	bool resumed = db->lastId("hometl") != 0;
+	DBData first(DBType::INT64), last(DBType::INT64);
+	first.int64 = 1;
+	last.int64 = numeric_limits<int64_t>::max();
+	unordered_map<int64_t, vector<int64_t> > owners_of;
+	vector<vector<DBData> > lines;
+	for (RecordHandle tweet : db->rangeQuery("tweets","id",first,last)) {
+		if (db->get(tweet,"deleted").boolean)
+			continue;
+		int64_t publisher = db->get(tweet,"publisher").int64;
+		int32_t time = db->get(tweet,"time").int32;
+		if (owners_of.count(publisher) == 0) {
+			owners_of[publisher] = followers(db,publisher);
+			owners_of[publisher].push_back(publisher);
+		}
+		for (int64_t owner : owners_of[publisher])
+			if (!resumed || homeRow(db,owner,tweet,time).empty())
+				lines.push_back(homeLine(owner,publisher,tweet,time));
+	}
+	db->insertBatch("hometl",lines);
+	// the mark goes in once every row is in, deleted so that no timeline
+	// shows it
+	vector<DBData> mark = homeLine(kFilledOwner,kFilledOwner,RecordHandle("tweets",0),0);
+	mark.back().boolean = true;
+	db->insert("hometl",mark);
+}
+
 bool userExist(NaiveDB *db, const char *user) {
 	DBData user_d;
 	user_d.type = DBType::STRING;
@@ -58,22 +211,30 @@ void registerAccount(NaiveDB *db, const char *user,
 	line.push_back(gender_d);
 	intro_d.str = intro;
 	line.push_back(intro_d);
+	DBData deleted_d(DBType::BOOLEAN);
+	deleted_d.boolean = false;
+	line.push_back(deleted_d);
 	db->insert("userinfo",line);
 }
 
+bool isFollowing(NaiveDB *db, int64_t uid, int64_t id) {
+	for (RecordHandle handle : edge(db,uid,id))
+		if (db->get(handle,"deleted").boolean == false)
+			return true;
+	return false;
+}
+
 void follow(NaiveDB *db, int64_t uid, int64_t id) {
-	DBData uid_d(DBType::INT64);
-	uid_d.int64 = uid;
-	vector<RecordHandle> query_res = db->query("afob","a",uid_d);
+	vector<RecordHandle> query_res = edge(db,uid,id);
 	bool deleted = false;
 	for (RecordHandle handle : query_res) {
-		if (db->get(handle,"b").int64 == id) {
-			deleted = true;
-			DBData tmp(DBType::BOOLEAN);
-			tmp.boolean = false;
-			db->modify(handle,"deleted",tmp);
-			break;
-		}
+		deleted = true;
+		if (db->get(handle,"deleted").boolean == false)
+			return; // following already
+		DBData tmp(DBType::BOOLEAN);
+		tmp.boolean = false;
+		db->modify(handle,"deleted",tmp);
+		break;
 	}
 
 	if (!deleted) {
@@ -88,19 +249,18 @@ void follow(NaiveDB *db, int64_t uid, int64_t id) {
 		line.push_back(dbd); // deleted
 		db->insert("afob",line);
 	}
+	backfill(db,uid,id);
 }
 
 void unfollow(NaiveDB *db, int64_t uid, int64_t id) {
-	DBData uid_d(DBType::INT64);
-	uid_d.int64 = uid;
-	vector<RecordHandle> query_res = db->query("afob","a",uid_d);
-	for (RecordHandle handle : query_res) {
-		if (db->get(handle,"b").int64 == id) {
-			DBData tmp(DBType::BOOLEAN);
-			tmp.boolean = true;
-			db->modify(handle,"deleted",tmp);
-			break;
-		}
+	for (RecordHandle handle : edge(db,uid,id)) {
+		if (db->get(handle,"deleted").boolean)
+			return; // not following
+		DBData tmp(DBType::BOOLEAN);
+		tmp.boolean = true;
+		db->modify(handle,"deleted",tmp);
+		prune(db,uid,id);
+		break;
 	}
 }
 
@@ -122,7 +282,8 @@ void retweet(NaiveDB *db, int64_t uid, const TweetLine &tweet) {
 	dbd.boolean = false;
 	dbline.push_back(dbd); // deleted
 
-	db->insert("tweets",dbline);
+	RecordHandle handle = db->insert("tweets",dbline);
+	fanOut(db,uid,handle,unix_time);
 }
 
 void newTweet(NaiveDB *db, int64_t uid, const char *content) {
@@ -142,7 +303,8 @@ void newTweet(NaiveDB *db, int64_t uid, const char *content) {
 	dbd.boolean = false;
 	dbline.push_back(dbd); // deleted
 
-	db->insert("tweets",dbline);
+	RecordHandle handle = db->insert("tweets",dbline);
+	fanOut(db,uid,handle,unix_time);
 }
 
 }
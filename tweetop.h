@@ -1,6 +1,8 @@
 #ifndef TWEETOP_H
 #define TWEETOP_H
 
+#include <cassert>
+#include <limits>
 #include <string>
 #include <vector>
 #include "naivedb.h"
@@ -21,11 +23,34 @@ public:
 };
 
 inline bool operator<(const TweetLine &lval,const TweetLine &rval) {
-	return lval.time >= rval.time;
+	// newer tweets first
+	return lval.time > rval.time;
 }
 
 namespace TweetOp {
 
+// Home timelines
+// With a hometl table in the schema the home timeline of every user is
+// kept materialized: a new tweet is pushed to the timelines of the
+// publisher and of their followers, follow and unfollow backfill and
+// prune. The rows are indexed by homeSlot(owner,time), so a timeline is
+// one rangeQuery on slot, sorted by time. The slots of uid run from
+// homeSlot(uid,0) to homeSlot(uid,kLastHomeTime), uid takes the high 31
+// bits and time the low 31, so neither may be negative.
+const int32_t kLastHomeTime = std::numeric_limits<int32_t>::max();
+
+inline int64_t homeSlot(int64_t uid, int32_t time) {
+	assert(uid >= 0 && uid <= std::numeric_limits<int32_t>::max());
+	assert(time >= 0);
+	return (uid << 32) | time;
+}
+
+// prepareHomeTimelines(...) fills hometl from the tweets when it has just
+// been added to the schema, call it once after opening the database; a
+// row put in last marks the fill done, one cut short is finished by the
+// next call
+void prepareHomeTimelines(NaiveDB *db);
+
 // userExist(...) note that it returns true even when user is deleted
 // it's not a bug
 bool userExist(NaiveDB *db, const char *user);
@@ -43,6 +68,9 @@ void registerAccount(NaiveDB *db,const char *user,
 					 const char *gender,
 					 const char *intro);
 
+// isFollowing(...) true when uid follows id
+bool isFollowing(NaiveDB *db, int64_t uid, int64_t id);
+
 // follow(...) make uid follow id
 void follow(NaiveDB *db, int64_t uid, int64_t id);
 
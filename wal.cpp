@@ -0,0 +1,191 @@
+#include "wal.h"
+#include <cassert>
+#include <unordered_map>
+
+using namespace std;
+
+namespace {
+
+// FNV-1a, good enough to tell a torn tail from a complete operation
+uint32_t checksum(const char *data, size_t length) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i != length; ++i) {
+		hash ^= (unsigned char)data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+struct WriteRecord {
+	string filename;
+	FilePos pos;
+	const char *data;
+	uint32_t length;
+};
+
+// decode a WRITE record at src, return nullptr if it runs past end
+const char* parseWrite(const char *src, const char *end, WriteRecord &record) {
+	uint16_t namelen;
+	if (end - src < 1 + (ptrdiff_t)sizeof(namelen))
+		return nullptr;
+	src = block_read(src + 1,namelen);
+	if (end - src < namelen + (ptrdiff_t)(sizeof(FilePos) + sizeof(uint32_t)))
+		return nullptr;
+	record.filename.assign(src,namelen);
+	src += namelen;
+	src = block_read(src,record.pos);
+	src = block_read(src,record.length);
+	if (end - src < (ptrdiff_t)record.length)
+		return nullptr;
+	record.data = src;
+	return src + record.length;
+}
+
+} // namespace
+
+Wal::Wal(const string &filename)
+	: file_(filename), committed_lsn_(0), durable_lsn_(0), syncing_(false)
+{
+	size_ = file_.size();
+}
+
+Wal::~Wal() {
+	sync();
+}
+
+void Wal::replay() {
+	vector<char> log(size_);
+	file_.read(0,log.data(),log.size());
+	const char *src = log.data();
+	const char *end = src + log.size();
+	const char *group = src; // first record of the current operation
+	vector<WriteRecord> writes;
+	unordered_map<string, PosFile*> files;
+	while (src < end) {
+		if (*src == WRITE) {
+			WriteRecord record;
+			src = parseWrite(src,end,record);
+			if (src == nullptr)
+				break; // torn tail
+			writes.push_back(record);
+		} else if (*src == COMMIT && end - src >= 1 + (ptrdiff_t)sizeof(uint32_t)) {
+			uint32_t sum;
+			block_read(src + 1,sum);
+			if (sum != checksum(group,src - group))
+				break; // torn tail
+			// the operation is complete, redo it
+			for (WriteRecord &record : writes) {
+				PosFile *&file = files[record.filename];
+				if (file == nullptr)
+					file = new PosFile(record.filename);
+				file->write(record.pos,record.data,record.length);
+			}
+			writes.clear();
+			src += 1 + sizeof(uint32_t);
+			group = src;
+		} else
+			break; // garbage, or a torn commit record
+	}
+	for (auto &iter : files) {
+		iter.second->sync();
+		delete iter.second;
+	}
+	truncate();
+}
+
+void Wal::append(const string &filename, FilePos pos, const void *data, size_t length) {
+	uint16_t namelen = filename.size();
+	uint32_t datalen = length;
+	size_t offset = pending_.size();
+	pending_.resize(offset + 1 + sizeof(namelen) + namelen +
+					sizeof(pos) + sizeof(datalen) + length);
+	char *dest = pending_.data() + offset;
+	*dest++ = WRITE;
+	dest = block_write(dest,namelen);
+	memcpy(dest,filename.data(),namelen);
+	dest += namelen;
+	dest = block_write(dest,pos);
+	dest = block_write(dest,datalen);
+	memcpy(dest,data,length);
+}
+
+void Wal::afterDurable(const function<void()> &action) {
+	pending_actions_.push_back(action);
+}
+
+void Wal::applyDurable() {
+	uint64_t lsn;
+	{
+		lock_guard<mutex> lock(mutex_);
+		lsn = durable_lsn_;
+	}
+	while (!durable_actions_.empty() && durable_actions_.front().first <= lsn) {
+		durable_actions_.front().second();
+		durable_actions_.pop_front();
+	}
+}
+
+uint64_t Wal::commit() {
+	uint32_t sum = checksum(pending_.data(),pending_.size());
+	pending_.push_back(COMMIT);
+	pending_.resize(pending_.size() + sizeof(sum));
+	block_write(pending_.data() + pending_.size() - sizeof(sum),sum);
+	uint64_t lsn;
+	{
+		lock_guard<mutex> lock(mutex_);
+		buffer_.insert(buffer_.end(),pending_.begin(),pending_.end());
+		lsn = ++committed_lsn_;
+	}
+	pending_.clear();
+	for (auto &action : pending_actions_)
+		durable_actions_.push_back(make_pair(lsn,action));
+	pending_actions_.clear();
+	return lsn;
+}
+
+void Wal::waitDurable(uint64_t lsn) {
+	unique_lock<mutex> lock(mutex_);
+	while (durable_lsn_ < lsn) {
+		if (syncing_) {
+			// somebody else is syncing, our records may be in the next batch
+			synced_.wait(lock);
+			continue;
+		}
+		// lead a sync of everything committed so far
+		syncing_ = true;
+		vector<char> batch;
+		batch.swap(buffer_);
+		uint64_t target = committed_lsn_;
+		FilePos pos = size_;
+		size_ += batch.size();
+		lock.unlock();
+		file_.write(pos,batch.data(),batch.size());
+		file_.sync();
+		lock.lock();
+		durable_lsn_ = target;
+		syncing_ = false;
+		synced_.notify_all();
+	}
+}
+
+void Wal::sync() {
+	uint64_t lsn;
+	{
+		lock_guard<mutex> lock(mutex_);
+		lsn = committed_lsn_;
+	}
+	waitDurable(lsn);
+}
+
+void Wal::truncate() {
+	sync();
+	lock_guard<mutex> lock(mutex_);
+	file_.resize(0);
+	file_.sync();
+	size_ = 0;
+}
+
+FilePos Wal::size() {
+	lock_guard<mutex> lock(mutex_);
+	return size_ + buffer_.size();
+}
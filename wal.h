@@ -0,0 +1,94 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "diskfile.h"
+#include "kikutil.h"
+
+/*
+ * Write-ahead log
+ * ----------------
+ * A redo-only log of physical writes. Every mutation of the database
+ * appends the bytes it changed in .dat and .idx files (filename,
+ * position, data) followed by a commit record, so the data files
+ * themselves need not be synced on every change.
+ *
+ * Group commit: commit() only queues the records of an operation.
+ * waitDurable() writes out everything queued so far with a single
+ * fdatasync, callers arriving while a sync is running wait for it and
+ * are served together by the next one.
+ *
+ * Log record layout:
+ *   WRITE  : type(1) namelen(2) name pos(8) length(4) data
+ *   COMMIT : type(1) checksum(4), checksum covers the records of the
+ *            operation, so a torn tail is detected and ignored
+ *
+ * Nothing a logged operation changed may reach a data file before the
+ * operation is durable. Owners hold such changes back (pages pinned in
+ * the buffer pool, writes kept in memory) and let go of them in an
+ * afterDurable(...) action. applyDurable() runs the actions of the
+ * operations that are durable by then, it never waits for a sync, so it
+ * can run under the lock that serializes the operations.
+ */
+
+class Wal {
+	DISALLOW_COPY_AND_ASSIGN(Wal);
+public:
+	enum RecordType {
+		WRITE = 1, COMMIT = 2
+	};
+
+	// opens filename for appending, creating an empty log if needed
+	explicit Wal(const std::string &filename);
+	~Wal();
+
+	// redo every committed operation in the log into the data files and
+	// empty the log, call it before the data files are opened
+	void replay();
+
+	// queue a write of the running operation
+	void append(const std::string &filename, FilePos pos, const void *data, size_t length);
+	// run action from a call of applyDurable() once the running
+	// operation is durable, for changes that must not hit the disk ahead
+	// of the log
+	void afterDurable(const std::function<void()> &action);
+	// run the actions of every durable operation, in the order of the
+	// operations, guarded by the caller like append(...)
+	void applyDurable();
+	// seal the running operation and return its log sequence number
+	uint64_t commit();
+
+	// block until operation lsn is on disk
+	void waitDurable(uint64_t lsn);
+	// make every committed operation durable
+	void sync();
+	// empty the log, only once every action is applied and every data
+	// file is synced
+	void truncate();
+
+	FilePos size();
+private:
+	PosFile file_;
+	std::mutex mutex_;
+	std::condition_variable synced_;
+	// records of the running operation, guarded by the caller
+	std::vector<char> pending_;
+	// actions of the running operation, then of committed operations
+	// waiting to be durable, by lsn
+	std::vector<std::function<void()> > pending_actions_;
+	std::deque<std::pair<uint64_t, std::function<void()> > > durable_actions_;
+	// committed records not written to the log file yet
+	std::vector<char> buffer_;
+	uint64_t committed_lsn_;
+	uint64_t durable_lsn_;
+	bool syncing_;
+	FilePos size_;
+};
+
+#endif // WAL_H